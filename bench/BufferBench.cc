@@ -0,0 +1,121 @@
+#include <benchmark/benchmark.h>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+#include "Buffer.hpp"
+#include "OpticalPacket.hpp"
+#include "Payloads.hpp"
+
+/** The Buffer from before it was lock-free: a deque behind the mutex SerialHandler used for every packet type. */
+class MutexDequeBuffer {
+    std::deque<Packet> data;
+    std::mutex mutex;
+
+public:
+    void add(const Packet& packet) {
+        mutex.lock();
+        if (this->data.size() >= Buffer::CAPACITY)
+            this->data.pop_front();
+        this->data.push_back(packet);
+        mutex.unlock();
+    }
+
+    std::optional<Packet> pop_latest() {
+        mutex.lock();
+        if (this->data.empty()) {
+            mutex.unlock();
+            return std::nullopt;
+        }
+        Packet packet = std::move(this->data.back());
+        this->data.pop_back();
+        mutex.unlock();
+        return packet;
+    }
+};
+
+/** Gives the benchmark access to Buffer's private add, the same way SerialHandler uses it. */
+class BufferBench {
+public:
+    static void add(Buffer& buffer, const Packet& packet) {
+        buffer.add(packet);
+    }
+};
+
+static void add(Buffer& buffer, const Packet& packet) {
+    BufferBench::add(buffer, packet);
+}
+
+static void add(MutexDequeBuffer& buffer, const Packet& packet) {
+    buffer.add(packet);
+}
+
+/**
+ * Thread 0 acts as the receive thread and adds optical packets as fast as it can, while every other thread pops them.
+ * Reports items processed per thread, so the producer's rate shows how much the consumers slow it down.
+ */
+template <typename T>
+static void BM_BufferContention(benchmark::State& state) {
+    static T* buffer;
+    if (state.thread_index() == 0)
+        buffer = new T;
+    const OpticalPacket packet{1, 2, 3};
+
+    for (auto _ : state) {
+        if (state.thread_index() == 0) {
+            add(*buffer, packet);
+        }
+        else {
+            benchmark::DoNotOptimize(buffer->pop_latest());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        delete buffer;
+        buffer = nullptr;
+    }
+}
+BENCHMARK(BM_BufferContention<Buffer>)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_BufferContention<MutexDequeBuffer>)->ThreadRange(1, 8)->UseRealTime();
+
+/** A single thread adding a packet and popping it straight back, over payload sizes. */
+static void BM_BufferAddPop(benchmark::State& state) {
+    Buffer buffer;
+    const auto payload = make_payload(state.range(0), 10);
+    const Packet packet{Header{PacketIds::TEXT}, payload.data(), payload.size()};
+    for (auto _ : state) {
+        add(buffer, packet);
+        benchmark::DoNotOptimize(buffer.pop_latest());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * packet.serialized_size()));
+}
+BENCHMARK(BM_BufferAddPop)->Apply(payload_size_args);
+
+/**
+ * Taking every queued optical packet in order, either one pop_oldest at a time (0) or with one drain (1). The queue
+ * is refilled with the timer paused.
+ */
+static void BM_BufferDrain(benchmark::State& state) {
+    Buffer buffer;
+    const bool batch = state.range(0);
+    const OpticalPacket packet{1, 2, 3};
+    std::vector<Packet> packets;
+    packets.reserve(Buffer::CAPACITY);
+    for (auto _ : state) {
+        state.PauseTiming();
+        packets.clear();
+        for (size_t i = 0; i < Buffer::CAPACITY; i++) add(buffer, packet);
+        state.ResumeTiming();
+
+        if (batch) {
+            buffer.drain(std::back_inserter(packets));
+        } else {
+            while (std::optional<Packet> popped = buffer.pop_oldest()) packets.push_back(std::move(*popped));
+        }
+        benchmark::DoNotOptimize(packets.data());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * Buffer::CAPACITY));
+}
+BENCHMARK(BM_BufferDrain)->ArgName("batch")->Arg(0)->Arg(1);
@@ -0,0 +1,123 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+
+#include "CobsDecoder.hpp"
+#include "Payloads.hpp"
+#include "TextPacket.hpp"
+#include "Utils.hpp"
+#include "ZeroScan.hpp"
+
+/** The kinds of payloads benchmarked. Real TextPackets are mostly text, or mostly zero padding after a short message. */
+enum Payload {
+    TEXT,
+    SPARSE,
+};
+
+/** @returns A serialized 1 KiB TextPacket, the largest frame we send. */
+static std::vector<uint8_t> make_text_frame(const Payload payload) {
+    std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE> text{};
+    if (payload == TEXT) {
+        for (size_t i = 0; i < text.size(); i++) text[i] = static_cast<char>('a' + i % 26);
+    }
+    else {
+        constexpr char message[] = "odometry reset";
+        std::memcpy(text.data(), message, sizeof(message));
+    }
+    return TextPacket{text}.serialize();
+}
+
+static void set_label(benchmark::State& state, const Payload payload) {
+    state.SetLabel(std::string{payload == TEXT ? "text" : "sparse"} + "/" + ZeroScan::kernel_name());
+}
+
+static void BM_CobsEncode(benchmark::State& state) {
+    const auto frame = make_text_frame(static_cast<Payload>(state.range(0)));
+    std::vector<uint8_t> encoded(Utils::cobs_max_encoded_size(frame.size()));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Utils::cobs_encode(std::span<const uint8_t>{frame}, encoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+    set_label(state, static_cast<Payload>(state.range(0)));
+}
+BENCHMARK(BM_CobsEncode)->Arg(TEXT)->Arg(SPARSE);
+
+static void BM_CobsEncodeReference(benchmark::State& state) {
+    const auto frame = make_text_frame(static_cast<Payload>(state.range(0)));
+    std::vector<uint8_t> encoded(Utils::cobs_max_encoded_size(frame.size()));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Utils::cobs_encode_reference(std::span<const uint8_t>{frame}, encoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+    set_label(state, static_cast<Payload>(state.range(0)));
+}
+BENCHMARK(BM_CobsEncodeReference)->Arg(TEXT)->Arg(SPARSE);
+
+static void BM_CobsDecode(benchmark::State& state) {
+    const auto frame = make_text_frame(static_cast<Payload>(state.range(0)));
+    auto encoded = *Utils::cobs_encode(frame);
+    encoded.pop_back(); // remove null delimiter
+    std::vector<uint8_t> decoded(encoded.size());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Utils::cobs_decode(std::span<const uint8_t>{encoded}, decoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+    set_label(state, static_cast<Payload>(state.range(0)));
+}
+BENCHMARK(BM_CobsDecode)->Arg(TEXT)->Arg(SPARSE);
+
+static void BM_CobsDecodeReference(benchmark::State& state) {
+    const auto frame = make_text_frame(static_cast<Payload>(state.range(0)));
+    auto encoded = *Utils::cobs_encode(frame);
+    encoded.pop_back(); // remove null delimiter
+    std::vector<uint8_t> decoded(encoded.size());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Utils::cobs_decode_reference(std::span<const uint8_t>{encoded}, decoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+    set_label(state, static_cast<Payload>(state.range(0)));
+}
+BENCHMARK(BM_CobsDecodeReference)->Arg(TEXT)->Arg(SPARSE);
+
+static void BM_CobsEncodePayload(benchmark::State& state) {
+    const auto frame = make_frame(state.range(0), state.range(1));
+    std::vector<uint8_t> encoded(Utils::cobs_max_encoded_size(frame.size()));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Utils::cobs_encode(std::span<const uint8_t>{frame}, encoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+    state.SetLabel(ZeroScan::kernel_name());
+}
+BENCHMARK(BM_CobsEncodePayload)->Apply(payload_args);
+
+static void BM_CobsDecodePayload(benchmark::State& state) {
+    const auto frame = make_frame(state.range(0), state.range(1));
+    auto encoded = *Utils::cobs_encode(frame);
+    encoded.pop_back(); // remove null delimiter
+    std::vector<uint8_t> decoded(encoded.size());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Utils::cobs_decode(std::span<const uint8_t>{encoded}, decoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+    state.SetLabel(ZeroScan::kernel_name());
+}
+BENCHMARK(BM_CobsDecodePayload)->Apply(payload_args);
+
+/** Feeds whole encoded frames, delimiter included, to the streaming decoder the way SerialHandler receives them. */
+static void BM_CobsDecoderFeed(benchmark::State& state) {
+    const auto frame = make_frame(state.range(0), state.range(1));
+    const auto encoded = *Utils::cobs_encode(frame);
+    std::vector<uint8_t> output(frame.size() + 1);
+    CobsDecoder decoder{output};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(decoder.feed(encoded));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+}
+BENCHMARK(BM_CobsDecoderFeed)->Apply(payload_args);
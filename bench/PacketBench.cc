@@ -0,0 +1,100 @@
+#include <benchmark/benchmark.h>
+
+#include "CompactOptical.hpp"
+#include "Fragmentation.hpp"
+#include "OpticalPacket.hpp"
+#include "PacketView.hpp"
+#include "Payloads.hpp"
+
+/** @returns A packet with a payload of the size, like one made from received bytes. */
+static Packet make_packet(const size_t size) {
+    const auto payload = make_payload(size, 10);
+    return Packet{Header{PacketIds::TEXT}, payload.data(), payload.size()};
+}
+
+/** Copying bytes into a packet. Payloads over Packet::INLINE_DATA_SIZE have to allocate. */
+static void BM_PacketConstruct(benchmark::State& state) {
+    const auto payload = make_payload(state.range(0), 10);
+    for (auto _ : state) {
+        Packet packet{Header{PacketIds::TEXT}, payload.data(), payload.size()};
+        benchmark::DoNotOptimize(packet);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * payload.size()));
+}
+BENCHMARK(BM_PacketConstruct)->Apply(payload_size_args);
+
+static void BM_PacketSerialize(benchmark::State& state) {
+    const Packet packet = make_packet(state.range(0));
+    std::array<uint8_t, SerialHandler::MAX_PACKET_SIZE> output;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.serialize(output));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * packet.serialized_size()));
+}
+BENCHMARK(BM_PacketSerialize)->Apply(payload_size_args);
+
+/** The allocating serialize, kept for comparison with the span one above. */
+static void BM_PacketSerializeVector(benchmark::State& state) {
+    const Packet packet = make_packet(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.serialize());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * packet.serialized_size()));
+}
+BENCHMARK(BM_PacketSerializeVector)->Apply(payload_size_args);
+
+static void BM_PacketGetData(benchmark::State& state) {
+    const Packet packet = OpticalPacket{1, 2, 3};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.get_data<OpticalPacket>());
+    }
+}
+BENCHMARK(BM_PacketGetData);
+
+/** Reading one field straight from received bytes, which is what a PacketView listener does instead of get_data. */
+static void BM_PacketViewGet(benchmark::State& state) {
+    const auto frame = OpticalPacket{1, 2, 3}.serialize();
+    const PacketView<OpticalPacket> view{frame};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(view.get<&OpticalPacket::Data::heading>());
+    }
+}
+BENCHMARK(BM_PacketViewGet);
+
+/**
+ * Encoding a moving optical sample as compact packets, with the keyframe interval as the argument. The wire_bytes
+ * counter is the average encoded frame size per sample, to compare with the full OpticalPacket's.
+ */
+static void BM_CompactOpticalEncode(benchmark::State& state) {
+    CompactOpticalEncoder encoder{{.keyframe_interval = static_cast<uint16_t>(state.range(0))}};
+    std::array<uint8_t, SerialHandler::MAX_ENCODED_PACKET_SIZE> encoded;
+    double x = 0;
+    size_t wire_bytes = 0;
+    for (auto _ : state) {
+        x += 0.01;
+        const Packet packet = encoder.encode({x, x / 2, x / 100});
+        std::array<uint8_t, SerialHandler::MAX_PACKET_SIZE> bytes;
+        const size_t length = packet.serialize(bytes);
+        wire_bytes += *Utils::cobs_encode(std::span{bytes.data(), length}, encoded);
+    }
+    state.counters["wire_bytes"] = benchmark::Counter(static_cast<double>(wire_bytes), benchmark::Counter::kAvgIterations);
+    state.counters["optical_wire_bytes"] = static_cast<double>(Utils::cobs_encode(OpticalPacket{x, x / 2, x / 100}.serialize())->size());
+}
+BENCHMARK(BM_CompactOpticalEncode)->ArgName("keyframe_interval")->Arg(1)->Arg(10)->Arg(100);
+
+/** Splitting a message into fragments and putting it back together, with the message size as the argument. */
+static void BM_FragmentRoundTrip(benchmark::State& state) {
+    const auto message = make_payload(state.range(0), 10);
+    Fragmenter fragmenter;
+    Reassembler reassembler;
+    for (auto _ : state) {
+        fragmenter.split(message, [&reassembler](const FragmentPacket& fragment) {
+            std::array<uint8_t, SerialHandler::MAX_PACKET_SIZE> bytes;
+            const size_t length = fragment.serialize(bytes);
+            benchmark::DoNotOptimize(reassembler.add(std::span{bytes.data(), length}, 0));
+        });
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * message.size()));
+}
+BENCHMARK(BM_FragmentRoundTrip)->Arg(1024)->Arg(Reassembler::MAX_MESSAGE_SIZE);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "SerialHandler.hpp"
+
+/** Data sizes in bytes that every size parameterized benchmark runs: empty, an OpticalPacket, medium, and the largest. */
+static const std::vector<int64_t> PAYLOAD_SIZES{0, 24, 256, static_cast<int64_t>(SerialHandler::MAX_PACKET_DATA_SIZE)};
+/** Percentages of zero bytes in a payload. Zeros are what cobs has to remove, so they change how fast it runs. */
+static const std::vector<int64_t> ZERO_DENSITIES{0, 10, 50, 100};
+
+/**
+ * @returns The same bytes every time for the size and density, so results can be compared between commits.
+ * @param zero_percent Roughly how many of the bytes are 0, from 0 to 100.
+ */
+inline std::vector<uint8_t> make_payload(const size_t size, const int64_t zero_percent) {
+    std::vector<uint8_t> bytes(size);
+    uint32_t random = 0x12345678;
+    for (uint8_t& byte : bytes) {
+        // A small linear congruential generator, since std distributions differ between standard libraries
+        random = random * 1664525 + 1013904223;
+        const bool zero = static_cast<int64_t>((random >> 8) % 100) < zero_percent;
+        byte = zero ? 0 : static_cast<uint8_t>(1 + (random >> 24) % 255);
+    }
+    return bytes;
+}
+
+/** @returns A serialized packet with a payload from make_payload, which is what gets cobs encoded when it is sent. */
+inline std::vector<uint8_t> make_frame(const size_t size, const int64_t zero_percent) {
+    const auto payload = make_payload(size, zero_percent);
+    return Packet{Header{PacketIds::TEXT}, payload.data(), payload.size()}.serialize();
+}
+
+/** Runs a benchmark for every payload size and zero density. state.range(0) is the size and state.range(1) the density. */
+inline void payload_args(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"size", "zeros"})->ArgsProduct({PAYLOAD_SIZES, ZERO_DENSITIES});
+}
+
+/** Runs a benchmark for every payload size. state.range(0) is the size. */
+inline void payload_size_args(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgName("size")->ArgsProduct({PAYLOAD_SIZES});
+}
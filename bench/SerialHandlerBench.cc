@@ -0,0 +1,94 @@
+#include <benchmark/benchmark.h>
+
+#include "InitializeAuxPacket.hpp"
+#include "LoopbackTransport.hpp"
+#include "OpticalPacket.hpp"
+#include "TextPacket.hpp"
+
+/** Gives the benchmarks access to SerialHandler's private receive path, without going through a read. */
+class SerialHandlerBench {
+public:
+    static void decode_packet(SerialHandler& handler, const std::span<const uint8_t> frame) {
+        handler.decode_packet(frame);
+    }
+
+    static size_t decode_all(SerialHandler& handler, const std::span<const uint8_t> bytes) {
+        return handler.decode_all(bytes);
+    }
+};
+
+/** @returns A handler shared by every benchmark. It is on a loopback, so it runs without a Brain plugged in. */
+static SerialHandler& shared_handler() {
+    static auto transports = LoopbackTransport::pair();
+    static SerialHandler handler{transports.first};
+    return handler;
+}
+
+/** Adds a listener that does almost nothing, so only the cost of calling it is measured. */
+template <typename T>
+static void add_reading_listener(SerialHandler& handler) {
+    handler.add_listener<T>([](SerialHandler&, const PacketView<T> view) {
+        benchmark::DoNotOptimize(view.data_bytes().size());
+    });
+}
+
+/** The packet types decode_packet is run on, from no data up to the largest packet. */
+enum Kind {
+    EMPTY,
+    OPTICAL,
+    TEXT,
+};
+
+/** Handling one decoded frame: checking it, storing it in its buffer, and running the listener if there is one. */
+static void BM_DecodePacket(benchmark::State& state) {
+    SerialHandler& handler = shared_handler();
+    const auto kind = static_cast<Kind>(state.range(0));
+    const bool listener = state.range(1);
+    std::vector<uint8_t> frame;
+    switch (kind) {
+        case EMPTY:
+            frame = InitializeAuxPacket{}.serialize();
+            if (listener) add_reading_listener<InitializeAuxPacket>(handler);
+            break;
+        case OPTICAL:
+            frame = OpticalPacket{1, 2, 3}.serialize();
+            if (listener) add_reading_listener<OpticalPacket>(handler);
+            break;
+        case TEXT:
+            frame = TextPacket{{'h', 'i'}}.serialize();
+            if (listener) add_reading_listener<TextPacket>(handler);
+            break;
+    }
+
+    for (auto _ : state) {
+        SerialHandlerBench::decode_packet(handler, frame);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+
+    handler.remove_listener<InitializeAuxPacket>();
+    handler.remove_listener<OpticalPacket>();
+    handler.remove_listener<TextPacket>();
+}
+BENCHMARK(BM_DecodePacket)->ArgNames({"kind", "listener"})->ArgsProduct({{EMPTY, OPTICAL, TEXT}, {0, 1}});
+
+/** Decoding a full read of back to back optical frames, which is what receive_all does with each read. */
+static void BM_DecodeAll(benchmark::State& state) {
+    SerialHandler& handler = shared_handler();
+    const auto frame = *Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    std::vector<uint8_t> read;
+    while (read.size() + frame.size() <= SerialHandler::MAX_LIBUSB_PACKET_SIZE) {
+        read.insert(read.end(), frame.begin(), frame.end());
+    }
+    if (state.range(0))
+        add_reading_listener<OpticalPacket>(handler);
+
+    size_t packets = 0;
+    for (auto _ : state) {
+        packets += SerialHandlerBench::decode_all(handler, read);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(packets));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * read.size()));
+
+    handler.remove_listener<OpticalPacket>();
+}
+BENCHMARK(BM_DecodeAll)->ArgName("listener")->Arg(0)->Arg(1);
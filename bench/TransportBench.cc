@@ -0,0 +1,137 @@
+#include <benchmark/benchmark.h>
+#include <memory>
+
+#include "CaptureTransport.hpp"
+#include "FdTransport.hpp"
+#include "LoopbackTransport.hpp"
+#include "OpticalPacket.hpp"
+#include "ReplayTransport.hpp"
+#include "SerialHandler.hpp"
+
+/** The transports a Brain handler and a PI handler are connected by. */
+enum Link {
+    LOOPBACK,
+    SOCKET_PAIR,
+    PTY,
+};
+
+/** Owns both ends of a link, however they were made. */
+struct LinkPair {
+    std::unique_ptr<Transport> brain;
+    std::unique_ptr<Transport> pi;
+};
+
+static LinkPair make_link(const Link link) {
+    if (link == LOOPBACK) {
+        auto [brain, pi] = LoopbackTransport::pair();
+        return {std::make_unique<LoopbackTransport>(std::move(brain)), std::make_unique<LoopbackTransport>(std::move(pi))};
+    }
+    auto pair = link == SOCKET_PAIR ? FdTransport::socket_pair() : FdTransport::pty();
+    if (!pair.has_value())
+        return {};
+    return {std::make_unique<FdTransport>(std::move(pair->first)), std::make_unique<FdTransport>(std::move(pair->second))};
+}
+
+static const char* link_name(const Link link) {
+    switch (link) {
+        case LOOPBACK: return "loopback";
+        case SOCKET_PAIR: return "socketpair";
+        case PTY: return "pty";
+    }
+    return "";
+}
+
+/**
+ * One packet from a Brain handler to a PI handler and back, through real encoding, framing and decoding on both
+ * sides. The time per iteration is the round trip latency.
+ */
+static void BM_EndToEndRoundTrip(benchmark::State& state) {
+    const auto link = static_cast<Link>(state.range(0));
+    LinkPair pair = make_link(link);
+    if (!pair.brain) {
+        state.SkipWithError("could not make the link");
+        return;
+    }
+    SerialHandler brain{*pair.brain};
+    SerialHandler pi{*pair.pi};
+    const OpticalPacket packet{1, 2, 3};
+
+    for (auto _ : state) {
+        brain.send(packet);
+        pi.receive();
+        pi.send(*pi.pop_latest<OpticalPacket>());
+        brain.receive();
+        benchmark::DoNotOptimize(brain.pop_latest<OpticalPacket>());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * 2));
+    state.SetLabel(link_name(link));
+}
+BENCHMARK(BM_EndToEndRoundTrip)->ArgName("link")->Arg(LOOPBACK)->Arg(SOCKET_PAIR)->Arg(PTY);
+
+/** Bursts of packets sent from the Brain handler, all received by the PI handler. Reports packets and bytes per second. */
+static void BM_EndToEndThroughput(benchmark::State& state) {
+    const auto link = static_cast<Link>(state.range(0));
+    const auto burst = static_cast<size_t>(state.range(1));
+    LinkPair pair = make_link(link);
+    if (!pair.brain) {
+        state.SkipWithError("could not make the link");
+        return;
+    }
+    SerialHandler brain{*pair.brain};
+    SerialHandler pi{*pair.pi};
+    const OpticalPacket packet{1, 2, 3};
+    const size_t frame_size = Utils::cobs_encode(packet.serialize())->size();
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < burst; i++) {
+            brain.send_buffered(packet);
+        }
+        brain.flush();
+        size_t received = 0;
+        while (received < burst) {
+            received += pi.receive_all();
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * burst));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * burst * frame_size));
+    state.SetLabel(link_name(link));
+}
+BENCHMARK(BM_EndToEndThroughput)->ArgNames({"link", "burst"})->ArgsProduct({{LOOPBACK, SOCKET_PAIR, PTY}, {1, 32}});
+
+/**
+ * Decoding a captured burst of packets replayed as fast as possible, with the burst size as the argument. This is the
+ * decoder's speed on real chunk boundaries with no link in the way.
+ */
+static void BM_ReplayDecode(benchmark::State& state) {
+    const auto burst = static_cast<size_t>(state.range(0));
+    const std::string path = "/tmp/replay_decode_bench.cap";
+    {
+        auto [brain_side, pi_side] = LoopbackTransport::pair();
+        CaptureTransport capture{pi_side, path.c_str()};
+        SerialHandler brain{brain_side};
+        SerialHandler pi{capture};
+        for (size_t i = 0; i < burst; i++) {
+            brain.send_buffered(OpticalPacket{1, 2, 3});
+        }
+        brain.flush();
+        size_t received = 0;
+        while (received < burst) {
+            received += pi.receive_all();
+        }
+    }
+    auto replay = ReplayTransport::open(path.c_str(), ReplayTransport::Timing::FAST);
+    if (!replay.has_value()) {
+        state.SkipWithError("could not open the capture");
+        return;
+    }
+    SerialHandler handler{*replay};
+
+    for (auto _ : state) {
+        replay->rewind();
+        while (!replay->finished()) {
+            benchmark::DoNotOptimize(handler.receive_all());
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * burst));
+}
+BENCHMARK(BM_ReplayDecode)->ArgName("burst")->Arg(32)->Arg(512);
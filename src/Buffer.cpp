@@ -1,26 +1,203 @@
 #include "Buffer.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+Buffer::Buffer(const size_t packet_size)
+    : packet_size(std::clamp<size_t>(packet_size, sizeof(Header), MAX_PACKET_SIZE)),
+      slot_stride((1 + (this->packet_size + sizeof(uint64_t) - 1) / sizeof(uint64_t) + CACHE_LINE_WORDS - 1)
+                  / CACHE_LINE_WORDS * CACHE_LINE_WORDS),
+      storage(std::make_unique<std::atomic<uint64_t>[]>(CAPACITY * this->slot_stride + CACHE_LINE_WORDS - 1))
+{
+    // Skip ahead to the first word on a cache line
+    const auto address = reinterpret_cast<uintptr_t>(this->storage.get());
+    this->slots = this->storage.get() + (CACHE_LINE_SIZE - address % CACHE_LINE_SIZE) % CACHE_LINE_SIZE / sizeof(uint64_t);
+}
+
+std::atomic<uint64_t>* Buffer::slot(const uint32_t index) const {
+    return this->slots + (index & (CAPACITY - 1)) * this->slot_stride;
+}
+
+Buffer::State Buffer::unpack(const uint64_t state) {
+    return State{
+        static_cast<uint32_t>(state & INDEX_MASK),
+        static_cast<uint32_t>((state >> INDEX_BITS) & INDEX_MASK),
+        static_cast<uint16_t>(state >> (INDEX_BITS * 2)),
+    };
+}
+
+uint64_t Buffer::pack(const State state) {
+    return static_cast<uint64_t>(state.head & INDEX_MASK)
+        | static_cast<uint64_t>(state.tail & INDEX_MASK) << INDEX_BITS
+        | static_cast<uint64_t>(state.tag) << (INDEX_BITS * 2);
+}
+
 size_t Buffer::size() const {
-    return this->data.size();
+    return unpack(this->state.load(std::memory_order_acquire)).size();
+}
+
+size_t Buffer::dropped() const {
+    return this->dropped_count.load(std::memory_order_relaxed);
+}
+
+size_t Buffer::copy_slot(const uint32_t index, SlotCopy& words) const {
+    const std::atomic<uint64_t>* slot = this->slot(index);
+    // A copy that turns out to be torn is still turned into a packet by pop_batch, so keep the length one can have
+    const size_t length = std::clamp<size_t>(slot[0].load(std::memory_order_relaxed), sizeof(Header), this->packet_size);
+    for (size_t i = 0; i < (length + sizeof(uint64_t) - 1) / sizeof(uint64_t); i++) {
+        words[i] = slot[1 + i].load(std::memory_order_relaxed);
+    }
+    return length;
+}
+
+Packet Buffer::to_packet(const SlotCopy& words, const size_t length) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(words.data());
+    Header header;
+    memcpy(&header, bytes, sizeof(Header));
+    return Packet{header, bytes + sizeof(Header), length - sizeof(Header)};
 }
 
 std::optional<Packet> Buffer::pop_latest() {
-    if (this->data.empty())
-        return std::nullopt;
+    return this->pop(true);
+}
 
-    Packet packet = this->data.back();
-    this->data.pop_back();
-    return std::move(packet);
+std::optional<Packet> Buffer::pop_oldest() {
+    return this->pop(false);
 }
 
-void Buffer::add(const Packet& data) {
-    if (this->data.size() > max_size) {
-        this->data.erase(this->data.begin(), this->data.begin() + (this->data.size() - this->max_size));
+std::optional<Packet> Buffer::peek_latest() const {
+    return this->peek(true);
+}
+
+std::optional<Packet> Buffer::peek_oldest() const {
+    return this->peek(false);
+}
+
+std::optional<Packet> Buffer::pop(const bool latest) {
+    SlotCopy words;
+    uint64_t current = this->state.load(std::memory_order_acquire);
+    while (true) {
+        const State state = unpack(current);
+        if (state.size() == 0)
+            return std::nullopt;
+
+        // Copy the slot before claiming it. The add that filled it happened before the state was loaded, and if anything
+        // changed the slot since then it also changed the state, so the compare and swap fails and the copy is thrown away
+        const uint32_t index = latest ? (state.head - 1) & INDEX_MASK : state.tail;
+        const size_t length = this->copy_slot(index, words);
+
+        const State next = latest
+            ? State{index, state.tail, static_cast<uint16_t>(state.tag + 1)}
+            : State{state.head, (state.tail + 1) & INDEX_MASK, static_cast<uint16_t>(state.tag + 1)};
+        if (this->state.compare_exchange_weak(current, pack(next), std::memory_order_acq_rel, std::memory_order_acquire))
+            return to_packet(words, length);
     }
+}
+
+std::optional<Packet> Buffer::peek(const bool latest) const {
+    SlotCopy words;
+    uint64_t current = this->state.load(std::memory_order_acquire);
+    while (true) {
+        const State state = unpack(current);
+        if (state.size() == 0)
+            return std::nullopt;
+
+        const size_t length = this->copy_slot(latest ? (state.head - 1) & INDEX_MASK : state.tail, words);
+
+        // Nothing is claimed, so instead check that the state is the same after copying, like a seqlock reader. The
+        // fence keeps the copy from being moved after the check
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t after = this->state.load(std::memory_order_relaxed);
+        if (after == current)
+            return to_packet(words, length);
+        current = after;
+    }
+}
+
+size_t Buffer::pop_batch(const std::span<std::optional<Packet>> batch) {
+    SlotCopy words;
+    uint64_t current = this->state.load(std::memory_order_acquire);
+    while (true) {
+        const State state = unpack(current);
+        const size_t count = std::min<size_t>(state.size(), batch.size());
+        if (count == 0)
+            return 0;
+
+        // Copy all of them before claiming any, the same way pop does for one
+        for (size_t i = 0; i < count; i++) {
+            const size_t length = this->copy_slot((state.tail + i) & INDEX_MASK, words);
+            batch[i] = to_packet(words, length);
+        }
+
+        const State next{state.head, static_cast<uint32_t>((state.tail + count) & INDEX_MASK), static_cast<uint16_t>(state.tag + 1)};
+        if (this->state.compare_exchange_weak(current, pack(next), std::memory_order_acq_rel, std::memory_order_acquire))
+            return count;
+    }
+}
 
-    this->data.push_back(std::move(data));
+bool Buffer::add(const Packet& data) {
+    std::array<uint8_t, MAX_PACKET_SIZE> bytes;
+    const size_t length = data.serialize(bytes);
+    if (length == 0)
+        return false;
+    return this->add(std::span{bytes.data(), length});
+}
+
+bool Buffer::add(const std::span<const uint8_t> bytes) {
+    if (bytes.empty())
+        return false;
+    if (bytes.size() > this->packet_size) {
+        this->dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    const size_t limit = std::clamp<size_t>(this->max_size.load(std::memory_order_relaxed), 1, CAPACITY);
+    // The slot the packet was last written to, so it is only written again if a consumer popped the newest packet
+    std::optional<uint32_t> written;
+    uint64_t current = this->state.load(std::memory_order_acquire);
+    while (true) {
+        const State state = unpack(current);
+
+        if (state.size() >= limit) {
+            if (this->full_policy.load(std::memory_order_relaxed) == FullPolicy::DROP_NEWEST) {
+                this->dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // Trim from the oldest end until there is room for one more
+            const uint32_t trimmed = state.size() - limit + 1;
+            const State next{state.head, (state.tail + trimmed) & INDEX_MASK, static_cast<uint16_t>(state.tag + 1)};
+            if (this->state.compare_exchange_weak(current, pack(next), std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                this->dropped_count.fetch_add(trimmed, std::memory_order_relaxed);
+                current = pack(next);
+            }
+            continue;
+        }
+
+        // Nothing reads the slot at head until the state below is published, so it is safe to write without claiming it
+        if (written != state.head) {
+            std::atomic<uint64_t>* slot = this->slot(state.head);
+            slot[0].store(bytes.size(), std::memory_order_relaxed);
+            for (size_t i = 0; i < bytes.size(); i += sizeof(uint64_t)) {
+                uint64_t word = 0;
+                memcpy(&word, bytes.data() + i, std::min(sizeof(uint64_t), bytes.size() - i));
+                slot[1 + i / sizeof(uint64_t)].store(word, std::memory_order_relaxed);
+            }
+            written = state.head;
+        }
+
+        const State next{(state.head + 1) & INDEX_MASK, state.tail, static_cast<uint16_t>(state.tag + 1)};
+        if (this->state.compare_exchange_weak(current, pack(next), std::memory_order_acq_rel, std::memory_order_acquire))
+            return true;
+    }
 }
 
 void Buffer::set_max_size(size_t size) {
-    this->max_size = size;
+    this->max_size.store(size, std::memory_order_relaxed);
+}
+
+void Buffer::set_full_policy(const FullPolicy policy) {
+    this->full_policy.store(policy, std::memory_order_relaxed);
 }
@@ -1,33 +1,187 @@
 #pragma once
-#include <deque>
-#include <limits>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <span>
 
 #include "Packet.hpp"
 
-/** A buffer of packets. Used in case we receive multiple packets before we have a chance to read them. */
+/**
+ * A buffer of packets. Used in case we receive multiple packets before we have a chance to read them.
+ *
+ * This is a fixed size, lock-free ring. A single thread (the one receiving) adds packets, while any amount of threads
+ * pop them, without any of them taking a lock. The head, tail and a tag that changes on every modification are packed
+ * into one atomic word. Consumers copy the packet out of its slot and only keep the copy if the word did not change
+ * while they were copying, otherwise they try again.
+ */
 class Buffer {
-    /** A double ended queue for our packets. The back is the newest values. */
-    std::deque<Packet> data;
+public:
+    /** What add does when the buffer is full. */
+    enum class FullPolicy {
+        /** Throw away the oldest packet to make room for the new one. */
+        OVERWRITE_OLDEST,
+        /** Throw away the new packet. */
+        DROP_NEWEST,
+    };
+
+    /** The amount of packets a buffer can hold. Must be a power of 2. */
+    static constexpr size_t CAPACITY = 32;
+    /** The largest serialized packet any buffer can hold. Must be at least SerialHandler::MAX_PACKET_SIZE, which is checked there. */
+    static constexpr size_t MAX_PACKET_SIZE = 1024;
+
+private:
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "Buffer capacity must be a power of 2");
+    static_assert(MAX_PACKET_SIZE % sizeof(uint64_t) == 0);
+
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+    static constexpr size_t CACHE_LINE_WORDS = CACHE_LINE_SIZE / sizeof(uint64_t);
+    /** The most words a slot's bytes can take up. */
+    static constexpr size_t SLOT_WORDS = MAX_PACKET_SIZE / sizeof(uint64_t);
+
+    /** The bits used for each of head and tail in the state word. The tag uses the remaining 16 bits. */
+    static constexpr int INDEX_BITS = 24;
+    static constexpr uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static_assert(CAPACITY < (1u << INDEX_BITS));
+
+    /** The unpacked state word. head is the index after the newest packet, and tail is the index of the oldest. */
+    struct State {
+        uint32_t head;
+        uint32_t tail;
+        uint16_t tag;
+
+        [[nodiscard]] uint32_t size() const {
+            return (this->head - this->tail) & INDEX_MASK;
+        }
+    };
+
+    static State unpack(uint64_t state);
+    static uint64_t pack(State state);
+
+    /** The words of one slot, copied out so they can be checked before being turned into a packet. */
+    using SlotCopy = std::array<uint64_t, SLOT_WORDS>;
+
+    /**
+     * Copies the slot at the index without claiming it. The copy is only valid if the state did not change since it
+     * was loaded, which the caller has to check.
+     * @returns The length of the packet in the slot.
+     */
+    size_t copy_slot(uint32_t index, SlotCopy& words) const;
+
+    /** @returns The packet in a copy of a slot. */
+    static Packet to_packet(const SlotCopy& words, size_t length);
+
+    /** Pops the packet at the newest or oldest end. */
+    std::optional<Packet> pop(bool latest);
+
+    /** Returns a copy of the packet at the newest or oldest end without removing it. */
+    std::optional<Packet> peek(bool latest) const;
 
-    /** The max size of the dequeue. Defaults to numeric_limits::max. If add is called when size is at max then values
-     * are trimmed off the front. */
-    size_t max_size;
+    /**
+     * Pops up to batch.size() of the oldest packets with a single compare and swap, oldest first.
+     * @returns The amount of packets put in batch.
+     */
+    size_t pop_batch(std::span<std::optional<Packet>> batch);
 
-    /** Adds a packet to the buffer */
-    void add(const Packet& data);
+    /** The packed head, tail and tag. Every change to the buffer goes through a compare and swap on this. */
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> state{0};
+
+    /** The max amount of packets kept, at most CAPACITY. If add is called when size is at max then the full policy is used. */
+    std::atomic<size_t> max_size{CAPACITY};
+    std::atomic<FullPolicy> full_policy{FullPolicy::OVERWRITE_OLDEST};
+    /** The amount of packets thrown away because the buffer was full. */
+    std::atomic<size_t> dropped_count{0};
+
+    /** The largest serialized packet a slot of this buffer can hold. */
+    size_t packet_size;
+    /**
+     * The words each slot takes up: its length, and then its bytes. Slot bytes are stored as words, so they can be copied
+     * atomically without a lock. Rounded up to whole cache lines, so slots don't slow each other down.
+     */
+    size_t slot_stride;
+    /** Allocated once when constructed, so adding and popping never allocate. Has room to start slots on a cache line. */
+    std::unique_ptr<std::atomic<uint64_t>[]> storage;
+    /** The first word of the first slot, inside storage. */
+    std::atomic<uint64_t>* slots;
+
+    /** @returns The length word of the slot at the index, followed by its bytes. */
+    [[nodiscard]] std::atomic<uint64_t>* slot(uint32_t index) const;
+
+    /**
+     * Adds a packet to the buffer. Must only be called from one thread at a time.
+     * @returns False if the packet was thrown away because the buffer is full and the policy is DROP_NEWEST, or because
+     * it is larger than the buffer's packet size.
+     */
+    bool add(const Packet& data);
+
+    /**
+     * Adds a packet from its serialized bytes, the header followed by the data. Must only be called from one thread at a time.
+     * @returns False if the packet was thrown away because the buffer is full and the policy is DROP_NEWEST, or because
+     * it is larger than the buffer's packet size.
+     */
+    bool add(std::span<const uint8_t> bytes);
 
     // Friend SerialHandler so that it can use the private add method
     friend class SerialHandler;
+#ifdef GTEST
+    friend class BufferTest;
+#endif
+#ifdef BENCH
+    friend class BufferBench;
+#endif
 
 public:
-    Buffer() : max_size(std::numeric_limits<size_t>::max()) {};
+    /**
+     * @param packet_size The largest serialized packet, header included, the buffer has to hold. Slots are only as
+     * large as this, so SerialHandler sizes each buffer for its packet type. At most MAX_PACKET_SIZE.
+     */
+    explicit Buffer(size_t packet_size = MAX_PACKET_SIZE);
 
-    /** Sets the maximum size of the dequeue. NOTE: This does not modify the size of the buffer until the next element is added. */
+    /** Sets the maximum size of the buffer, up to CAPACITY. NOTE: This does not modify the size of the buffer until the next element is added. */
     void set_max_size(size_t size);
 
-    /** Pops and returns the latest packet from the dequeue. This is the item at the END of the queue. Returns nullopt if the dequeue is empty */
+    /** Sets what happens to packets added when the buffer is full. Defaults to OVERWRITE_OLDEST. */
+    void set_full_policy(FullPolicy policy);
+
+    /** Pops and returns the latest packet from the buffer. Returns nullopt if the buffer is empty. Safe to call from any thread. */
     std::optional<Packet> pop_latest();
 
-    /** Returns the size of the dequeue */
+    /** Pops and returns the oldest packet from the buffer. Returns nullopt if the buffer is empty. Safe to call from any thread. */
+    std::optional<Packet> pop_oldest();
+
+    /** Returns a copy of the latest packet without removing it. Returns nullopt if the buffer is empty. Safe to call from any thread. */
+    [[nodiscard]] std::optional<Packet> peek_latest() const;
+
+    /** Returns a copy of the oldest packet without removing it. Returns nullopt if the buffer is empty. Safe to call from any thread. */
+    [[nodiscard]] std::optional<Packet> peek_oldest() const;
+
+    /**
+     * Pops up to count of the oldest packets and writes them to out, oldest first. They are all removed at once, so
+     * another consumer never takes a packet from the middle of them. Safe to call from any thread.
+     * @returns The amount of packets written to out.
+     */
+    template <typename OutputIt>
+    size_t pop_n(size_t count, OutputIt out)
+    {
+        std::array<std::optional<Packet>, CAPACITY> batch;
+        const size_t popped = this->pop_batch(std::span{batch.data(), std::min(count, CAPACITY)});
+        for (size_t i = 0; i < popped; i++) {
+            *out++ = std::move(*batch[i]);
+        }
+        return popped;
+    }
+
+    /** Pops every packet and writes them to out, oldest first, like pop_n. */
+    template <typename OutputIt>
+    size_t drain(OutputIt out)
+    {
+        return this->pop_n(CAPACITY, out);
+    }
+
+    /** Returns the size of the buffer */
     [[nodiscard]] size_t size() const;
+
+    /** Returns the amount of packets thrown away because the buffer was full, or because they were too large for it. */
+    [[nodiscard]] size_t dropped() const;
 };
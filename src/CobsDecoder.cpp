@@ -0,0 +1,92 @@
+#include "CobsDecoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "ZeroScan.hpp"
+
+CobsDecoder::CobsDecoder(const std::span<uint8_t> output) : output(output) {}
+
+CobsDecoder::FeedResult CobsDecoder::feed(const std::span<const uint8_t> bytes) {
+    size_t i = 0;
+    while (i < bytes.size()) {
+        // Skip everything up to the next delimiter
+        if (this->invalid) {
+            const size_t zero = ZeroScan::find_zero(bytes.data() + i, bytes.size() - i);
+            if (zero == bytes.size() - i) return {bytes.size(), Result::INCOMPLETE};
+            i += zero + 1;
+            this->finish_frame();
+            return {i, Result::INVALID};
+        }
+
+        // In the middle of a block, copy as much of it as we have. The block should not contain any zeros, but if it
+        // does that is the end of the frame
+        if (this->block_remaining > 0) {
+            const size_t available = std::min(this->block_remaining, bytes.size() - i);
+            const size_t run = ZeroScan::find_zero(bytes.data() + i, available);
+            if (this->length + run > this->output.size()) {
+                // The frame is too large, so the rest of it gets skipped
+                this->invalid = true;
+                continue;
+            }
+            memcpy(this->output.data() + this->length, bytes.data() + i, run);
+            this->length += run;
+            this->encoded_length += run;
+            this->block_remaining -= run;
+            i += run;
+
+            if (run < available) {
+                // Found a delimiter before the block ended, so a marker pointed past the end of the frame
+                i++;
+                this->finish_frame();
+                return {i, Result::INVALID};
+            }
+            continue;
+        }
+
+        // Otherwise this byte is either a marker or the delimiter
+        const uint8_t byte = bytes[i++];
+        if (byte == 0x00) {
+            // Nothing has been received since the last delimiter, so there is no frame to end
+            if (this->encoded_length == 0) continue;
+
+            // A frame needs at least a marker and one other byte. See Utils::cobs_decode
+            const bool valid = this->encoded_length >= 2;
+            const size_t decoded_length = this->length;
+            this->finish_frame();
+            if (!valid) return {i, Result::INVALID};
+            this->frame_length = decoded_length;
+            return {i, Result::FRAME};
+        }
+
+        // Every marker after the first one replaces a zero, unless the block before it was a full 0xFF block
+        if (this->encoded_length > 0 && this->previous_marker != 0xFF) {
+            if (this->length >= this->output.size()) {
+                this->invalid = true;
+                continue;
+            }
+            this->output[this->length++] = 0x00;
+        }
+        this->previous_marker = byte;
+        this->block_remaining = byte - 1;
+        this->encoded_length++;
+    }
+
+    return {i, Result::INCOMPLETE};
+}
+
+std::span<const uint8_t> CobsDecoder::frame() const {
+    return this->output.first(this->frame_length);
+}
+
+void CobsDecoder::reset() {
+    this->finish_frame();
+}
+
+void CobsDecoder::finish_frame() {
+    this->length = 0;
+    this->block_remaining = 0;
+    this->encoded_length = 0;
+    this->previous_marker = 0;
+    this->invalid = false;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/**
+ * Decodes a stream of cobs encoded frames as the bytes arrive, without needing the whole frame first.
+ * Each byte given to feed is looked at exactly once, and decoded bytes are written straight into the output buffer
+ * given to the constructor, so there is no rescanning, copying or shifting of partially received frames.
+ * Produces exactly the same frames as Utils::cobs_decode does on the bytes between delimiters.
+ */
+class CobsDecoder {
+public:
+    enum class Result {
+        /** All the given bytes were used and the current frame has not ended yet. */
+        INCOMPLETE,
+        /** A frame ended and was decoded successfully. It can be read with frame() until the next call to feed. */
+        FRAME,
+        /** A frame ended but was not valid cobs, or was too large for the output buffer. It is discarded. */
+        INVALID,
+    };
+
+    struct FeedResult {
+        /** The amount of bytes used. Feeding stops right after a null delimiter, so this can be less than what was given. */
+        size_t consumed;
+        Result result;
+    };
+
+    /**
+     * @param output Where decoded frames are written. Frames that decode to more bytes than this are INVALID.
+     * Must outlive the decoder.
+     */
+    explicit CobsDecoder(std::span<uint8_t> output);
+
+    /**
+     * Decodes bytes until the end of a frame is reached, or until there are no bytes left.
+     * Empty frames (two delimiters in a row) are skipped.
+     */
+    FeedResult feed(std::span<const uint8_t> bytes);
+
+    /** @returns The last successfully decoded frame. Only valid after feed returns FRAME and until feed is called again. */
+    [[nodiscard]] std::span<const uint8_t> frame() const;
+
+    /** Discards any partially decoded frame. */
+    void reset();
+
+private:
+    /** Where the decoded bytes are written. */
+    std::span<uint8_t> output;
+
+    /** The amount of decoded bytes written to output for the current frame. */
+    size_t length = 0;
+
+    /** The amount of bytes left in the current block before the next marker. */
+    size_t block_remaining = 0;
+
+    /** The amount of encoded bytes seen in the current frame, used to reject frames that are too short. */
+    size_t encoded_length = 0;
+
+    /** The last marker read. A 0xFF marker has no zero where its block ends. */
+    uint8_t previous_marker = 0;
+
+    /** If the current frame has already failed and the rest of it should be skipped until the next delimiter. */
+    bool invalid = false;
+
+    /** The length of the last decoded frame. */
+    size_t frame_length = 0;
+
+    /** Marks the current frame as finished and gets ready for the next one. */
+    void finish_frame();
+};
@@ -0,0 +1,76 @@
+#include "CompactOptical.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "PacketView.hpp"
+
+/** @returns The value in steps of 10^exponent, clamped to what fits in T. */
+template <typename T>
+static T quantize(const double value, const int8_t exponent) {
+    const double steps = std::round(value / std::pow(10.0, exponent));
+    return static_cast<T>(std::clamp<double>(steps, std::numeric_limits<T>::min(), std::numeric_limits<T>::max()));
+}
+
+static double dequantize(const int64_t steps, const int8_t exponent) {
+    return static_cast<double>(steps) * std::pow(10.0, exponent);
+}
+
+/** @returns True if the difference fits in a delta. */
+static bool fits_delta(const int64_t difference) {
+    return difference >= std::numeric_limits<int16_t>::min() && difference <= std::numeric_limits<int16_t>::max();
+}
+
+CompactOpticalEncoder::CompactOpticalEncoder() : CompactOpticalEncoder(Config{}) {}
+
+CompactOpticalEncoder::CompactOpticalEncoder(const Config config) : config(config) {
+    this->config.keyframe_interval = std::max<uint16_t>(this->config.keyframe_interval, 1);
+}
+
+Packet CompactOpticalEncoder::encode(const OpticalPacket::Data& sample) {
+    const auto x = quantize<int32_t>(sample.x, this->config.position_exponent);
+    const auto y = quantize<int32_t>(sample.y, this->config.position_exponent);
+    const auto heading = quantize<int32_t>(sample.heading, this->config.heading_exponent);
+
+    const int64_t dx = static_cast<int64_t>(x) - this->keyframe.x;
+    const int64_t dy = static_cast<int64_t>(y) - this->keyframe.y;
+    const int64_t dheading = static_cast<int64_t>(heading) - this->keyframe.heading;
+    if (this->since_keyframe.has_value() && *this->since_keyframe < this->config.keyframe_interval
+        && fits_delta(dx) && fits_delta(dy) && fits_delta(dheading)) {
+        ++*this->since_keyframe;
+        return CompactOpticalDeltaPacket{{
+            static_cast<int16_t>(dx), static_cast<int16_t>(dy), static_cast<int16_t>(dheading), this->keyframe.keyframe
+        }};
+    }
+
+    const uint16_t number = this->since_keyframe.has_value() ? this->keyframe.keyframe + 1 : 0;
+    this->keyframe = {x, y, heading, this->config.position_exponent, this->config.heading_exponent, number};
+    this->since_keyframe = 1;
+    return CompactOpticalKeyframePacket{this->keyframe};
+}
+
+std::optional<OpticalPacket::Data> CompactOpticalDecoder::decode(const std::span<const uint8_t> frame) {
+    const uint8_t id = PacketView<Packet>{frame}.get_id();
+    if (id == CompactOpticalKeyframePacket::id) {
+        this->keyframe = PacketView<CompactOpticalKeyframePacket>{frame}.data();
+        const CompactOpticalKeyframePacket::Data& keyframe = *this->keyframe;
+        return OpticalPacket::Data{
+            dequantize(keyframe.x, keyframe.position_exponent),
+            dequantize(keyframe.y, keyframe.position_exponent),
+            dequantize(keyframe.heading, keyframe.heading_exponent),
+        };
+    }
+
+    const auto delta = PacketView<CompactOpticalDeltaPacket>{frame}.data();
+    // The keyframe this delta is from was lost, so there is nothing to add it to until the next keyframe arrives
+    if (!this->keyframe.has_value() || this->keyframe->keyframe != delta.keyframe)
+        return std::nullopt;
+
+    const CompactOpticalKeyframePacket::Data& keyframe = *this->keyframe;
+    return OpticalPacket::Data{
+        dequantize(static_cast<int64_t>(keyframe.x) + delta.x, keyframe.position_exponent),
+        dequantize(static_cast<int64_t>(keyframe.y) + delta.y, keyframe.position_exponent),
+        dequantize(static_cast<int64_t>(keyframe.heading) + delta.heading, keyframe.heading_exponent),
+    };
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "CompactOpticalPackets.hpp"
+#include "OpticalPacket.hpp"
+
+/**
+ * Turns optical samples into CompactOpticalKeyframePackets and CompactOpticalDeltaPackets to send instead of
+ * OpticalPackets. A keyframe is 16 bytes of data and a delta is 8, compared to 24 for an OpticalPacket.
+ *
+ * Keyframes are sent every keyframe_interval samples, and whenever a sample has moved too far from the last keyframe
+ * for a delta to hold it. There is no acknowledgement from the receiver, so deltas are always from the last keyframe
+ * sent, and the receiver throws away deltas until it gets that keyframe.
+ */
+class CompactOpticalEncoder {
+public:
+    struct Config {
+        /** x and y are sent in steps of 10^position_exponent. */
+        int8_t position_exponent = -3;
+        /** heading is sent in steps of 10^heading_exponent. */
+        int8_t heading_exponent = -4;
+        /** A keyframe is sent at least once every this many samples. 1 sends only keyframes. */
+        uint16_t keyframe_interval = 10;
+    };
+
+    CompactOpticalEncoder();
+
+    explicit CompactOpticalEncoder(Config config);
+
+    /** @returns The packet to send for the sample, which is either a keyframe or a delta. */
+    Packet encode(const OpticalPacket::Data& sample);
+
+private:
+    Config config;
+    /** The last keyframe sent. */
+    CompactOpticalKeyframePacket::Data keyframe{};
+    /** The amount of samples since the last keyframe, or nullopt if no keyframe has been sent yet. */
+    std::optional<uint16_t> since_keyframe;
+};
+
+/** Turns received compact optical packets back into OpticalPacket data. Used by SerialHandler. */
+class CompactOpticalDecoder {
+public:
+    /**
+     * @param frame The header and data of a CompactOpticalKeyframePacket or CompactOpticalDeltaPacket.
+     * @returns The sample, or nullopt if it is a delta from a keyframe that was not received.
+     */
+    std::optional<OpticalPacket::Data> decode(std::span<const uint8_t> frame);
+
+    /** @returns If the packet id is one of the compact optical packets. */
+    static constexpr bool is_compact(const uint8_t id) {
+        return id == CompactOpticalKeyframePacket::id || id == CompactOpticalDeltaPacket::id;
+    }
+
+private:
+    /** The last keyframe received, or nullopt if none has been. */
+    std::optional<CompactOpticalKeyframePacket::Data> keyframe;
+};
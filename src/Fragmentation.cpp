@@ -0,0 +1,93 @@
+#include "Fragmentation.hpp"
+
+#include <cstddef>
+
+#include "PacketView.hpp"
+
+Reassembler::Reassembler(const uint64_t timeout) : timeout(timeout), slots(std::make_unique<Slot[]>(MAX_REASSEMBLIES)) {}
+
+std::optional<std::span<const uint8_t>> Reassembler::add(const std::span<const uint8_t> frame, const uint64_t now) {
+    const PacketView<FragmentPacket> view{frame};
+    const auto index = view.get<&FragmentPacket::Data::index>();
+    const auto count = view.get<&FragmentPacket::Data::count>();
+    const auto length = view.get<&FragmentPacket::Data::length>();
+    // Every fragment but the last is full, so where each one goes only depends on its index
+    const bool last = index + 1 == count;
+    if (count == 0 || count > MAX_FRAGMENTS || index >= count || length > FragmentPacket::MAX_FRAGMENT_BYTES
+        || (!last && length != FragmentPacket::MAX_FRAGMENT_BYTES)) {
+        this->counts.invalid++;
+        return std::nullopt;
+    }
+
+    Slot& slot = this->find_slot(view.get<&FragmentPacket::Data::message_id>(), count, now);
+    if (slot.fragments.test(index)) {
+        this->counts.duplicates++;
+        return std::nullopt;
+    }
+
+    const size_t start = index * FragmentPacket::MAX_FRAGMENT_BYTES;
+    const size_t bytes_offset = sizeof(Header) + offsetof(FragmentPacket::Data, bytes);
+    memcpy(slot.bytes.data() + start, frame.data() + bytes_offset, length);
+    slot.fragments.set(index);
+    slot.received++;
+    if (last)
+        slot.length = start + length;
+
+    if (slot.received < slot.count)
+        return std::nullopt;
+
+    slot.active = false;
+    this->counts.completed++;
+    return std::span<const uint8_t>{slot.bytes.data(), slot.length};
+}
+
+Reassembler::Slot& Reassembler::find_slot(const uint16_t message_id, const uint16_t count, const uint64_t now) {
+    Slot* free = nullptr;
+    Slot* oldest = nullptr;
+    for (size_t i = 0; i < MAX_REASSEMBLIES; i++) {
+        Slot& slot = this->slots[i];
+        if (slot.active && now - slot.started > this->timeout) {
+            slot.active = false;
+            this->counts.timed_out++;
+        }
+        if (slot.active && slot.message_id == message_id) {
+            if (slot.count == count)
+                return slot;
+            // A different count means the sender's message ids wrapped around, so the old message will never finish
+            slot.active = false;
+            free = &slot;
+        }
+        if (!slot.active) {
+            free = free != nullptr ? free : &slot;
+            continue;
+        }
+        if (oldest == nullptr || slot.started < oldest->started)
+            oldest = &slot;
+    }
+
+    Slot* slot = free;
+    if (slot == nullptr) {
+        slot = oldest;
+        this->counts.evicted++;
+    }
+    slot->active = true;
+    slot->message_id = message_id;
+    slot->count = count;
+    slot->received = 0;
+    slot->started = now;
+    slot->length = 0;
+    slot->fragments.reset();
+    return *slot;
+}
+
+Reassembler::Stats Reassembler::stats() const {
+    return this->counts;
+}
+
+size_t Reassembler::incomplete() const {
+    size_t incomplete = 0;
+    for (size_t i = 0; i < MAX_REASSEMBLIES; i++) {
+        incomplete += this->slots[i].active;
+    }
+    return incomplete;
+}
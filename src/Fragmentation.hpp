@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+
+#include "FragmentPacket.hpp"
+
+/**
+ * Splits messages larger than a packet into FragmentPackets. Messages can be up to Reassembler::MAX_MESSAGE_SIZE,
+ * which is as much as the receiving side has room to put back together.
+ */
+class Fragmenter {
+public:
+    /** @returns The amount of fragments a message of the size is split into. Empty messages are still one fragment. */
+    static constexpr size_t fragment_count(const size_t size) {
+        return std::max<size_t>(1, (size + FragmentPacket::MAX_FRAGMENT_BYTES - 1) / FragmentPacket::MAX_FRAGMENT_BYTES);
+    }
+
+    /**
+     * Splits the message into fragments and passes each to send, in order.
+     * @returns False if the message is too large, in which case nothing is sent.
+     */
+    template <typename F>
+    requires std::invocable<F&, const FragmentPacket&>
+    bool split(std::span<const uint8_t> message, F&& send);
+
+private:
+    /** Atomic so several threads can split messages at once. */
+    std::atomic<uint16_t> next_message_id{0};
+};
+
+/**
+ * Puts FragmentPackets back together into the messages they were split from. Fragments can arrive in any order, and
+ * fragments of up to MAX_REASSEMBLIES messages can be mixed together. Storage for every message is allocated once
+ * when constructed, so adding fragments never allocates.
+ *
+ * Messages that are still missing fragments after the timeout are thrown away, since the rest were probably lost. If
+ * a fragment of a new message arrives while MAX_REASSEMBLIES messages are already incomplete, the oldest is thrown away.
+ */
+class Reassembler {
+public:
+    /** The largest message that can be put back together. */
+    static constexpr size_t MAX_MESSAGE_SIZE = 16384;
+    /** The most messages that can be put back together at once. */
+    static constexpr size_t MAX_REASSEMBLIES = 4;
+    /** The default time in microseconds a message has to get all of its fragments. */
+    static constexpr uint64_t DEFAULT_TIMEOUT = 1'000'000;
+
+    static constexpr size_t MAX_FRAGMENTS = Fragmenter::fragment_count(MAX_MESSAGE_SIZE);
+
+    /** Counts of what happened to the fragments added. */
+    struct Stats {
+        /** Messages that got all of their fragments. */
+        size_t completed;
+        /** Incomplete messages thrown away because the timeout passed. */
+        size_t timed_out;
+        /** Incomplete messages thrown away to make room for a new one. */
+        size_t evicted;
+        /** Fragments thrown away because they don't make sense, such as an index past the count. */
+        size_t invalid;
+        /** Fragments that had already been received. */
+        size_t duplicates;
+    };
+
+    /** @param timeout The time in microseconds a message has to get all of its fragments. */
+    explicit Reassembler(uint64_t timeout = DEFAULT_TIMEOUT);
+
+    /**
+     * Adds a received fragment.
+     * @param frame The header and data of a FragmentPacket.
+     * @param now The current time in microseconds, such as from Utils::micros.
+     * @returns The whole message if this was its last missing fragment. It points into the reassembler, so is only
+     * valid until add is called again.
+     */
+    std::optional<std::span<const uint8_t>> add(std::span<const uint8_t> frame, uint64_t now);
+
+    [[nodiscard]] Stats stats() const;
+
+    /** @returns The amount of messages that have some but not all of their fragments. */
+    [[nodiscard]] size_t incomplete() const;
+
+private:
+    /** A message being put back together. */
+    struct Slot {
+        bool active = false;
+        uint16_t message_id = 0;
+        uint16_t count = 0;
+        uint16_t received = 0;
+        /** When the first fragment arrived. */
+        uint64_t started = 0;
+        /** The length of the message, known once the last fragment arrives. */
+        size_t length = 0;
+        std::bitset<MAX_FRAGMENTS> fragments;
+        std::array<uint8_t, MAX_MESSAGE_SIZE> bytes;
+    };
+
+    /** @returns The slot for the message, taking a free one or the oldest if it has none yet. */
+    Slot& find_slot(uint16_t message_id, uint16_t count, uint64_t now);
+
+    uint64_t timeout;
+    Stats counts{};
+    std::unique_ptr<Slot[]> slots;
+};
+
+template <typename F>
+requires std::invocable<F&, const FragmentPacket&>
+bool Fragmenter::split(const std::span<const uint8_t> message, F&& send) {
+    if (message.size() > Reassembler::MAX_MESSAGE_SIZE)
+        return false;
+
+    const uint16_t message_id = this->next_message_id.fetch_add(1, std::memory_order_relaxed);
+    const auto count = static_cast<uint16_t>(fragment_count(message.size()));
+    for (uint16_t index = 0; index < count; index++) {
+        const size_t start = index * FragmentPacket::MAX_FRAGMENT_BYTES;
+        const size_t length = std::min(message.size() - start, FragmentPacket::MAX_FRAGMENT_BYTES);
+        FragmentPacket::Data data{message_id, index, count, static_cast<uint16_t>(length), {}};
+        // An empty message has no bytes to copy, and message.data() may be null
+        if (length > 0)
+            memcpy(data.bytes.data(), message.data() + start, length);
+        send(FragmentPacket{data});
+    }
+    return true;
+}
@@ -5,4 +5,9 @@
 struct Header {
     /** The type of packet being sent. */
     uint8_t packet_id;
+#if PACKET_SEQUENCE
+    /** Counts up by one for each packet of this type sent, wrapping around. Set by SerialHandler when sending, so the
+     * receiver can tell when packets are lost, duplicated or arrive out of order. */
+    uint8_t sequence = 0;
+#endif
 };
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <typename Signature, size_t Size>
+class InplaceFunction;
+
+/**
+ * A move only replacement for std::function that stores the callable inside itself, so it never allocates. Callables
+ * larger than Size bytes don't compile, instead of silently going on the heap. Used for listeners, which are often
+ * added on the Brain where allocating is best avoided.
+ * @tparam Size The most bytes a stored callable can take up.
+ */
+template <typename Return, typename... Args, size_t Size>
+class InplaceFunction<Return(Args...), Size> {
+    alignas(std::max_align_t) std::byte storage[Size];
+
+    /** Calls the stored callable. nullptr when empty. */
+    Return (*invoker)(void* storage, Args... args) = nullptr;
+    /** Moves the stored callable from one storage to another if from is not null, and destroys the one in to if it is. */
+    void (*manager)(void* to, void* from) = nullptr;
+
+    template <typename F>
+    static Return invoke(void* storage, Args... args) {
+        return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+    }
+
+    template <typename F>
+    static void manage(void* to, void* from) {
+        if (from) {
+            new (to) F(std::move(*static_cast<F*>(from)));
+        }
+        else {
+            static_cast<F*>(to)->~F();
+        }
+    }
+
+    void reset() {
+        if (this->manager)
+            this->manager(this->storage, nullptr);
+        this->invoker = nullptr;
+        this->manager = nullptr;
+    }
+
+public:
+    InplaceFunction() = default;
+
+    InplaceFunction(std::nullptr_t) {}
+
+    template <typename F>
+    requires (!std::same_as<std::remove_cvref_t<F>, InplaceFunction>
+        && std::is_invocable_r_v<Return, std::remove_cvref_t<F>&, Args...>
+        && sizeof(std::remove_cvref_t<F>) <= Size
+        && alignof(std::remove_cvref_t<F>) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<std::remove_cvref_t<F>>)
+    InplaceFunction(F&& function) {
+        using Stored = std::remove_cvref_t<F>;
+        new (this->storage) Stored(std::forward<F>(function));
+        this->invoker = &invoke<Stored>;
+        this->manager = &manage<Stored>;
+    }
+
+    InplaceFunction(const InplaceFunction&) = delete;
+    InplaceFunction& operator=(const InplaceFunction&) = delete;
+
+    InplaceFunction(InplaceFunction&& other) noexcept : invoker(other.invoker), manager(other.manager) {
+        if (this->manager)
+            this->manager(this->storage, other.storage);
+        other.reset();
+    }
+
+    InplaceFunction& operator=(InplaceFunction&& other) noexcept {
+        if (this != &other) {
+            this->reset();
+            this->invoker = other.invoker;
+            this->manager = other.manager;
+            if (this->manager)
+                this->manager(this->storage, other.storage);
+            other.reset();
+        }
+        return *this;
+    }
+
+    InplaceFunction& operator=(std::nullptr_t) {
+        this->reset();
+        return *this;
+    }
+
+    ~InplaceFunction() {
+        this->reset();
+    }
+
+    explicit operator bool() const {
+        return this->invoker != nullptr;
+    }
+
+    /** Calls the stored callable. Throws std::bad_function_call if empty, like std::function. */
+    Return operator()(Args... args) const {
+        if (!this->invoker)
+            throw std::bad_function_call();
+        return this->invoker(const_cast<std::byte*>(this->storage), std::forward<Args>(args)...);
+    }
+};
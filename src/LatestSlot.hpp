@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+/**
+ * Holds only the newest data of a packet type, protected by a sequence lock. A single thread writes, and writing never
+ * waits on readers. Readers never block the writer: they copy the data and check that the sequence did not change while
+ * they were copying, trying again if it did. Reading is lock-free but not wait-free, since a reader that keeps
+ * overlapping with writes keeps trying again.
+ */
+class LatestSlot {
+public:
+    /** The largest data that fits in the slot, in bytes. */
+    static constexpr size_t MAX_SIZE = 64;
+
+private:
+    static constexpr size_t WORDS = MAX_SIZE / sizeof(uint64_t);
+
+    /** Odd while a write is in progress. Each write adds 2, so sequence / 2 is the amount of writes. */
+    alignas(64) std::atomic<uint32_t> sequence{0};
+    /** The data is stored as words, so it can be copied atomically without a lock. */
+    std::array<std::atomic<uint64_t>, WORDS> words{};
+
+public:
+    /**
+     * Replaces the data in the slot. Must only be called from one thread at a time.
+     * @param bytes The new data. Must be at most MAX_SIZE bytes.
+     */
+    void write(const std::span<const uint8_t> bytes) {
+        std::array<uint64_t, WORDS> copy{};
+        memcpy(copy.data(), bytes.data(), std::min(bytes.size(), MAX_SIZE));
+
+        const uint32_t start = this->sequence.load(std::memory_order_relaxed);
+        this->sequence.store(start + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; i++) {
+            this->words[i].store(copy[i], std::memory_order_relaxed);
+        }
+        this->sequence.store(start + 2, std::memory_order_release);
+    }
+
+    /** @returns The amount of writes finished so far, without reading the data. Never waits. */
+    uint32_t writes() const {
+        return this->sequence.load(std::memory_order_acquire) / 2;
+    }
+
+    /**
+     * Copies the newest data out of the slot. Spins while a write is in progress.
+     * @param output Where the data is written. Must be at most MAX_SIZE bytes.
+     * @returns The amount of writes made to the slot, which is 0 if nothing has been written yet.
+     */
+    uint32_t read(const std::span<uint8_t> output) const {
+        std::array<uint64_t, WORDS> copy;
+        while (true) {
+            const uint32_t start = this->sequence.load(std::memory_order_acquire);
+            if (start % 2 != 0) continue; // A write is in progress
+
+            for (size_t i = 0; i < WORDS; i++) {
+                copy[i] = this->words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (this->sequence.load(std::memory_order_relaxed) == start) {
+                memcpy(output.data(), copy.data(), std::min(output.size(), MAX_SIZE));
+                return start / 2;
+            }
+        }
+    }
+};
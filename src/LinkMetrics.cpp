@@ -0,0 +1,109 @@
+#include "LinkMetrics.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#include "Utils.hpp"
+
+double LinkMetrics::HistogramSnapshot::mean() const {
+    return this->count == 0 ? 0.0 : static_cast<double>(this->total) / static_cast<double>(this->count);
+}
+
+uint64_t LinkMetrics::HistogramSnapshot::percentile(const double fraction) const {
+    if (this->count == 0)
+        return 0;
+
+    // The rank of the wanted duration, counting from 1
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(this->count))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += this->buckets[i];
+        if (seen >= rank) {
+            const uint64_t upper = i == 0 ? 0 : (uint64_t{1} << i) - 1;
+            return std::min(upper, this->max);
+        }
+    }
+    // Buckets and count are loaded separately, so a record in between can make them disagree slightly
+    return this->max;
+}
+
+size_t LinkMetrics::Histogram::bucket(const uint64_t micros) {
+    return std::min<size_t>(std::bit_width(micros), HISTOGRAM_BUCKETS - 1);
+}
+
+void LinkMetrics::Histogram::record(const uint64_t micros) {
+    this->buckets[bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+    this->count.fetch_add(1, std::memory_order_relaxed);
+    this->total.fetch_add(micros, std::memory_order_relaxed);
+
+    uint64_t current = this->max.load(std::memory_order_relaxed);
+    while (micros > current && !this->max.compare_exchange_weak(current, micros, std::memory_order_relaxed)) {}
+}
+
+LinkMetrics::HistogramSnapshot LinkMetrics::Histogram::snapshot() const {
+    HistogramSnapshot snapshot;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot.buckets[i] = this->buckets[i].load(std::memory_order_relaxed);
+    }
+    snapshot.count = this->count.load(std::memory_order_relaxed);
+    snapshot.total = this->total.load(std::memory_order_relaxed);
+    snapshot.max = this->max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+double LinkMetrics::packet_rate(const Snapshot& earlier, const Snapshot& later, const uint8_t id) {
+    if (later.time <= earlier.time)
+        return 0.0;
+    const auto packets = static_cast<double>(later.packets[id] - earlier.packets[id]);
+    return packets * 1'000'000.0 / static_cast<double>(later.time - earlier.time);
+}
+
+void LinkMetrics::add_bytes_read(const size_t bytes) {
+    this->bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LinkMetrics::add_bytes_written(const size_t bytes) {
+    this->bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LinkMetrics::add_frame(const uint8_t id) {
+    this->frames_decoded.fetch_add(1, std::memory_order_relaxed);
+    this->packets[id].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LinkMetrics::add_drop(const Drop reason) {
+    this->frames_dropped[static_cast<size_t>(reason)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LinkMetrics::add_listener_call(const uint64_t micros) {
+    this->listener_calls.fetch_add(1, std::memory_order_relaxed);
+    this->listener_time.record(micros);
+}
+
+void LinkMetrics::add_read(const uint64_t micros) {
+    this->read_latency.record(micros);
+}
+
+void LinkMetrics::add_decode(const uint64_t micros) {
+    this->decode_time.record(micros);
+}
+
+LinkMetrics::Snapshot LinkMetrics::snapshot() const {
+    Snapshot snapshot;
+    snapshot.time = Utils::micros();
+    snapshot.bytes_read = this->bytes_read.load(std::memory_order_relaxed);
+    snapshot.bytes_written = this->bytes_written.load(std::memory_order_relaxed);
+    snapshot.frames_decoded = this->frames_decoded.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < this->frames_dropped.size(); i++) {
+        snapshot.frames_dropped[i] = this->frames_dropped[i].load(std::memory_order_relaxed);
+    }
+    snapshot.listener_calls = this->listener_calls.load(std::memory_order_relaxed);
+    for (size_t id = 0; id < PacketIds::LENGTH; id++) {
+        snapshot.packets[id] = this->packets[id].load(std::memory_order_relaxed);
+    }
+    snapshot.read_latency = this->read_latency.snapshot();
+    snapshot.decode_time = this->decode_time.snapshot();
+    snapshot.listener_time = this->listener_time.snapshot();
+    return snapshot;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "PacketIds.hpp"
+
+/**
+ * Counts what goes over the serial connection and how long handling it takes. Every counter is a relaxed atomic, so
+ * recording never takes a lock and snapshot can be called from any thread while packets are being received.
+ *
+ * SerialHandler only has one when built with LINK_METRICS, so it can be removed entirely on the Brain.
+ */
+class LinkMetrics {
+public:
+    /**
+     * A histogram of durations in microseconds. Bucket 0 holds durations of 0, and bucket i holds durations from 2^(i-1)
+     * up to 2^i - 1. The last bucket also holds everything longer.
+     */
+    static constexpr size_t HISTOGRAM_BUCKETS = 24;
+
+    /** Why a received frame was thrown away. */
+    enum class Drop {
+        /** The bytes between delimiters were not valid cobs, or decoded to more than the max packet size. */
+        COBS,
+        /** The frame was too short for a header, or its packet id is not registered. */
+        UNKNOWN_ID,
+        /** The frame's data was not the size of its packet type's data. */
+        WRONG_SIZE,
+        LENGTH,
+    };
+
+    /** A copy of a histogram at one point in time. */
+    struct HistogramSnapshot {
+        std::array<uint64_t, HISTOGRAM_BUCKETS> buckets{};
+        uint64_t count = 0;
+        /** The sum of all the recorded durations. */
+        uint64_t total = 0;
+        uint64_t max = 0;
+
+        [[nodiscard]] double mean() const;
+
+        /**
+         * @param fraction Between 0 and 1, such as 0.99 for the 99th percentile.
+         * @returns The upper bound of the bucket the percentile falls in, which is at most max. 0 if nothing was recorded.
+         */
+        [[nodiscard]] uint64_t percentile(double fraction) const;
+    };
+
+    class Histogram {
+        std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> buckets{};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> max{0};
+
+    public:
+        /** @returns The bucket a duration is counted in. */
+        static size_t bucket(uint64_t micros);
+
+        void record(uint64_t micros);
+
+        [[nodiscard]] HistogramSnapshot snapshot() const;
+    };
+
+    /** A copy of all the metrics at one point in time. Compare two with packet_rate to get rates. */
+    struct Snapshot {
+        /** When the snapshot was taken, from Utils::micros. */
+        uint64_t time = 0;
+
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        /** Frames that decoded into a valid packet. */
+        uint64_t frames_decoded = 0;
+        /** Frames thrown away, indexed by Drop. */
+        std::array<uint64_t, static_cast<size_t>(Drop::LENGTH)> frames_dropped{};
+        /** Packets thrown away because their buffer was full. Filled in by SerialHandler from its buffers. */
+        uint64_t buffer_overflows = 0;
+        uint64_t listener_calls = 0;
+        /** Valid packets received of each id. */
+        std::array<uint64_t, PacketIds::LENGTH> packets{};
+
+        /** How long each blocking read from the serial connection took, including waiting for data. */
+        HistogramSnapshot read_latency;
+        /** How long the cobs decoder took on each chunk of received bytes. */
+        HistogramSnapshot decode_time;
+        /** How long each listener call took. */
+        HistogramSnapshot listener_time;
+
+        [[nodiscard]] uint64_t dropped(Drop reason) const {
+            return this->frames_dropped[static_cast<size_t>(reason)];
+        }
+    };
+
+    /** @returns The packets of the id received per second between two snapshots. */
+    static double packet_rate(const Snapshot& earlier, const Snapshot& later, uint8_t id);
+
+    void add_bytes_read(size_t bytes);
+    void add_bytes_written(size_t bytes);
+    void add_frame(uint8_t id);
+    void add_drop(Drop reason);
+    void add_listener_call(uint64_t micros);
+    void add_read(uint64_t micros);
+    void add_decode(uint64_t micros);
+
+    /** @returns A copy of every counter. Only atomic loads, so it is cheap enough to call every loop. */
+    [[nodiscard]] Snapshot snapshot() const;
+
+private:
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> frames_decoded{0};
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(Drop::LENGTH)> frames_dropped{};
+    std::atomic<uint64_t> listener_calls{0};
+    std::array<std::atomic<uint64_t>, PacketIds::LENGTH> packets{};
+
+    Histogram read_latency;
+    Histogram decode_time;
+    Histogram listener_time;
+};
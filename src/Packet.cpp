@@ -4,8 +4,7 @@
 
 #include "SerialHandler.hpp"
 
-Packet::Packet(Header header, const uint8_t* data, size_t length) : data(length), header(header) {
-    memcpy(this->data.data(), data, length);
+Packet::Packet(Header header, const uint8_t* data, size_t length) : data(data, length), header(header) {
     assert(length <= SerialHandler::MAX_PACKET_DATA_SIZE);
 }
 
@@ -20,6 +19,20 @@ std::vector<uint8_t> Packet::serialize() const {
     return data_to_send;
 }
 
+size_t Packet::serialize(const std::span<uint8_t> output) const {
+    if (output.size() < this->serialized_size())
+        return 0;
+
+    memcpy(output.data(), &this->header, sizeof(Header));
+    memcpy(output.data() + sizeof(Header), this->data.data(), this->data.size());
+
+    return this->serialized_size();
+}
+
+size_t Packet::serialized_size() const {
+    return sizeof(Header) + this->data.size();
+}
+
 uint8_t Packet::get_id() const {
     return this->header.packet_id;
 }
@@ -1,21 +1,38 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstring>
 #include <memory>
+#include <span>
+#include <string_view>
 #include <utility>
 
 #include "Header.hpp"
+#include "PacketData.hpp"
 #include "Utils.hpp"
 #ifdef GTEST
 #include <gtest/gtest_prod.h>
 #endif
+/**
+ * True for packet types whose data can be shorter than their Data struct, such as TextPacket. Only the bytes used are
+ * sent, and the rest of Data reads as zeros. Such a packet type sets `static constexpr bool variable_size = true`.
+ */
+template <typename T>
+concept VariableSizePacket = requires { requires T::variable_size; };
+
 /**
  * Base class for packets to inherit from, that defines the data stored and available methods
  */
 class Packet {
+public:
+    /** Packets with at most this many data bytes are stored without allocating. See PacketData. */
+    static constexpr size_t INLINE_DATA_SIZE = PACKET_INLINE_DATA_SIZE;
+
 protected:
     /** The data bytes contained in the packet. */
-    std::vector<uint8_t> data;
+    PacketData<INLINE_DATA_SIZE> data;
 
     /** The header of the packet, containing metadata such as packet ID. */
     Header header;
@@ -25,10 +42,7 @@ protected:
      * @param data The data which is copied into the packets internal data buffer.
      */
     template <typename T>
-    Packet(Header header, const T& data) : data(sizeof(T)), header(header)
-    {
-        memcpy(this->data.data(), &data, sizeof(T));
-    }
+    Packet(Header header, const T& data) : data(reinterpret_cast<const uint8_t*>(&data), sizeof(T)), header(header) {}
 public:
     /**
      * This constructor is more convenient to use when the data is already in byte form or when the type of the data is
@@ -40,9 +54,32 @@ public:
      */
     explicit Packet(Header header, const uint8_t* data, size_t length);
 
+    /** @param data The data bytes, which may be shorter than a Data struct for variable size packets. */
+    explicit Packet(Header header, std::span<const uint8_t> data) : Packet(header, data.data(), data.size()) {}
+
+    /** @param text The data as characters, without a terminating zero. */
+    explicit Packet(Header header, std::string_view text)
+        : Packet(header, reinterpret_cast<const uint8_t*>(text.data()), text.size()) {}
+
+    Packet(const Packet&) = default;
+    /** Moving a packet never allocates, and takes the heap memory of large packets instead of copying it. */
+    Packet(Packet&&) noexcept = default;
+    Packet& operator=(const Packet&) = default;
+    Packet& operator=(Packet&&) noexcept = default;
+
     /** @returns The header and the data combined into one vector of bytes */
     std::vector<uint8_t> serialize() const;
 
+    /**
+     * Writes the header and the data into the given buffer, without allocating.
+     * @param output Where to write the bytes. Must be at least serialized_size() bytes.
+     * @returns The amount of bytes written, or 0 if output is too small.
+     */
+    size_t serialize(std::span<uint8_t> output) const;
+
+    /** @returns The amount of bytes serialize will produce. */
+    size_t serialized_size() const;
+
     uint8_t get_id() const;
 
     /**
@@ -52,10 +89,27 @@ public:
     requires std::derived_from<T, Packet>
     T::Data get_data() const {
         std::array<uint8_t, sizeof(typename T::Data)> bytes;
-        memcpy(&bytes, this->data.data(), sizeof(typename T::Data));
+        if constexpr (VariableSizePacket<T>) {
+            // The bytes that weren't sent read as zeros
+            bytes.fill(0);
+            memcpy(&bytes, this->data.data(), std::min(this->data.size(), sizeof(typename T::Data)));
+        }
+        else {
+            memcpy(&bytes, this->data.data(), sizeof(typename T::Data));
+        }
         return std::bit_cast<typename T::Data>(bytes);
     }
 
+    /** @returns The data bytes, only as many as the packet has. */
+    [[nodiscard]] std::span<const uint8_t> get_bytes() const {
+        return {this->data.data(), this->data.size()};
+    }
+
+    /** @returns The data as characters, such as the text of a TextPacket. */
+    [[nodiscard]] std::string_view get_text() const {
+        return {reinterpret_cast<const char*>(this->data.data()), this->data.size()};
+    }
+
 #ifdef GTEST
     friend class PacketTest; // give access to the private members
     FRIEND_TEST(PacketTest, ConstructingFromDataStruct); // give that test access to the protected constructor
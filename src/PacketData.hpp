@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+/**
+ * The default amount of data bytes a packet can hold without allocating. Every packet we send often (such as OpticalPacket)
+ * fits in this, and only large ones such as TextPacket go on the heap. Can be changed by defining it before this is included,
+ * or with a compile definition.
+ */
+#ifndef PACKET_INLINE_DATA_SIZE
+#define PACKET_INLINE_DATA_SIZE 64
+#endif
+
+/**
+ * A fixed length array of bytes that is stored inside the object when it is at most InlineSize bytes, and on the heap
+ * otherwise. Used for the data of packets so that small packets can be created, copied and moved without allocating,
+ * which matters on the Brain where allocating at a high rate causes latency spikes and fragments the heap.
+ * @tparam InlineSize The largest amount of bytes stored without allocating.
+ */
+template <size_t InlineSize>
+class PacketData {
+    /** The amount of bytes stored. Also decides where they are stored. */
+    size_t length;
+
+    union {
+        /** Used when length <= InlineSize. */
+        uint8_t inline_bytes[InlineSize];
+        /** Used when length > InlineSize. */
+        uint8_t* heap_bytes;
+    };
+
+    /** Takes the bytes of other, leaving it empty. this must not be holding any heap memory. */
+    void take(PacketData& other) noexcept {
+        this->length = other.length;
+        if (other.is_inline()) {
+            memcpy(this->inline_bytes, other.inline_bytes, other.length);
+        }
+        else {
+            this->heap_bytes = other.heap_bytes;
+        }
+        other.length = 0;
+    }
+
+    /** Frees the heap memory if there is any and empties this. */
+    void release() noexcept {
+        if (!this->is_inline())
+            delete[] this->heap_bytes;
+        this->length = 0;
+    }
+
+public:
+    /** Creates an empty array. */
+    PacketData() noexcept : length(0) {}
+
+    /** Creates an array of length bytes. The bytes are left uninitialized. */
+    explicit PacketData(const size_t length) : length(length) {
+        if (!this->is_inline())
+            this->heap_bytes = new uint8_t[length];
+    }
+
+    /** Creates an array with a copy of the given bytes. */
+    PacketData(const uint8_t* bytes, const size_t length) : PacketData(length) {
+        if (length == 0) return;
+        // Checks the argument instead of using data(), so the compiler can tell which case a constant length uses
+        if (length <= InlineSize) {
+            memcpy(this->inline_bytes, bytes, length);
+        }
+        else {
+            memcpy(this->heap_bytes, bytes, length);
+        }
+    }
+
+    PacketData(const PacketData& other) : PacketData(other.data(), other.length) {}
+
+    PacketData(PacketData&& other) noexcept : length(0) {
+        this->take(other);
+    }
+
+    PacketData& operator=(const PacketData& other) {
+        if (this != &other) {
+            PacketData copy{other};
+            this->release();
+            this->take(copy);
+        }
+        return *this;
+    }
+
+    PacketData& operator=(PacketData&& other) noexcept {
+        if (this != &other) {
+            this->release();
+            this->take(other);
+        }
+        return *this;
+    }
+
+    ~PacketData() {
+        this->release();
+    }
+
+    uint8_t* data() noexcept {
+        return this->is_inline() ? this->inline_bytes : this->heap_bytes;
+    }
+
+    const uint8_t* data() const noexcept {
+        return this->is_inline() ? this->inline_bytes : this->heap_bytes;
+    }
+
+    [[nodiscard]] size_t size() const noexcept {
+        return this->length;
+    }
+
+    [[nodiscard]] bool empty() const noexcept {
+        return this->length == 0;
+    }
+
+    /** @returns True if the bytes are stored inside this object instead of on the heap. */
+    [[nodiscard]] bool is_inline() const noexcept {
+        return this->length <= InlineSize;
+    }
+};
@@ -8,6 +8,9 @@ namespace PacketIds {
         INITIALIZE_OPTICAL,
         INITIALIZE_OPTICAL_COMPLETE,
         TEXT,
+        COMPACT_OPTICAL_KEYFRAME,
+        COMPACT_OPTICAL_DELTA,
+        FRAGMENT,
         LENGTH // Used to get the amount of packet ids at compile time
     };
 }
@@ -0,0 +1,81 @@
+#include "PacketSignal.hpp"
+
+#include <chrono>
+
+uint32_t PacketSignal::count() const {
+    return this->notifies.load(std::memory_order_seq_cst);
+}
+
+void PacketSignal::notify() {
+    // Both of these are sequentially consistent, the same as in wait. Either a waiter registered before this increment
+    // and is woken below, or it registers after and sees the new count before sleeping
+    this->notifies.fetch_add(1, std::memory_order_seq_cst);
+    if (this->waiters.load(std::memory_order_seq_cst) == 0)
+        return;
+
+#if PI
+    // Lock so the notify can't happen between a waiter checking the count and going to sleep
+    mutex.lock();
+    mutex.unlock();
+    this->notified.notify_all();
+#elif BRAIN
+    mutex.lock();
+    for (const pros::task_t task : this->tasks) {
+        if (task != nullptr)
+            pros::c::task_notify(task);
+    }
+    mutex.unlock();
+#endif
+}
+
+bool PacketSignal::wait(const uint32_t seen, const uint32_t timeout) {
+    this->waiters.fetch_add(1, std::memory_order_seq_cst);
+    bool changed = false;
+
+#if PI
+    std::unique_lock lock{mutex};
+    const auto is_changed = [this, seen] { return this->notifies.load(std::memory_order_seq_cst) != seen; };
+    if (timeout == 0) {
+        this->notified.wait(lock, is_changed);
+        changed = true;
+    }
+    else {
+        changed = this->notified.wait_for(lock, std::chrono::milliseconds(timeout), is_changed);
+    }
+#elif BRAIN
+    const pros::task_t current = pros::c::task_get_current();
+    mutex.lock();
+    pros::task_t* registered = nullptr;
+    for (pros::task_t& task : this->tasks) {
+        if (task == nullptr) {
+            task = current;
+            registered = &task;
+            break;
+        }
+    }
+    mutex.unlock();
+
+    const uint32_t start = pros::millis();
+    while (!(changed = this->notifies.load(std::memory_order_seq_cst) != seen)) {
+        const uint32_t waited = pros::millis() - start;
+        if (timeout != 0 && waited >= timeout)
+            break;
+
+        const uint32_t remaining = timeout == 0 ? TIMEOUT_MAX : timeout - waited;
+        // Notifications left over from an earlier wait can wake this early, which the loop checks for
+        if (registered != nullptr)
+            pros::c::task_notify_take(true, remaining);
+        else
+            pros::delay(1);
+    }
+
+    if (registered != nullptr) {
+        mutex.lock();
+        *registered = nullptr;
+        mutex.unlock();
+    }
+#endif
+
+    this->waiters.fetch_sub(1, std::memory_order_seq_cst);
+    return changed;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#if PI
+#include <condition_variable>
+#include <mutex>
+#endif
+#if BRAIN
+#include "api.h" // Needed for pros::Mutex and task notifications
+#endif
+
+/**
+ * Lets threads sleep until a packet is received, instead of polling. The receiving thread calls notify after storing
+ * each packet, and waiters sleep until the count of notifies changes from what they last saw.
+ *
+ * On the PI this is a condition variable. PROS has no condition variable, so on the Brain each waiting task registers
+ * itself and notify wakes it with a task notification. notify only takes the mutex when something is waiting, so
+ * receiving costs an atomic increment when nothing is.
+ */
+class PacketSignal {
+public:
+    /** The most tasks that can sleep at once on the Brain. Any more poll every millisecond instead. */
+    static constexpr size_t MAX_WAITERS = 8;
+
+    /** @returns The amount of notifies so far. Read it before checking for a packet, then pass it to wait. */
+    [[nodiscard]] uint32_t count() const;
+
+    /** Wakes every waiter. Called by the receiving thread after storing a packet. */
+    void notify();
+
+    /**
+     * Sleeps until count is no longer seen.
+     * @param seen The count from before checking for a packet, so a packet stored since then still ends the wait.
+     * @param timeout The longest time to wait in milliseconds, or 0 to wait forever.
+     * @returns False if the timeout passed first.
+     */
+    bool wait(uint32_t seen, uint32_t timeout);
+
+private:
+    std::atomic<uint32_t> notifies{0};
+    /** The amount of threads in wait, so notify can skip the mutex when there are none. */
+    std::atomic<uint32_t> waiters{0};
+
+#if PI
+    std::mutex mutex;
+    std::condition_variable notified;
+#elif BRAIN
+    pros::Mutex mutex;
+    /** The tasks sleeping in wait. Empty entries are nullptr. Only changed under mutex. */
+    std::array<pros::task_t, MAX_WAITERS> tasks{};
+#endif
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+#include "Header.hpp"
+#include "Packet.hpp"
+
+/**
+ * A read only view of a received packet of type T, pointing straight at the decoded bytes instead of copying them.
+ * Listeners taking a PacketView get one that points into the SerialHandler's receive storage, so it is only valid until
+ * the listener returns. Call to_packet to keep the packet after that.
+ *
+ * The bytes have no alignment, so fields are read by copying them out with get instead of through a pointer to Data.
+ * @tparam T The packet class, such as OpticalPacket.
+ */
+template <typename T>
+requires std::derived_from<T, Packet>
+class PacketView {
+    /** The header followed by the data, exactly as received. */
+    std::span<const uint8_t> bytes;
+
+public:
+    /** @param frame The header followed by the data of a packet with type T. The data must be the full size of T::Data. */
+    explicit PacketView(const std::span<const uint8_t> frame) : bytes(frame) {}
+
+    [[nodiscard]] Header header() const {
+        Header header;
+        memcpy(&header, this->bytes.data(), sizeof(Header));
+        return header;
+    }
+
+    [[nodiscard]] uint8_t get_id() const {
+        return this->header().packet_id;
+    }
+
+    /** @returns The data bytes after the header. */
+    [[nodiscard]] std::span<const uint8_t> data_bytes() const {
+        return this->bytes.subspan(sizeof(Header));
+    }
+
+    /**
+     * Reads a single field of the data without copying the rest of it.
+     * Example: view.get<&OpticalPacket::Data::heading>()
+     */
+    template <auto Member>
+    [[nodiscard]] auto get() const {
+        using Data = typename T::Data;
+        using Field = std::remove_cvref_t<decltype(std::declval<const Data&>().*Member)>;
+
+        // Find where the field is in the struct. This is folded into a constant by the compiler
+        static constexpr Data layout{};
+        const size_t offset = reinterpret_cast<const std::byte*>(&(layout.*Member)) - reinterpret_cast<const std::byte*>(&layout);
+
+        Field field;
+        if constexpr (VariableSizePacket<T>) {
+            // The field may be partly or entirely past the bytes that were sent, which read as zeros
+            const size_t available = this->data_bytes().size() > offset ? this->data_bytes().size() - offset : 0;
+            std::array<uint8_t, sizeof(Field)> bytes{};
+            memcpy(bytes.data(), this->data_bytes().data() + offset, std::min(available, sizeof(Field)));
+            memcpy(&field, bytes.data(), sizeof(Field));
+        }
+        else {
+            memcpy(&field, this->data_bytes().data() + offset, sizeof(Field));
+        }
+        return field;
+    }
+
+    /** @returns A copy of all the data. */
+    [[nodiscard]] auto data() const requires requires { typename T::Data; } {
+        typename T::Data data;
+        if constexpr (VariableSizePacket<T>) {
+            memset(&data, 0, sizeof(typename T::Data));
+            memcpy(&data, this->data_bytes().data(), std::min(this->data_bytes().size(), sizeof(typename T::Data)));
+        }
+        else {
+            memcpy(&data, this->data_bytes().data(), sizeof(typename T::Data));
+        }
+        return data;
+    }
+
+    /** @returns The data as characters, such as the text of a TextPacket. Points at the received bytes like the view. */
+    [[nodiscard]] std::string_view data_text() const {
+        return {reinterpret_cast<const char*>(this->data_bytes().data()), this->data_bytes().size()};
+    }
+
+    /** @returns A packet that owns a copy of the bytes, so it can be kept after the view is no longer valid. */
+    [[nodiscard]] Packet to_packet() const {
+        return Packet{this->header(), this->data_bytes().data(), this->data_bytes().size()};
+    }
+};
@@ -1,217 +1,1005 @@
 #include "SerialHandler.hpp"
 
+#include <array>
+#include <chrono>
+#include <cstddef>
 #include <cstring>
 #include <optional>
+#include <span>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 #include <cassert>
 
+#include "PacketRegistry.hpp"
+#include "Trace.hpp"
+#if BRAIN
+#include "FdTransport.hpp"
+#endif
+
 SerialHandler::SerialHandler(
 #if PI
     const UsbTransferWrapper* usb_wrapper
 #endif
     )
+{
 #if PI
-    :
-    device_handle(nullptr),
-    usb_wrapper(usb_wrapper)
+    auto usb_transport = std::make_unique<UsbTransport>(usb_wrapper);
+    this->usb = usb_transport.get();
+    this->owned_transport = std::move(usb_transport);
+#elif BRAIN
+    // PROS connects stdin and stdout to the USB serial port
+    this->owned_transport = std::make_unique<FdTransport>(STDIN_FILENO, STDOUT_FILENO);
 #endif
-{
+    this->transport = this->owned_transport.get();
+    this->set_default_send_priorities();
+}
+
+SerialHandler::SerialHandler(Transport& transport) : transport(&transport) {
+    this->set_default_send_priorities();
+}
+
+template <size_t... Ids>
+static std::array<Buffer, PacketIds::LENGTH> make_sized_buffers(std::index_sequence<Ids...>) {
+    return {Buffer{sizeof(Header) + Packets::data_sizes[Ids]}...};
+}
+
+std::array<Buffer, PacketIds::LENGTH> SerialHandler::make_buffers() {
+    return make_sized_buffers(std::make_index_sequence<PacketIds::LENGTH>{});
+}
+
+void SerialHandler::set_default_send_priorities() {
+    this->send_priorities[TextPacket::id] = SendPriority::BULK;
+    this->send_priorities[FragmentPacket::id] = SendPriority::BULK;
+}
+
+SerialHandler::~SerialHandler() {
+#if PI
+    this->stop_writer_thread();
+#endif
+    // Write whatever is still waiting to be sent
+    this->flush();
+    while (this->write_queued() > 0) {}
+    this->drop_queued_remaining();
 #if PI
-    // Initialize the libusb context. We pass nullptr as the context to use the global default one.
-    if (const int error = libusb_init_context(nullptr, nullptr, 0) != LIBUSB_SUCCESS) {
-        printf("Failed to initialize libusb context: %s\n", libusb_error_name(error));
+    this->stop_reader_thread();
+    this->stop_async_receive();
+#endif
+}
+
+
+// TODO: To be safe, sent packets should begin with a null byte to end the previous data, in the case tha theres unknown data
+// before it. It also couldn't hurt to add a small set of signature bytes to prefix a packet, to prevent junk data
+// having the chance to be a valid packet id and pollute the buffers
+std::optional<size_t> SerialHandler::encode_frame(const Packet& packet, const std::span<uint8_t> output) {
+    assert(packet.serialized_size() <= MAX_PACKET_SIZE && "Cannot send a packet with size greater than max packet size!");
+
+    // Serialize on the stack so sending does not allocate
+    std::array<uint8_t, MAX_PACKET_SIZE> data_to_send;
+    const size_t data_length = packet.serialize(data_to_send);
+    if (data_length == 0)
+        return std::nullopt;
+
+    #if PACKET_SEQUENCE
+    // Stamp the sequence here instead of in the packet, so resending the same packet object still counts up
+    data_to_send[offsetof(Header, sequence)] = this->send_sequences[packet.get_id()].fetch_add(1, std::memory_order_relaxed);
+    #endif
+
+    // Frame the packet using COBS
+    return Utils::cobs_encode(std::span{data_to_send.data(), data_length}, output);
+}
+
+size_t SerialHandler::write_once(const std::span<const uint8_t> bytes, const unsigned int timeout) {
+    TRACE_SCOPE("write");
+    const size_t written = this->transport->write(bytes, timeout);
+
+    #if LINK_METRICS
+    this->link_metrics.add_bytes_written(written);
+    #endif
+    return written;
+}
+
+void SerialHandler::write_bytes(std::span<const uint8_t> bytes) {
+    // Hold the write lock for every frame, so no other write lands in the middle of one after a partial write
+    write_mutex.lock();
+    while (!bytes.empty()) {
+        const size_t written = this->write_once(bytes, 0);
+        if (written == 0) {
+            this->send_dropped_bytes.fetch_add(bytes.size(), std::memory_order_relaxed);
+            break;
+        }
+        if (written < bytes.size())
+            this->send_partial_writes.fetch_add(1, std::memory_order_relaxed);
+        bytes = bytes.subspan(written);
+    }
+    write_mutex.unlock();
+}
+
+void SerialHandler::send(const Packet& packet) {
+    TRACE_SCOPE("send");
+    std::array<uint8_t, MAX_ENCODED_PACKET_SIZE> encoded;
+    const std::optional<size_t> encoded_length = encode_frame(packet, encoded);
+    if (!encoded_length.has_value())
+        return;
+
+    this->write_bytes(std::span{encoded.data(), *encoded_length});
+}
+
+void SerialHandler::send_buffered(const Packet& packet) {
+    TRACE_SCOPE("send_buffered");
+    std::array<uint8_t, MAX_ENCODED_PACKET_SIZE> encoded;
+    const std::optional<size_t> encoded_length = encode_frame(packet, encoded);
+    if (!encoded_length.has_value())
         return;
+
+    const uint64_t now = Utils::micros();
+    send_mutex.lock();
+    // Make room first, so frames are always written whole and in order
+    if (this->send_length + *encoded_length > SEND_BUFFER_SIZE)
+        this->flush_locked();
+
+    const bool started = this->send_length == 0;
+    if (started)
+        this->send_oldest_time = now;
+    memcpy(this->send_buffer.data() + this->send_length, encoded.data(), *encoded_length);
+    this->send_length += *encoded_length;
+
+    if (this->send_length >= this->send_flush_threshold || now - this->send_oldest_time >= this->send_flush_deadline)
+        this->flush_locked();
+    send_mutex.unlock();
+
+    #if PI
+    // The writer thread flushes the buffer when its deadline passes, so it has to know when a new deadline starts
+    if (started && this->writer_running.load(std::memory_order_relaxed)) {
+        send_queue_mutex.lock();
+        this->send_buffer_starts.fetch_add(1, std::memory_order_relaxed);
+        send_queue_mutex.unlock();
+        this->send_queue_ready.notify_one();
     }
+    #endif
+}
 
-    // Get the list of devices on the system
-    libusb_device** devices = nullptr;
-    const ssize_t device_count = libusb_get_device_list(nullptr, &devices);
-    if (device_count < 0) {
-        printf("Failed to get device list: %s\n", libusb_error_name(static_cast<int>(device_count)));
+void SerialHandler::flush() {
+    send_mutex.lock();
+    this->flush_locked();
+    send_mutex.unlock();
+}
+
+void SerialHandler::flush_if_due() {
+    const uint64_t now = Utils::micros();
+    send_mutex.lock();
+    if (this->send_length > 0 && now - this->send_oldest_time >= this->send_flush_deadline)
+        this->flush_locked();
+    send_mutex.unlock();
+}
+
+void SerialHandler::flush_locked() {
+    if (this->send_length == 0)
         return;
+
+    this->write_bytes(std::span{this->send_buffer.data(), this->send_length});
+    this->send_length = 0;
+}
+
+bool SerialHandler::send_message(const std::span<const uint8_t> message) {
+    const bool split = this->fragmenter.split(message, [this](const FragmentPacket& fragment) {
+        this->send_buffered(fragment);
+    });
+    this->flush();
+    return split;
+}
+
+bool SerialHandler::send_async(const Packet& packet) {
+    return this->send_async(packet, this->send_priorities[packet.get_id()].load(std::memory_order_relaxed));
+}
+
+bool SerialHandler::send_async(const Packet& packet, const SendPriority priority) {
+    TRACE_SCOPE("send_async");
+    std::array<uint8_t, MAX_ENCODED_PACKET_SIZE> encoded;
+    const std::optional<size_t> encoded_length = encode_frame(packet, encoded);
+    if (!encoded_length.has_value())
+        return false;
+
+    SendQueue& queue = this->send_queues[static_cast<size_t>(priority)];
+    send_queue_mutex.lock();
+    const size_t head = queue.head.load(std::memory_order_relaxed);
+    const size_t free = SEND_QUEUE_SIZE - (head - queue.tail.load(std::memory_order_acquire));
+    if (*encoded_length > free) {
+        send_queue_mutex.unlock();
+        this->send_dropped_packets.fetch_add(1, std::memory_order_relaxed);
+        this->send_dropped_bytes.fetch_add(*encoded_length, std::memory_order_relaxed);
+        return false;
     }
 
-    // TODO: We should probably retry initializing the context and getting the device list if they ever fail.
+    // The frame may wrap around the end of the ring
+    const size_t start = head % SEND_QUEUE_SIZE;
+    const size_t first = std::min(*encoded_length, SEND_QUEUE_SIZE - start);
+    memcpy(queue.bytes.data() + start, encoded.data(), first);
+    memcpy(queue.bytes.data(), encoded.data() + first, *encoded_length - first);
+    queue.head.store(head + *encoded_length, std::memory_order_release);
+    send_queue_mutex.unlock();
 
-    // Loop the connected devices to find the VEX V5 Brain
-    for (int i = 0; i < device_count; i++) {
-        libusb_device_descriptor device_descriptor{};
-        // Get the device descriptor. If LIBUSBX_API_VERSION >= 0x01000102 then this function will never fail.
-        if (libusb_get_device_descriptor(devices[i], &device_descriptor) != LIBUSB_SUCCESS)
-            continue;
+    #if PI
+    this->send_queue_ready.notify_one();
+    #endif
+    return true;
+}
 
-        if (device_descriptor.idVendor == VEX_USB_VENDOR_ID) {
-            libusb_device_handle* handle = nullptr;
-            if (const int error = libusb_open(devices[i], &handle) != LIBUSB_SUCCESS) {
-                printf("Failed to open VEX Brain: %s\n", libusb_error_name(error));
-                // TODO: If we find it can error, we should make a loop to try to open multiple times
-                return;
-            }
-            this->device_handle = handle;
+void SerialHandler::set_send_fairness(const size_t bytes) {
+    this->send_fairness_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+size_t SerialHandler::queued_frames_length(const SendQueue& queue, const size_t queued, const size_t max_length) {
+    const size_t tail = queue.tail.load(std::memory_order_relaxed);
+    size_t end = 0;
+    size_t scanned = 0;
+    while (scanned < queued) {
+        // Frames end at their delimiter, which may be after the ring wraps around
+        const size_t start = (tail + scanned) % SEND_QUEUE_SIZE;
+        const size_t search = std::min(queued - scanned, SEND_QUEUE_SIZE - start);
+        const auto* delimiter = static_cast<const uint8_t*>(memchr(queue.bytes.data() + start, 0, search));
+        if (delimiter == nullptr) {
+            scanned += search;
+            continue;
+        }
 
-            libusb_detach_kernel_driver(handle, VEX_USB_USER_INTERFACE_NUMBER);
-            libusb_detach_kernel_driver(handle, VEX_USB_USER_DATA_INTERFACE_NUMBER);
+        scanned += delimiter - (queue.bytes.data() + start) + 1;
+        if (end > 0 && scanned > max_length)
+            break;
+        end = scanned;
+        if (end >= max_length)
+            break;
+    }
+    return end;
+}
 
-            // Since this is output, line_coding_bytes will not be modified by libusb_control_transfer
-            libusb_control_transfer(
-                handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
-                SET_LINE_CODING, 0, VEX_USB_COMMUNICATIONS_INTERFACE_NUMBER, const_cast<unsigned char*>(line_coding_bytes),
-                sizeof(line_coding_bytes), 0);
+bool SerialHandler::schedule_send() {
+    std::array<size_t, static_cast<size_t>(SendPriority::LENGTH)> queued;
+    for (size_t i = 0; i < queued.size(); i++) {
+        const SendQueue& queue = this->send_queues[i];
+        queued[i] = queue.head.load(std::memory_order_acquire) - queue.tail.load(std::memory_order_relaxed);
+    }
 
-            libusb_control_transfer(
-                handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
-                SET_LINE_CODING, 0, VEX_USB_USER_INTERFACE_NUMBER, const_cast<unsigned char*>(line_coding_bytes), sizeof(line_coding_bytes), 0);
+    // The highest priority with frames waiting, unless a lower one has waited long enough to be owed a frame
+    const size_t fairness = this->send_fairness_bytes.load(std::memory_order_relaxed);
+    size_t pick = queued.size();
+    bool owed = false;
+    for (size_t i = 0; i < queued.size(); i++) {
+        if (queued[i] == 0)
+            continue;
+        if (pick == queued.size())
+            pick = i;
+        else if (this->send_queues[i].skipped >= fairness) {
+            pick = i;
+            owed = true;
             break;
+        }
+    }
+    if (pick == queued.size())
+        return false;
 
+    // A priority that is owed a frame only gets one, so it can't hold up higher priorities for long
+    SendQueue& queue = this->send_queues[pick];
+    const size_t length = queued_frames_length(queue, queued[pick], owed ? 1 : SEND_WRITE_QUANTUM);
+    if (length == 0)
+        return false;
+
+    queue.skipped = 0;
+    for (size_t i = pick + 1; i < queued.size(); i++) {
+        if (queued[i] > 0)
+            this->send_queues[i].skipped += length;
+    }
+    this->send_current = pick;
+    this->send_current_remaining = length;
+    return true;
+}
+
+size_t SerialHandler::write_queued() {
+    // Finish the frames already picked before picking again, so frames are never interleaved. The write lock is taken
+    // when frames are picked and kept until they are all written, even across calls
+    if (this->send_current_remaining == 0) {
+        write_mutex.lock();
+        if (!this->schedule_send()) {
+            write_mutex.unlock();
+            return 0;
         }
     }
 
-    // All devices start with ref count of 1, this subtracts 1 so it dereferences them all
-    libusb_free_device_list(devices, 1);
+    // Only write up to the end of the ring, the rest is written by the next call
+    SendQueue& queue = this->send_queues[this->send_current];
+    const size_t tail = queue.tail.load(std::memory_order_relaxed);
+    const size_t start = tail % SEND_QUEUE_SIZE;
+    const size_t length = std::min(this->send_current_remaining, SEND_QUEUE_SIZE - start);
+    const size_t written = this->write_once(std::span{queue.bytes.data() + start, length}, SEND_TIMEOUT);
+    if (written > 0 && written < length)
+        this->send_partial_writes.fetch_add(1, std::memory_order_relaxed);
+
+    // Senders can only reuse the space once the bytes are written
+    queue.tail.store(tail + written, std::memory_order_release);
+    this->send_current_remaining -= written;
+    if (this->send_current_remaining == 0)
+        write_mutex.unlock();
+    return written;
+}
 
-    if (!this->device_handle) printf("Failed to find vex brain!\n");
-#endif
+void SerialHandler::drop_queued_remaining() {
+    if (this->send_current_remaining == 0)
+        return;
+
+    SendQueue& queue = this->send_queues[this->send_current];
+    queue.tail.store(queue.tail.load(std::memory_order_relaxed) + this->send_current_remaining, std::memory_order_release);
+    this->send_dropped_bytes.fetch_add(this->send_current_remaining, std::memory_order_relaxed);
+    this->send_current_remaining = 0;
+    write_mutex.unlock();
 }
 
-SerialHandler::~SerialHandler() {
-#if PI
-    if (this->device_handle) {
-        libusb_close(this->device_handle);
-        libusb_exit(nullptr);
+size_t SerialHandler::queued_send_bytes() const {
+    size_t queued = 0;
+    for (const SendQueue& queue : this->send_queues) {
+        queued += queue.head.load(std::memory_order_acquire) - queue.tail.load(std::memory_order_acquire);
     }
+    return queued;
+}
+
+size_t SerialHandler::queued_send_bytes(const SendPriority priority) const {
+    const SendQueue& queue = this->send_queues[static_cast<size_t>(priority)];
+    return queue.head.load(std::memory_order_acquire) - queue.tail.load(std::memory_order_acquire);
+}
+
+#if LINK_METRICS
+LinkMetrics::Snapshot SerialHandler::metrics() const {
+    LinkMetrics::Snapshot snapshot = this->link_metrics.snapshot();
+    for (const Buffer& buffer : this->buffers) {
+        snapshot.buffer_overflows += buffer.dropped();
+    }
+    return snapshot;
+}
 #endif
+
+SerialHandler::SendStats SerialHandler::send_stats() const {
+    return SendStats{
+        this->send_dropped_packets.load(std::memory_order_relaxed),
+        this->send_dropped_bytes.load(std::memory_order_relaxed),
+        this->send_partial_writes.load(std::memory_order_relaxed),
+    };
 }
 
+void SerialHandler::set_send_flush_threshold(const size_t bytes) {
+    send_mutex.lock();
+    this->send_flush_threshold = std::min(bytes, SEND_BUFFER_SIZE);
+    send_mutex.unlock();
+}
 
-// TODO: To be safe, sent packets should begin with a null byte to end the previous data, in the case tha theres unknown data
-// before it. It also couldn't hurt to add a small set of signature bytes to prefix a packet, to prevent junk data
-// having the chance to be a valid packet id and pollute the buffers
-void SerialHandler::send(const Packet& packet) {
-    std::vector<uint8_t> data_to_send = packet.serialize();
+void SerialHandler::set_send_flush_deadline(const uint32_t microseconds) {
+    send_mutex.lock();
+    this->send_flush_deadline = microseconds;
+    send_mutex.unlock();
+}
 
-    assert(data_to_send.size() <= MAX_PACKET_SIZE && "Cannot send a packet with size greater than max packet size!");
 
-    // Frame the packet using COBS
-    std::optional<std::vector<uint8_t>> encoded = Utils::cobs_encode(data_to_send);
-    if (!encoded.has_value())
+#if BRAIN
+bool SerialHandler::try_receive() {
+    // Finish off whatever is left from the last read before reading more
+    if (this->read_index == this->read_length && !this->read_more())
+        return false;
+
+    return this->decode_read_buffer() != CobsDecoder::Result::INCOMPLETE;
+}
+#endif
+
+void SerialHandler::receive() {
+    TRACE_SCOPE("receive");
+    while (true) {
+        // Only read once everything from the last read has been decoded, otherwise a read can hold multiple packets
+        if (this->read_index < this->read_length) {
+            // Returns on both valid and invalid frames, since either way a frame was read
+            if (this->decode_read_buffer() != CobsDecoder::Result::INCOMPLETE)
+                return;
+            continue;
+        }
+
+        this->read_more();
+    }
+}
+
+size_t SerialHandler::receive_all() {
+    TRACE_SCOPE("receive_all");
+    if (this->read_index == this->read_length) {
+        #if PI
+        // Keep trying until the blocking read actually returns something
+        while (!this->read_more()) {}
+        #elif BRAIN
+        if (!this->read_more())
+            return 0;
+        #endif
+    }
+
+    // Decode every frame left in the read
+    const size_t received = this->decode_all(
+        std::span<const uint8_t>{this->read_buffer + this->read_index, this->read_length - this->read_index});
+    this->read_index = this->read_length;
+    return received;
+}
+
+size_t SerialHandler::decode_all(std::span<const uint8_t> bytes) {
+    // Check which packets have listeners once with a single lock, so packets without one never lock.
+    // Packets that had one are checked again before their listener is called, in case it was removed since
+    const std::array<bool, PacketIds::LENGTH> has_listener = this->listener_snapshot();
+
+    size_t received = 0;
+    while (!bytes.empty()) {
+        const auto [consumed, result] = this->feed_decoder(bytes);
+        bytes = bytes.subspan(consumed);
+
+        if (result != CobsDecoder::Result::FRAME || !this->accept_frame(this->decoder.frame())) continue;
+        // The frame stays in frame_buffer until the next feed, so it is delivered straight from there
+        this->deliver_frame(this->decoder.frame(), has_listener);
+        received++;
+    }
+
+    return received;
+}
+
+bool SerialHandler::set_listener(const uint8_t id, Listener&& listener) {
+    mutex.lock();
+    if (this->listeners[id].has_function()) {
+        mutex.unlock();
+        return false;
+    }
+    this->listeners[id].set(std::move(listener));
+    mutex.unlock();
+    return true;
+}
+
+void SerialHandler::call_listener(const std::span<const uint8_t> frame) {
+    GuardedFunction<Listener>& listener = this->listeners[frame[0]];
+    mutex.lock();
+    const bool calling = listener.begin_call();
+    mutex.unlock();
+    if (!calling)
         return;
 
-    // Write the data to the serial connection
-    // TODO: Both of these functions have a possibility to not fully send all of the data, we would need to resend the part not sent
-    #if BRAIN
-    write(STDOUT_FILENO, encoded->data(), encoded->size());
-    #elif PI
-    libusb_bulk_transfer(this->device_handle, VEX_USB_USER_DATA_ENDPOINT_OUT, encoded->data(),
-                         static_cast<int>(encoded->size()), nullptr, 0);
+    // call the function while NOT locked, so a user doesn't call a method like add_listener which requires a lock and causes a deadlock.
+    // A listener removed or replaced meanwhile is kept until end_call, so it can't be destroyed while it runs
+    TRACE_SCOPE("listener");
+    #if LINK_METRICS
+    const uint64_t start = Utils::micros();
     #endif
+    listener.function(*this, frame);
+    #if LINK_METRICS
+    this->link_metrics.add_listener_call(Utils::micros() - start);
+    #endif
+
+    mutex.lock();
+    listener.end_call();
+    mutex.unlock();
 }
 
+std::array<bool, PacketIds::LENGTH> SerialHandler::listener_snapshot() {
+    TRACE_SCOPE("listener_lock");
+    std::array<bool, PacketIds::LENGTH> has_listener{};
+    mutex.lock();
+    for (size_t id = 0; id < PacketIds::LENGTH; id++) {
+        has_listener[id] = this->listeners[id].has_function();
+    }
+    mutex.unlock();
+    return has_listener;
+}
 
-#if BRAIN
-bool SerialHandler::try_receive() {
-    ssize_t num_read = read(STDIN_FILENO, this->buffer + this->next_write_index, MAX_LIBUSB_PACKET_SIZE);
+void SerialHandler::create_reassembler() {
+    reassembly_mutex.lock();
+    if (!this->reassembler)
+        this->reassembler = std::make_unique<Reassembler>();
+    reassembly_mutex.unlock();
+}
+
+std::optional<std::span<const uint8_t>> SerialHandler::reassemble(const std::span<const uint8_t> frame) {
+    if (!this->reassembler)
+        return std::nullopt;
+
+    const std::optional<std::span<const uint8_t>> message = this->reassembler->add(frame, Utils::micros());
+    const Reassembler::Stats stats = this->reassembler->stats();
+    this->reassembly_counts.completed.store(stats.completed, std::memory_order_relaxed);
+    this->reassembly_counts.timed_out.store(stats.timed_out, std::memory_order_relaxed);
+    this->reassembly_counts.evicted.store(stats.evicted, std::memory_order_relaxed);
+    this->reassembly_counts.invalid.store(stats.invalid, std::memory_order_relaxed);
+    this->reassembly_counts.duplicates.store(stats.duplicates, std::memory_order_relaxed);
+    return message;
+}
+
+/**
+ * @param deadline When the wait ends in Utils::micros time, or 0 to wait forever.
+ * @returns The milliseconds left until the deadline, rounded up so the last wait doesn't end early. 0 to wait forever
+ * when there is no deadline, or nullopt if it has passed.
+ */
+static std::optional<uint32_t> millis_until(const uint64_t deadline) {
+    if (deadline == 0)
+        return 0;
+    const uint64_t now = Utils::micros();
+    if (now >= deadline)
+        return std::nullopt;
+    return static_cast<uint32_t>((deadline - now + 999) / 1000);
+}
+
+std::optional<Packet> SerialHandler::wait_for(const uint8_t id, const uint32_t timeout) {
+    if (id >= PacketIds::LENGTH)
+        return std::nullopt;
+
+    const uint64_t deadline = timeout == 0 ? 0 : Utils::micros() + timeout * uint64_t{1000};
+    while (true) {
+        // Take the count before looking, so a packet stored in between still ends the wait
+        const uint32_t seen = this->packet_signal.count();
+        // Conflated packets only go to the latest slot, so the buffer would never fill. Checked every time since
+        // conflating can be turned on during the wait
+        if (this->conflating[id].load(std::memory_order_relaxed))
+            return std::nullopt;
+        if (std::optional<Packet> packet = this->buffers[id].pop_oldest())
+            return packet;
+
+        // Another thread may pop the packet first, so check again after every wake until the deadline
+        const std::optional<uint32_t> remaining = millis_until(deadline);
+        if (!remaining.has_value() || !this->packet_signal.wait(seen, *remaining))
+            return std::nullopt;
+    }
+}
+
+std::optional<uint8_t> SerialHandler::wait_any(const std::span<const uint8_t> ids, const uint32_t timeout) {
+    // Conflated ids have a packet in their latest slot forever once one arrives, so only newer writes end the wait
+    std::array<uint32_t, PacketIds::LENGTH> latest_writes;
+    for (size_t id = 0; id < PacketIds::LENGTH; id++) {
+        latest_writes[id] = this->latest[id].writes();
+    }
+
+    const uint64_t deadline = timeout == 0 ? 0 : Utils::micros() + timeout * uint64_t{1000};
+    while (true) {
+        const uint32_t seen = this->packet_signal.count();
+        for (const uint8_t id : ids) {
+            if (id >= PacketIds::LENGTH)
+                continue;
+            if (this->buffers[id].size() > 0 || this->latest[id].writes() != latest_writes[id])
+                return id;
+        }
+
+        const std::optional<uint32_t> remaining = millis_until(deadline);
+        if (!remaining.has_value() || !this->packet_signal.wait(seen, *remaining))
+            return std::nullopt;
+    }
+}
+
+Reassembler::Stats SerialHandler::reassembly_stats() const {
+    return Reassembler::Stats{
+        this->reassembly_counts.completed.load(std::memory_order_relaxed),
+        this->reassembly_counts.timed_out.load(std::memory_order_relaxed),
+        this->reassembly_counts.evicted.load(std::memory_order_relaxed),
+        this->reassembly_counts.invalid.load(std::memory_order_relaxed),
+        this->reassembly_counts.duplicates.load(std::memory_order_relaxed),
+    };
+}
+
+void SerialHandler::store_frame(const std::span<const uint8_t> frame) {
+    const uint8_t id = frame[0];
+    // Packets too large for the slot can't be conflated, so they still go in the buffer
+    if (this->conflating[id].load(std::memory_order_relaxed) && frame.size() - sizeof(Header) <= LatestSlot::MAX_SIZE) {
+        this->latest[id].write(frame.subspan(sizeof(Header)));
+        return;
+    }
+    this->buffers[id].add(frame);
+}
+
+#if PACKET_SEQUENCE
+void SerialHandler::track_sequence(const std::span<const uint8_t> frame) {
+    const Header header = PacketView<Packet>{frame}.header();
+    SequenceTracker& tracker = this->sequence_trackers[header.packet_id];
+    tracker.received.fetch_add(1, std::memory_order_relaxed);
+
+    // The first packet of each type sets where counting starts, since the sender may have been running for a while
+    if (!tracker.started) {
+        tracker.started = true;
+        tracker.expected = header.sequence + 1;
+        return;
+    }
+
+    // How far ahead of what we expected this is. Anything more than half the range behind is treated as behind
+    const auto ahead = static_cast<int8_t>(header.sequence - tracker.expected);
+    if (ahead == 0) {
+        tracker.expected++;
+        return;
+    }
+
+    SequenceEvent event{SequenceEvent::Kind::GAP, header.packet_id, tracker.expected, header.sequence};
+    if (ahead > 0) {
+        // Every packet between what we expected and this one is missing
+        tracker.lost.fetch_add(ahead, std::memory_order_relaxed);
+        tracker.expected = header.sequence + 1;
+    }
+    else if (header.sequence == static_cast<uint8_t>(tracker.expected - 1)) {
+        event.kind = SequenceEvent::Kind::DUPLICATE;
+        tracker.duplicates.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        // A packet that was counted as lost showed up late
+        event.kind = SequenceEvent::Kind::REORDERED;
+        tracker.reordered.fetch_add(1, std::memory_order_relaxed);
+        if (tracker.lost.load(std::memory_order_relaxed) > 0)
+            tracker.lost.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    mutex.lock();
+    const bool calling = this->sequence_callback.begin_call();
+    mutex.unlock();
+    if (!calling)
+        return;
+
+    // call the function while NOT locked, so it can call set_sequence_callback without a deadlock.
+    // A callback replaced meanwhile is kept until end_call, so it can't be destroyed while it runs
+    this->sequence_callback.function(*this, event);
+    mutex.lock();
+    this->sequence_callback.end_call();
+    mutex.unlock();
+}
 
-    if (num_read <= 0) {
-        // handle errors
+SerialHandler::SequenceStats SerialHandler::sequence_stats(const uint8_t id) const {
+    const SequenceTracker& tracker = this->sequence_trackers[id];
+    return SequenceStats{
+        tracker.received.load(std::memory_order_relaxed),
+        tracker.lost.load(std::memory_order_relaxed),
+        tracker.duplicates.load(std::memory_order_relaxed),
+        tracker.reordered.load(std::memory_order_relaxed),
+    };
+}
+
+void SerialHandler::set_sequence_callback(SequenceCallback&& callback) {
+    mutex.lock();
+    this->sequence_callback.set(std::move(callback));
+    mutex.unlock();
+}
+#endif
+
+void SerialHandler::deliver_frame(std::span<const uint8_t> frame, const std::array<bool, PacketIds::LENGTH>& has_listener) {
+    #if PACKET_SEQUENCE
+    this->track_sequence(frame);
+    #endif
+
+    #if LINK_METRICS
+    this->link_metrics.add_frame(frame[0]);
+    #endif
+
+    // Compact optical packets are turned back into an OpticalPacket here, so everything after only sees OpticalPackets
+    std::array<uint8_t, sizeof(Header) + sizeof(OpticalPacket::Data)> expanded;
+    if (CompactOpticalDecoder::is_compact(frame[0])) {
+        const std::optional<OpticalPacket::Data> sample = this->compact_optical.decode(frame);
+        if (!sample.has_value())
+            return;
+        // Keep the rest of the header, such as the sequence number
+        memcpy(expanded.data(), frame.data(), sizeof(Header));
+        expanded[offsetof(Header, packet_id)] = OpticalPacket::id;
+        memcpy(expanded.data() + sizeof(Header), &*sample, sizeof(OpticalPacket::Data));
+        frame = expanded;
+    }
+
+    // the buffers are lock-free, only the listeners need the lock
+    this->store_frame(frame);
+    // Wake waiters before running the listener, so they don't wait on it
+    this->packet_signal.notify();
+
+    if (has_listener[frame[0]])
+        this->call_listener(frame);
+}
+
+#if PI
+/**
+ * Keeps transfers that libusb never gave back, and the memory they read into, alive for the rest of the program.
+ * Kept reachable instead of just leaked, so leak checkers don't report them.
+ */
+static void abandon_transfers(std::vector<libusb_transfer*>&& transfers, std::vector<unsigned char>&& buffer) {
+    static std::mutex abandoned_mutex;
+    // Never destroyed, since libusb could still write to them while the program exits
+    static auto* abandoned = new std::vector<std::pair<std::vector<libusb_transfer*>, std::vector<unsigned char>>>;
+    abandoned_mutex.lock();
+    abandoned->emplace_back(std::move(transfers), std::move(buffer));
+    abandoned_mutex.unlock();
+}
+
+bool SerialHandler::start_async_receive(const size_t transfer_count, const int transfer_size) {
+    assert(transfer_size > 0 && transfer_size % MAX_LIBUSB_PACKET_SIZE == 0 && "Transfers must be a multiple of the max libusb packet size!");
+    // Only USB can queue transfers
+    if (this->async_running || transfer_count == 0 || !this->usb)
         return false;
+
+    this->async_buffer.resize(transfer_count * transfer_size);
+    this->async_running = true;
+    for (size_t i = 0; i < transfer_count; i++) {
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        if (!transfer) {
+            printf("Failed to allocate libusb transfer\n");
+            break;
+        }
+        this->async_transfers.push_back(transfer);
+
+        // A timeout of 0 means the transfer waits until data arrives, same as the blocking receive
+        libusb_fill_bulk_transfer(transfer, this->usb->handle(), VEX_USB_USER_DATA_ENDPOINT_IN,
+                                  this->async_buffer.data() + i * transfer_size, transfer_size,
+                                  async_transfer_callback, this, 0);
+
+        if (const int error = this->usb->wrapper()->libusb_submit_transfer(transfer); error != LIBUSB_SUCCESS) {
+            printf("Failed to submit libusb transfer: %s\n", libusb_error_name(error));
+            continue;
+        }
+        this->async_active_transfers++;
     }
 
-    this->next_write_index += num_read;
-    // if the next write index is > the size then something has gone wrong on the senders side. the entire message will
-    // be discarded, because if index keeps growing we will exceed the length of the buffer. this is not an issue if the sender
-    // doesnt send data > max_packer_size
-    if (this->next_write_index >= MAX_PACKET_SIZE) {
-        this->next_write_index = 0;
+    if (this->async_active_transfers == 0) {
+        this->stop_async_receive();
         return false;
     }
+    return true;
+}
 
-    auto it = std::ranges::find(this->buffer, '\0');
-    // make sure the packet has ended
-    if (it == std::ranges::end(this->buffer) || it - this->buffer >= this->next_write_index)
+void SerialHandler::handle_events() {
+    if (!this->usb)
+        return;
+    if (const int error = this->usb->wrapper()->libusb_handle_events(this->usb->context()); error != LIBUSB_SUCCESS)
+        printf("Error: %s\n", libusb_error_name(error));
+}
+
+void SerialHandler::stop_async_receive(const unsigned int timeout) {
+    this->async_running = false;
+
+    // Cancelled transfers still complete through the callback, which won't submit them again now that we aren't running.
+    // Cancelling one that already completed fails, but its callback has then been called or is about to be
+    for (libusb_transfer* transfer : this->async_transfers) {
+        this->usb->wrapper()->libusb_cancel_transfer(transfer);
+    }
+
+    // libusb owns a transfer until its callback is called, so keep handling events until every one has been
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (this->async_active_transfers > 0 && std::chrono::steady_clock::now() < deadline) {
+        timeval wait{0, 10'000};
+        if (const int error = this->usb->wrapper()->libusb_handle_events_timeout(this->usb->context(), &wait);
+            error != LIBUSB_SUCCESS && error != LIBUSB_ERROR_INTERRUPTED)
+            printf("Error: %s\n", libusb_error_name(error));
+    }
+
+    if (this->async_active_transfers > 0) {
+        // Freeing these would let libusb write into freed memory, so they are abandoned for the rest of the program.
+        // Their callbacks find no handler and do nothing
+        printf("Error: %zu libusb transfers were not cancelled in time, abandoning them\n", this->async_active_transfers);
+        for (libusb_transfer* transfer : this->async_transfers) {
+            transfer->user_data = nullptr;
+        }
+        abandon_transfers(std::move(this->async_transfers), std::move(this->async_buffer));
+    }
+    else {
+        for (libusb_transfer* transfer : this->async_transfers) {
+            libusb_free_transfer(transfer);
+        }
+    }
+    this->async_transfers.clear();
+    this->async_buffer.clear();
+    this->async_active_transfers = 0;
+}
+
+bool SerialHandler::start_reader_thread() {
+    if (this->reader_running.exchange(true))
         return false;
 
-    this->decode_packet(it);
+    this->reader_thread = std::thread{&SerialHandler::reader_loop, this};
     return true;
 }
-#endif
 
-void SerialHandler::receive() {
-    // Get a pointer to the first null byte in the buffer
-    auto it = std::ranges::find(this->buffer, '\0');
-    while (it == std::ranges::end(this->buffer) // If a null byte is not found in the buffer
-        || it - this->buffer >= this->next_write_index) { // If the null byte that gets found is past the amount of data we actually read
+void SerialHandler::stop_reader_thread() {
+    this->reader_running = false;
+    if (this->reader_thread.joinable())
+        this->reader_thread.join();
+}
 
-        int num_read = 0;
-        // Reading the MAX_PACKET_SIZE is important so that libusb does not throw an error for not having enough room for the data (and cause undefined behavior)
-        // https://libusb.sourceforge.io/api-1.0/libusb_packetoverflow.html
-        // We read to buffer + an offset in case the packet we are reading spans multiple libusb packets
+size_t SerialHandler::process_incoming() {
+    const std::array<bool, PacketIds::LENGTH> has_listener = this->listener_snapshot();
 
-        #if PI
-        const int res = usb_wrapper->libusb_bulk_transfer(this->device_handle, VEX_USB_USER_DATA_ENDPOINT_IN,
-                                       this->buffer + this->next_write_index, MAX_LIBUSB_PACKET_SIZE, &num_read, 0);
-        if (res)
-            printf("Error: %s\n", libusb_error_name(res));
+    size_t processed = 0;
+    std::array<uint8_t, MAX_PACKET_SIZE> frame;
+    while (std::optional<Packet> packet = this->incoming.pop()) {
+        const size_t length = packet->serialize(frame);
+        this->deliver_frame(std::span{frame.data(), length}, has_listener);
+        processed++;
+    }
+    return processed;
+}
 
-        #elif BRAIN
-        num_read = read(STDIN_FILENO, this->buffer + this->next_write_index, MAX_LIBUSB_PACKET_SIZE);
-        if (num_read <= 0) {
-            // possibly handle error if its -1
+size_t SerialHandler::dropped_incoming() const {
+    return this->incoming_dropped.load(std::memory_order_relaxed);
+}
+
+bool SerialHandler::start_writer_thread() {
+    if (this->writer_running.exchange(true))
+        return false;
+
+    this->writer_thread = std::thread{&SerialHandler::writer_loop, this};
+    return true;
+}
+
+void SerialHandler::stop_writer_thread() {
+    // Lock so the writer can't miss the notify between checking writer_running and waiting
+    send_queue_mutex.lock();
+    this->writer_running = false;
+    send_queue_mutex.unlock();
+    this->send_queue_ready.notify_one();
+
+    if (this->writer_thread.joinable())
+        this->writer_thread.join();
+}
+
+std::chrono::microseconds SerialHandler::send_flush_wait() {
+    const uint64_t now = Utils::micros();
+    std::chrono::microseconds wait = std::chrono::milliseconds(SEND_TIMEOUT);
+    send_mutex.lock();
+    if (this->send_length > 0) {
+        const uint64_t due = this->send_oldest_time + this->send_flush_deadline;
+        wait = std::min(wait, std::chrono::microseconds(due > now ? due - now : 0));
+    }
+    send_mutex.unlock();
+    return wait;
+}
+
+void SerialHandler::writer_loop() {
+    while (this->writer_running.load(std::memory_order_relaxed)) {
+        // Write buffered packets whose deadline passed, so the last packet sent with send_buffered isn't left waiting.
+        // Not while queued frames are part way written, since this thread already holds the write lock for them
+        if (this->send_current_remaining == 0)
+            this->flush_if_due();
+
+        const size_t queued = this->queued_send_bytes();
+        if (queued > 0 && this->write_queued() > 0)
             continue;
-            // continue, otherwise it could be -1 and then -1 gets added to next_write_index which messes up the buffer
-            // this error handling might not be ideal because in some error cases the buffer might be written to partially before having an error occur
-        }
-        #endif
 
+        // Either there is nothing to write or the write failed. Wait for more bytes or for the send buffer to be due,
+        // so a failing write isn't retried in a tight loop. The starts are read before the wait is worked out, so a
+        // packet buffered in between still wakes us. send_buffered takes send_mutex before the write lock, so it can't
+        // be taken here while the write lock is held
+        const size_t starts = this->send_buffer_starts.load(std::memory_order_relaxed);
+        const std::chrono::microseconds wait = this->send_current_remaining == 0
+            ? this->send_flush_wait() : std::chrono::milliseconds(SEND_TIMEOUT);
+        std::unique_lock lock{send_queue_mutex};
+        this->send_queue_ready.wait_for(lock, wait, [this, queued, starts] {
+            return !this->writer_running.load(std::memory_order_relaxed) || this->queued_send_bytes() != queued
+                || this->send_buffer_starts.load(std::memory_order_relaxed) != starts;
+        });
+    }
 
+    // Only this thread can release the write lock, so finish the frames it is part way through before exiting
+    while (this->send_current_remaining > 0 && this->write_queued() > 0) {}
+    this->drop_queued_remaining();
+}
 
-        // Since we have to read 512 bytes each libusb call, we need to make sure there is always 512 bytes available in the buffer
-        this->next_write_index += num_read;
-        if (this->next_write_index >= MAX_ENCODED_PACKET_SIZE) {
-            this->next_write_index = 0;
+void SerialHandler::reader_loop() {
+    while (this->reader_running.load(std::memory_order_relaxed)) {
+        // Read with a timeout so the loop can notice when it should stop
+        if (this->read_index == this->read_length && !this->read_more(READER_THREAD_READ_TIMEOUT))
             continue;
+
+        std::span<const uint8_t> bytes{this->read_buffer + this->read_index, this->read_length - this->read_index};
+        this->read_index = this->read_length;
+        while (!bytes.empty()) {
+            const auto [consumed, result] = this->feed_decoder(bytes);
+            bytes = bytes.subspan(consumed);
+
+            if (result != CobsDecoder::Result::FRAME || !this->accept_frame(this->decoder.frame())) continue;
+            if (!this->incoming.push(PacketView<Packet>{this->decoder.frame()}.to_packet()))
+                this->incoming_dropped.fetch_add(1, std::memory_order_relaxed);
         }
+    }
+}
 
-        // TODO: Handle EOF or other errors
+void SerialHandler::async_transfer_callback(libusb_transfer* transfer) {
+    auto* handler = static_cast<SerialHandler*>(transfer->user_data);
+    // The transfer was abandoned by stop_async_receive, and the handler may be gone
+    if (!handler)
+        return;
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        #if LINK_METRICS
+        handler->link_metrics.add_bytes_read(transfer->actual_length);
+        #endif
+        handler->decode_all(std::span<const uint8_t>{transfer->buffer, static_cast<size_t>(transfer->actual_length)});
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        printf("Error: libusb transfer failed with status %d\n", transfer->status);
+    }
 
-        it = std::ranges::find(this->buffer, '\0');
+    // The device is gone, so there is no point submitting again
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        handler->async_running = false;
     }
 
-    this->decode_packet(it);
+    if (handler->async_running && handler->usb->wrapper()->libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+        return;
+
+    handler->async_active_transfers--;
+}
+#endif
+
+bool SerialHandler::read_more(const unsigned int timeout) {
+    TRACE_SCOPE("read");
+    #if LINK_METRICS
+    const uint64_t start = Utils::micros();
+    #endif
+    // Always read the full MAX_LIBUSB_PACKET_SIZE, which USB needs to avoid overflows
+    const size_t num_read = this->transport->read(std::span<uint8_t>{this->read_buffer, MAX_LIBUSB_PACKET_SIZE}, timeout);
+
+    #if LINK_METRICS
+    this->link_metrics.add_read(Utils::micros() - start);
+    this->link_metrics.add_bytes_read(num_read);
+    #endif
+
+    // TODO: Handle EOF or other errors
+    // Don't touch the buffer when nothing was read, so what is left of the last read is not lost
+    if (num_read == 0)
+        return false;
+
+    this->read_index = 0;
+    this->read_length = num_read;
+    return true;
 }
 
-void SerialHandler::decode_packet(const unsigned char* packet_end) {
-    const int packet_length = packet_end - this->buffer; // length not including the null delimiter
-    std::vector<uint8_t> bytes(packet_length);
+CobsDecoder::Result SerialHandler::decode_read_buffer() {
+    const auto [consumed, result] = this->feed_decoder(
+        std::span<const uint8_t>{this->read_buffer + this->read_index, this->read_length - this->read_index});
+    this->read_index += consumed;
 
-    // Copy the bytes into the bytes vector, excluding the null delimiter
-    memcpy(bytes.data(), this->buffer, packet_length);
+    if (result == CobsDecoder::Result::FRAME)
+        this->decode_packet(this->decoder.frame());
 
-    // In case we read multiple packets in 1 libusb packet, move the data between the end of our current packet, and the total bytes read, to the beginning of the buffer
-    memmove(this->buffer, this->buffer + packet_length + 1, this->next_write_index - packet_length);
-    this->next_write_index -= (packet_length + 1);
+    return result;
+}
 
-    const std::optional<std::vector<uint8_t>> decoded = Utils::cobs_decode(bytes);
-    if (!decoded.has_value()) return; // If we fail to decode, ignore the packet
+bool SerialHandler::valid_frame(const std::span<const uint8_t> frame) {
+    // A packet must have at least a header
+    if (frame.size() < sizeof(Header)) return false;
 
     // Decode the header
     Header received_header{};
-    memcpy(&received_header, decoded->data(), sizeof(received_header));
-    const uint8_t* ptr = decoded->data();
-    Packet received_packet{received_header, ptr + sizeof(received_header),
-                                 decoded->size() - sizeof(received_header)};
+    memcpy(&received_header, frame.data(), sizeof(received_header));
 
     // if the packet id does not exist, discard the packet
-    if (received_packet.get_id() >= PacketIds::LENGTH) return;
+    if (!Packets::contains(received_header.packet_id)) return false;
+    // the data must be exactly the size of the packet type's data, otherwise get_data would read past the end of it.
+    // Variable size packets read what they don't have as zeros, so they only can't be larger
+    const size_t data_size = frame.size() - sizeof(Header);
+    if (Packets::variable_sizes[received_header.packet_id])
+        return data_size <= Packets::data_sizes[received_header.packet_id];
+    return data_size == Packets::data_sizes[received_header.packet_id];
+}
 
-    mutex.lock();
-    // get the function before while locked
-    const auto& fn = this->listeners[received_header.packet_id];
-    this->buffers[received_header.packet_id].add(received_packet);
-    mutex.unlock();
+bool SerialHandler::accept_frame(const std::span<const uint8_t> frame) {
+    if (valid_frame(frame))
+        return true;
 
-    // call the function while NOT locked, so a user doesn't call a method like pop_latest which requires a lock and causes a deadlock
-    if (fn) { // test if function is valid
-        fn(*this, received_packet);
-    }
+    #if LINK_METRICS
+    const bool known_id = frame.size() >= sizeof(Header) && Packets::contains(frame[0]);
+    this->link_metrics.add_drop(known_id ? LinkMetrics::Drop::WRONG_SIZE : LinkMetrics::Drop::UNKNOWN_ID);
+    #endif
+    return false;
+}
+
+CobsDecoder::FeedResult SerialHandler::feed_decoder(const std::span<const uint8_t> bytes) {
+    TRACE_SCOPE("cobs_decode");
+    #if LINK_METRICS
+    const uint64_t start = Utils::micros();
+    #endif
+
+    const CobsDecoder::FeedResult fed = this->decoder.feed(bytes);
+
+    #if LINK_METRICS
+    this->link_metrics.add_decode(Utils::micros() - start);
+    if (fed.result == CobsDecoder::Result::INVALID)
+        this->link_metrics.add_drop(LinkMetrics::Drop::COBS);
+    #endif
+    return fed;
+}
+
+void SerialHandler::decode_packet(const std::span<const uint8_t> frame) {
+    TRACE_SCOPE("decode_packet");
+    if (!this->accept_frame(frame)) return; // If we fail to decode, ignore the packet
+
+    this->deliver_frame(frame, this->listener_snapshot());
 }
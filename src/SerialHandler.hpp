@@ -1,39 +1,43 @@
 #pragma once
 
-#include <functional>
+#include <array>
+#include <atomic>
+#if PI
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#endif
+#include <concepts>
+#include <memory>
+#include <optional>
 #include <unistd.h>
 #if PI
 #include <libusb.h>
+#include <thread>
 #endif
 
 #include "Buffer.hpp"
+#include "CobsDecoder.hpp"
+#include "CompactOptical.hpp"
+#include "Fragmentation.hpp"
+#include "InplaceFunction.hpp"
+#include "LatestSlot.hpp"
+#if LINK_METRICS
+#include "LinkMetrics.hpp"
+#endif
 #include "Packet.hpp"
+#include "PacketSignal.hpp"
+#include "PacketView.hpp"
+#include "SpscQueue.hpp"
+#include "Transport.hpp"
+#if PI
+#include "UsbTransport.hpp"
+#endif
 #if BRAIN
 #include "api.h" // Needed to be able to use pros::Mutex
 #endif
 
 
-#if PI
-// helper methods used for mocking usb methods in gtest
-class UsbTransferWrapper {
-public:
-    virtual ~UsbTransferWrapper() = default;
-    // TODO: Also wrap read and write calls
-    virtual int libusb_bulk_transfer(libusb_device_handle *dev_handle,
-        unsigned char endpoint, unsigned char *data, int length,
-        int *transferred, unsigned int timeout) const = 0;
-};
-
-class UsbTransferProd : public UsbTransferWrapper {
-public:
-    int libusb_bulk_transfer(libusb_device_handle *dev_handle,
-        unsigned char endpoint, unsigned char *data, int length,
-        int *transferred, unsigned int timeout) const override {
-        return ::libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
-    }
-};
-#endif
-
 class SerialHandler {
 public:
     /**
@@ -97,6 +101,9 @@ public:
     static constexpr size_t MAX_ENCODED_PACKET_SIZE = 1024 + 2 + 5;
     /** The max size in bytes that the data of a packet can be so that once its encoded it doesn't go over MAX_PACKET_SIZE */
     static constexpr size_t MAX_PACKET_DATA_SIZE = MAX_PACKET_SIZE - sizeof(Header);
+    static_assert(MAX_PACKET_SIZE <= Buffer::MAX_PACKET_SIZE, "Every packet must fit in a buffer slot");
+    static_assert(sizeof(Header) + sizeof(FragmentPacket::Data) + 2 + (sizeof(Header) + sizeof(FragmentPacket::Data)) / 254
+        <= MAX_LIBUSB_PACKET_SIZE, "An encoded fragment must fit in one USB packet");
 
 
     /** The request ID for setting the line coding over the USB control endpoint. */
@@ -113,23 +120,171 @@ public:
     static constexpr unsigned char line_coding_bytes[] = {0x80, 0x25, 0x0, 0x0, 0x0, 0x0, 0x8};
 
 
-    /** Constructs the serial handler. Leave the default argument unless you want to use the gtest usb wrappers */
+    /**
+     * Constructs the serial handler over the Brain's serial connection: USB on the PI, and stdin and stdout on the Brain.
+     * Leave the default argument unless you want to use the gtest usb wrappers
+     */
     SerialHandler(
 #if PI
         const UsbTransferWrapper* usb_wrapper = &default_wrapper
 #endif
         );
 
-    /** Cleans up the SerialHandler, closing the libusb device handle if running on the pi. */
+    /**
+     * Constructs the serial handler over any transport, such as a LoopbackTransport to another handler in the same
+     * process. The transport must outlive the handler. Async receive is only available over USB.
+     */
+    explicit SerialHandler(Transport& transport);
+
+    /** Cleans up the SerialHandler, closing the libusb device handle if it opened one. */
     ~SerialHandler();
 
     /**
-     * Sends the given packet over the serial connection.
+     * Sends the given packet over the serial connection. Safe to call from any thread, including while the writer
+     * thread is running: it waits for a frame being written to finish first.
      *
      * @param packet A reference to the packet to transmit.
      */
     void send(const Packet& packet);
 
+    /** The most bytes of encoded packets send_buffered can hold before they have to be written. */
+    static constexpr size_t SEND_BUFFER_SIZE = 4096;
+    /** The default amount of buffered bytes that makes send_buffered write them all at once. */
+    static constexpr size_t DEFAULT_SEND_FLUSH_THRESHOLD = MAX_LIBUSB_PACKET_SIZE;
+    /** The default longest time in microseconds a packet waits in the send buffer. */
+    static constexpr uint32_t DEFAULT_SEND_FLUSH_DEADLINE = 2000;
+
+    /**
+     * Encodes the packet into the send buffer instead of writing it right away, so several packets can go out in a
+     * single transfer. The buffer is written when it reaches the flush threshold, when flush is called, or when the
+     * oldest packet in it has waited longer than the flush deadline. While the writer thread is running it writes the
+     * buffer as soon as the deadline passes, taking turns with its own writes so frames are never mixed together.
+     * Otherwise the deadline is only checked in send_buffered and flush_if_due, so a loop sending with this should call
+     * flush_if_due or flush each tick.
+     * @param packet A reference to the packet to transmit.
+     */
+    void send_buffered(const Packet& packet);
+
+    /** Writes everything in the send buffer. Does nothing if it is empty. */
+    void flush();
+
+    /**
+     * Sends a message too large for a single packet, such as a path plan or calibration table, as FragmentPackets.
+     * The fragments are sent with send_buffered and then flushed. The receiver gets the message in its message listener.
+     * @param message Up to Reassembler::MAX_MESSAGE_SIZE bytes.
+     * @returns False if the message is too large, in which case nothing is sent.
+     */
+    bool send_message(std::span<const uint8_t> message);
+
+    /**
+     * Writes everything in the send buffer if its oldest packet has waited longer than the flush deadline. Only needed
+     * when the writer thread is not running, which does this on its own.
+     */
+    void flush_if_due();
+
+    /** Sets how many buffered bytes make send_buffered write them. Capped at SEND_BUFFER_SIZE. */
+    void set_send_flush_threshold(size_t bytes);
+
+    /** Sets the longest time in microseconds a packet can wait in the send buffer before being written. */
+    void set_send_flush_deadline(uint32_t microseconds);
+
+    /** The most bytes of encoded packets send_async can hold for each priority while they wait to be written. */
+    static constexpr size_t SEND_QUEUE_SIZE = 8192;
+    /**
+     * The most bytes write_queued takes from one priority before picking again, unless a single frame is larger. This
+     * bounds how long a control packet waits behind lower priority frames that are already being written.
+     */
+    static constexpr size_t SEND_WRITE_QUANTUM = MAX_LIBUSB_PACKET_SIZE;
+    /** The default amount of higher priority bytes written while a lower priority waits, before it gets to send a frame. */
+    static constexpr size_t DEFAULT_SEND_FAIRNESS_BYTES = 4096;
+    /**
+     * How long in milliseconds a single write_queued waits before giving up, so a slow connection can't stall the writer
+     * forever. send and send_buffered keep waiting until the bytes are written.
+     */
+    static constexpr unsigned int SEND_TIMEOUT = 100;
+
+    /** Counts of what could not be sent. */
+    struct SendStats {
+        /** Packets refused by send_async because the send queue was full. */
+        size_t dropped_packets;
+        /** Bytes of refused packets, and bytes that send or flush could not write. */
+        size_t dropped_bytes;
+        /** Writes that only sent part of their bytes, so the rest was written later. */
+        size_t partial_writes;
+    };
+
+    /**
+     * The send queue has one queue for each priority. Higher priority frames are written first, so a control packet
+     * doesn't wait behind a queue of log messages. Frames are never split, so a control packet still waits for the
+     * frame being written to finish.
+     */
+    enum class SendPriority : uint8_t {
+        /** Packets that something is waiting on, such as commands and odometry. */
+        CONTROL,
+        NORMAL,
+        /** Large packets that can wait, such as text. */
+        BULK,
+        LENGTH,
+    };
+
+    /**
+     * Non-blocking send. Encodes the packet onto the send queue for its type's priority and returns right away, leaving
+     * the actual write to write_queued (or the writer thread on the PI). Frames are only ever queued whole.
+     * @param packet A reference to the packet to transmit.
+     * @returns False if there is not enough room in the send queue, in which case the packet is dropped and counted in send_stats.
+     */
+    bool send_async(const Packet& packet);
+
+    /** send_async, but with a priority for just this packet instead of the one set for its type. */
+    bool send_async(const Packet& packet, SendPriority priority);
+
+    /**
+     * Sets the priority send_async uses for packets of the type. TextPackets and FragmentPackets default to BULK and the
+     * rest to CONTROL.
+     */
+    template <typename T>
+    void set_send_priority(const SendPriority priority)
+    {
+        this->send_priorities[T::id].store(priority, std::memory_order_relaxed);
+    }
+
+    /**
+     * Sets how many bytes of higher priority frames can be written while a lower priority has frames waiting, before
+     * the lower priority gets to write one frame. Lower values give lower priorities a fairer share, but make control
+     * packets wait longer.
+     */
+    void set_send_fairness(size_t bytes);
+
+    /**
+     * Writes once from the front of the send queue, choosing which priority to take from. If only part of the bytes
+     * are written, the rest stay at the front of the queue and are written by the next call before any other priority.
+     * Until then the write lock stays held, so send and flush wait instead of writing into the middle of a frame.
+     * Must always be called from the same thread, and not while the writer thread is running.
+     *
+     * The highest priority with frames waiting is written, unless a lower one has waited for the fairness bytes. So a
+     * control packet queued while the queue is busy is written after at most the current write (at most one frame or
+     * SEND_WRITE_QUANTUM bytes) and one frame from each lower priority that is owed one.
+     * @returns The amount of bytes written, which is 0 if the queue is empty or the write failed.
+     */
+    size_t write_queued();
+
+    /** @returns The amount of bytes in the send queue waiting to be written, for all priorities. */
+    [[nodiscard]] size_t queued_send_bytes() const;
+
+    /** @returns The amount of bytes waiting to be written with the priority. */
+    [[nodiscard]] size_t queued_send_bytes(SendPriority priority) const;
+
+    /** @returns Counts of packets and bytes that could not be sent. */
+    [[nodiscard]] SendStats send_stats() const;
+
+#if LINK_METRICS
+    /**
+     * @returns A copy of the link metrics: bytes, frames, drops, per id packet counts and timing histograms. Only reads
+     * atomics, so it can be called from any thread while receiving. Use LinkMetrics::packet_rate on two of them for rates.
+     */
+    [[nodiscard]] LinkMetrics::Snapshot metrics() const;
+#endif
+
 #if BRAIN
     /**
      * Non-blocking call that will read a single packet if there is one available, and return instantly.
@@ -146,47 +301,355 @@ public:
     void receive();
 
     /**
-     * Returns and remove the last received packet from the appropriate buffer.
+     * Decodes every complete packet from a single read, instead of just one like receive does. All the packets are added
+     * to their buffers, and then their listeners are run before this function returns.
+     * If there are bytes left over from a previous read, those are decoded instead of reading again.
+     * On the PI this blocks until the read completes. On the Brain the read does not block.
+     * @returns The amount of packets that were received. This can be 0 if the read only contained part of a packet.
+     */
+    size_t receive_all();
+
+#if PI
+    /** The default amount of transfers kept queued by start_async_receive. */
+    static constexpr size_t DEFAULT_ASYNC_TRANSFER_COUNT = 4;
+
+    /**
+     * Starts receiving asynchronously. Instead of one blocking transfer at a time, transfer_count bulk transfers are
+     * kept queued on the input endpoint so the Brain can always send while we are decoding or running listeners.
+     * Completed transfers are decoded and their listeners run inside handle_events, which must be called in a loop.
+     * receive, receive_all and try_receive must not be used while this is running.
+     * @param transfer_count The amount of transfers kept in flight at once.
+     * @param transfer_size The size in bytes of each transfer. Must be a multiple of MAX_LIBUSB_PACKET_SIZE.
+     * @returns True if at least one transfer was submitted.
+     */
+    bool start_async_receive(size_t transfer_count = DEFAULT_ASYNC_TRANSFER_COUNT, int transfer_size = MAX_LIBUSB_PACKET_SIZE);
+
+    /**
+     * Blocking call that waits for libusb events and handles them. Any transfers that completed are decoded, their
+     * packets added to the buffers, and their listeners run before this returns. The transfers are then queued again.
+     */
+    void handle_events();
+
+    /** How long in milliseconds stop_async_receive waits for cancelled transfers by default. */
+    static constexpr unsigned int ASYNC_STOP_TIMEOUT = 1000;
+
+    /**
+     * Cancels all the queued transfers and handles events until libusb has given every one of them back. Transfers that
+     * are not given back within the timeout may still be written to by libusb, so they are never freed.
+     * Does nothing if not receiving asynchronously.
+     * @param timeout How long in milliseconds to wait for the cancelled transfers.
+     */
+    void stop_async_receive(unsigned int timeout = ASYNC_STOP_TIMEOUT);
+
+    /** The maximum amount of packets the reader thread can hand off before process_incoming has to be called. */
+    static constexpr size_t INCOMING_QUEUE_SIZE = 256;
+    /** How long in milliseconds each read in the reader thread waits for data before checking if it should stop. */
+    static constexpr unsigned int READER_THREAD_READ_TIMEOUT = 100;
+
+    /**
+     * Starts a thread owned by the handler that reads and decodes packets in the background, so the thread using the
+     * packets never has to wait on USB. Decoded packets are handed over through a lock-free queue, so the reader also
+     * never waits on the mutex. Call process_incoming to move them into the buffers and run their listeners.
+     * receive, receive_all, try_receive and start_async_receive must not be used while this is running.
+     * @returns False if the thread is already running.
+     */
+    bool start_reader_thread();
+
+    /** Stops the reader thread and waits for it to exit. Packets it already decoded stay queued for process_incoming. */
+    void stop_reader_thread();
+
+    /**
+     * Adds all the packets decoded by the reader thread to their buffers, and runs their listeners on the calling thread.
+     * Must only be called from one thread at a time.
+     * @returns The amount of packets processed.
+     */
+    size_t process_incoming();
+
+    /** @returns The amount of packets the reader thread threw away because process_incoming was not called often enough. */
+    [[nodiscard]] size_t dropped_incoming() const;
+
+    /**
+     * Starts a thread owned by the handler that writes everything put on the send queue by send_async, so the threads
+     * sending never wait on USB. It also writes the send_buffered buffer once its flush deadline passes.
+     * @returns False if the thread is already running.
+     */
+    bool start_writer_thread();
+
+    /** Stops the writer thread and waits for it to exit. Bytes it did not write yet stay on the send queue. */
+    void stop_writer_thread();
+#endif
+
+    /**
+     * Returns and remove the last received packet from the appropriate buffer. Does not lock, so this never waits on
+     * the receiving thread or on readers of other packet types.
      * @return The removed packet.
     */
     template <typename T>
     std::optional<Packet> pop_latest()
     {
-        mutex.lock();
-        auto packet = this->buffers[T::id].pop_latest();
-        mutex.unlock();
-        return packet;
+        return this->buffers[T::id].pop_latest();
+    }
+
+    /** Returns and removes the oldest received packet of the type, so packets can be handled in the order they arrived. */
+    template <typename T>
+    std::optional<Packet> pop_oldest()
+    {
+        return this->buffers[T::id].pop_oldest();
+    }
+
+    /** @returns A copy of the last received packet of the type, without removing it. */
+    template <typename T>
+    std::optional<Packet> peek_latest() const
+    {
+        return this->buffers[T::id].peek_latest();
+    }
+
+    /** @returns A copy of the oldest received packet of the type, without removing it. */
+    template <typename T>
+    std::optional<Packet> peek_oldest() const
+    {
+        return this->buffers[T::id].peek_oldest();
     }
 
+    /**
+     * Waits for a packet of the type to be received, instead of polling pop_oldest. Another thread must be receiving,
+     * for example with receive_all, handle_events or process_incoming, which wake the waiter as soon as the packet is
+     * stored. Conflated types are never in their buffer, so waiting for one returns nullopt right away; use wait_any and
+     * read_latest for them instead.
+     * @param timeout The longest time to wait in milliseconds, or 0 to wait forever.
+     * @returns The oldest packet of the type, which is removed, or nullopt if the timeout passed first or the type is
+     * conflated.
+     */
+    template <typename T>
+    std::optional<Packet> wait_for(const uint32_t timeout)
+    {
+        return this->wait_for(T::id, timeout);
+    }
+
+    /** wait_for with the packet id instead of the type. */
+    std::optional<Packet> wait_for(uint8_t id, uint32_t timeout);
+
+    /**
+     * Waits until any of the packet ids has a packet in its buffer, without removing it. A conflated id counts once a
+     * new packet is written to its latest slot after the wait starts, since the slot always holds the last one.
+     * @param timeout The longest time to wait in milliseconds, or 0 to wait forever.
+     * @returns The first of the ids that has a packet, or nullopt if the timeout passed first.
+     */
+    std::optional<uint8_t> wait_any(std::span<const uint8_t> ids, uint32_t timeout);
+
+    /**
+     * Removes up to count of the oldest packets of the type at once and writes them to out, oldest first.
+     * @returns The amount of packets written.
+     */
+    template <typename T, typename OutputIt>
+    size_t pop_n(const size_t count, OutputIt out)
+    {
+        return this->buffers[T::id].pop_n(count, out);
+    }
+
+    /**
+     * Removes every packet of the type at once and writes them to out, oldest first. Such as
+     * handler.drain<OpticalPacket>(std::back_inserter(packets)).
+     * @returns The amount of packets written.
+     */
+    template <typename T, typename OutputIt>
+    size_t drain(OutputIt out)
+    {
+        return this->buffers[T::id].drain(out);
+    }
+
+    /** The newest data of a conflated packet type, returned by read_latest. */
+    template <typename T>
+    struct Latest {
+        T::Data data;
+        /** The amount of packets of this type received so far, so a reader can tell if it has seen this one before. */
+        uint32_t sequence;
+    };
+
+    /**
+     * Turns conflating on or off for a packet type. While on, each packet of this type replaces the previous one in a
+     * single slot read with read_latest, instead of being added to its buffer. Listeners still run for every packet.
+     * Meant for high rate state packets such as OpticalPacket where only the newest value matters.
+     */
+    template <typename T>
+    requires (sizeof(typename T::Data) <= LatestSlot::MAX_SIZE)
+    void set_conflating(const bool enabled)
+    {
+        this->conflating[T::id].store(enabled, std::memory_order_relaxed);
+    }
+
+    /**
+     * Reads the newest data of a conflated packet type without removing it. Does not lock, and never blocks the
+     * receiving thread, but tries again while a packet is being written to the slot.
+     * @returns The data and its sequence number, or nullopt if no packet of this type has been received while conflating.
+     */
+    template <typename T>
+    requires (sizeof(typename T::Data) <= LatestSlot::MAX_SIZE)
+    std::optional<Latest<T>> read_latest() const
+    {
+        std::array<uint8_t, sizeof(typename T::Data)> bytes;
+        const uint32_t sequence = this->latest[T::id].read(bytes);
+        if (sequence == 0)
+            return std::nullopt;
+        return Latest<T>{std::bit_cast<typename T::Data>(bytes), sequence};
+    }
+
+    /**
+     * @returns The amount of packets of the type thrown away because their buffer was full. By default a buffer keeps
+     * the newest Buffer::CAPACITY packets, so packets that are not popped in time are overwritten and counted here.
+     */
+    template <typename T>
+    [[nodiscard]] size_t dropped_packets() const
+    {
+        return this->buffers[T::id].dropped();
+    }
+
+    /** @returns The buffer for the packet type, to change its max size or full policy. */
+    template <typename T>
+    Buffer& get_buffer()
+    {
+        return this->buffers[T::id];
+    }
+
+    /** The most bytes a listener's captures can take up. Listeners are stored inline, so adding one never allocates. */
+    static constexpr size_t LISTENER_SIZE = 64;
+    /** A listener for any packet type. Gets the decoded bytes of the packet, including the header. */
+    using Listener = InplaceFunction<void(SerialHandler& serial_handler, std::span<const uint8_t> frame), LISTENER_SIZE>;
+
     /**
      * Adds an event listener to the list. There can only be one listener for each packet id.
      * The listener runs within a receive call, so should be kept short.
+     * The listener can take the packet as (SerialHandler&, PacketView<T>), which points straight at the received bytes and
+     * is only valid until the listener returns, as (SerialHandler&, const T::Data&), or as a copy with
+     * (SerialHandler&, const Packet&).
      * @Returns True if it was successfully added, or false if a listener for that id already exists.
      */
+    template <typename T, typename F>
+    requires std::invocable<F&, SerialHandler&, PacketView<T>>
+    bool add_listener(F&& listener)
+    {
+        return this->set_listener(T::id, Listener{
+            [listener = std::forward<F>(listener)](SerialHandler& serial_handler, const std::span<const uint8_t> frame) mutable {
+                listener(serial_handler, PacketView<T>{frame});
+            }
+        });
+    }
+
+    template <typename T, typename F>
+    requires (!std::invocable<F&, SerialHandler&, PacketView<T>>
+        && std::invocable<F&, SerialHandler&, const typename T::Data&>)
+    bool add_listener(F&& listener)
+    {
+        // Unwrap the data here, so the listener doesn't have to call get_data itself
+        return this->set_listener(T::id, Listener{
+            [listener = std::forward<F>(listener)](SerialHandler& serial_handler, const std::span<const uint8_t> frame) mutable {
+                listener(serial_handler, PacketView<T>{frame}.data());
+            }
+        });
+    }
+
+    template <typename T, typename F>
+    requires (!std::invocable<F&, SerialHandler&, PacketView<T>>
+        && std::invocable<F&, SerialHandler&, const Packet&>)
+    bool add_listener(F&& listener)
+    {
+        return this->set_listener(T::id, Listener{
+            [listener = std::forward<F>(listener)](SerialHandler& serial_handler, const std::span<const uint8_t> frame) mutable {
+                listener(serial_handler, PacketView<T>{frame}.to_packet());
+            }
+        });
+    }
+
+#if PACKET_SEQUENCE
+    /** Counts of how the sequence numbers of one packet type arrived. */
+    struct SequenceStats {
+        size_t received;
+        /** Packets that never arrived, found from gaps in the sequence. Packets that arrive late are taken back out. */
+        size_t lost;
+        /** Packets that arrived twice in a row. */
+        size_t duplicates;
+        /** Packets that arrived after a packet sent later than them. */
+        size_t reordered;
+    };
+
+    /** Passed to the sequence callback each time a packet does not arrive in order. */
+    struct SequenceEvent {
+        enum class Kind {
+            /** Packets were skipped between the expected sequence and this one. */
+            GAP,
+            DUPLICATE,
+            REORDERED,
+        };
+        Kind kind;
+        uint8_t packet_id;
+        /** The sequence that should have arrived next. */
+        uint8_t expected;
+        /** The sequence that did arrive. */
+        uint8_t received;
+    };
+
+    using SequenceCallback = InplaceFunction<void(SerialHandler& serial_handler, const SequenceEvent&), LISTENER_SIZE>;
+
+    /** @returns Counts of lost, duplicated and reordered packets of the type since the handler was created. */
+    [[nodiscard]] SequenceStats sequence_stats(uint8_t id) const;
+
     template <typename T>
-    bool add_listener(const std::function<void(SerialHandler& serial_handler, const Packet&)>& listener)
+    [[nodiscard]] SequenceStats sequence_stats() const
     {
-        mutex.lock();
-        if (this->listeners[T::id]) {
-            mutex.unlock();
-            return false;
-        }
-        this->listeners[T::id] = listener;
-        mutex.unlock();
-        return true;
+        return this->sequence_stats(T::id);
     }
 
     /**
-     * Removes a listener from the list.
+     * Sets a function called each time a packet arrives out of sequence. Like listeners, it runs within a receive call,
+     * so should be kept short. Pass nullptr to remove it.
+     */
+    void set_sequence_callback(SequenceCallback&& callback);
+#endif
+
+    /**
+     * Adds a listener for messages sent with send_message, called once all of a message's fragments have arrived.
+     * This is the listener for FragmentPacket, so remove_listener<FragmentPacket> removes it.
+     * The listener takes (SerialHandler&, std::span<const uint8_t> message). The message is only valid until it returns.
+     * The reassembler is only allocated by the first call, so handlers that never receive messages don't pay for it.
+     * Fragments are put back together and the listener is called under a lock, so receiving from several threads is
+     * safe, but the listener must not receive FragmentPackets itself.
+     * @Returns True if it was successfully added, or false if a listener for FragmentPacket already exists.
+     */
+    template <typename F>
+    requires std::invocable<F&, SerialHandler&, std::span<const uint8_t>>
+    bool add_message_listener(F&& listener)
+    {
+        this->create_reassembler();
+        return this->set_listener(FragmentPacket::id, Listener{
+            [listener = std::forward<F>(listener)](SerialHandler& serial_handler, const std::span<const uint8_t> frame) mutable {
+                // The message points into the reassembler, so keep other threads out until the listener is done with it
+                serial_handler.reassembly_mutex.lock();
+                const std::optional<std::span<const uint8_t>> message = serial_handler.reassemble(frame);
+                if (message.has_value())
+                    listener(serial_handler, *message);
+                serial_handler.reassembly_mutex.unlock();
+            }
+        });
+    }
+
+    /**
+     * @returns Counts of completed, timed out and thrown away messages. Can be called from any thread, including the
+     * message listener. All zero until add_message_listener is called.
+     */
+    [[nodiscard]] Reassembler::Stats reassembly_stats() const;
+
+    /**
+     * Removes a listener from the list. It is not called again, but if another thread is running it, it is only
+     * destroyed once it returns.
      * @Returns True if the listener was removed, or false if no listener exits with that id.
      */
     template <typename T>
     bool remove_listener()
     {
         mutex.lock();
-        if (this->listeners[T::id])
+        if (this->listeners[T::id].has_function())
         {
-            this->listeners[T::id] = nullptr; // Put the function in an empty state
+            this->listeners[T::id].set(nullptr); // Put the function in an empty state
             mutex.unlock();
             return true;
         }
@@ -195,20 +658,236 @@ public:
     }
 
 private:
+#ifdef BENCH
+    friend class SerialHandlerBench;
+#endif
+
+    /**
+     * Helper function used in try_receive and receive to handle a packet after its frame has been decoded.
+     * @param frame The decoded bytes of the packet, including the header
+     */
+    void decode_packet(std::span<const uint8_t> frame);
+
     /**
-     * Helper function used in try_receive and receive to decode a packet after one has been found.
-     * @param packet_end Pointer in buffer to the inclusive end of the packet
+     * Checks that a decoded frame is a packet: its id is registered, and its data is the size of that packet type's data.
      */
-    void decode_packet(const unsigned char* packet_end);
+    static bool valid_frame(std::span<const uint8_t> frame);
 
+    /** valid_frame, but also counts why the frame was dropped if it is not valid. */
+    bool accept_frame(std::span<const uint8_t> frame);
+
+    /** Feeds bytes to the decoder, counting the time it took and any frames that were not valid cobs. */
+    CobsDecoder::FeedResult feed_decoder(std::span<const uint8_t> bytes);
+
+    /**
+     * Feeds the bytes left in read_buffer to the decoder until a frame ends or the bytes run out.
+     * @returns The result of the last feed. If it is FRAME, the frame has already been passed to decode_packet.
+     */
+    CobsDecoder::Result decode_read_buffer();
+
+    /**
+     * Reads once from the serial connection into read_buffer, replacing what was there.
+     * @param timeout How long to wait for data in milliseconds, or 0 to wait forever. Only used on the PI.
+     * @returns True if any bytes were read.
+     */
+    bool read_more(unsigned int timeout = 0);
+
+    /**
+     * Serializes and cobs encodes a packet, including the null delimiter.
+     * @param output Where to write the frame. Must be at least MAX_ENCODED_PACKET_SIZE bytes.
+     * @returns The length of the frame, or nullopt if the packet could not be encoded.
+     */
+    std::optional<size_t> encode_frame(const Packet& packet, std::span<uint8_t> output);
+
+    /**
+     * Writes the bytes to the serial connection once.
+     * @param timeout How long to wait for the write in milliseconds, or 0 to wait forever.
+     * @returns The amount of bytes written, which can be less than asked for. 0 if the write failed.
+     */
+    size_t write_once(std::span<const uint8_t> bytes, unsigned int timeout);
+
+    /**
+     * Writes all the bytes to the serial connection, waiting as long as each write takes and resuming after partial
+     * writes. Bytes that fail to write are counted as dropped.
+     */
+    void write_bytes(std::span<const uint8_t> bytes);
+
+    /** Writes everything in the send buffer. send_mutex must be locked. */
+    void flush_locked();
+
+    /**
+     * A listener or callback that can be removed or replaced while a receiving thread is calling it. Calls are made
+     * without the mutex, so a change made during one is kept in next and only takes effect once the last call returns,
+     * instead of destroying the function while it runs. Only used with the mutex locked.
+     */
+    template <typename Function>
+    struct GuardedFunction {
+        Function function;
+        /** What replaces function once calls reaches 0, if changed is set. */
+        Function next;
+        bool changed = false;
+        /** How many threads are calling function right now. */
+        uint8_t calls = 0;
+
+        /** @returns If there is a function, counting a change that has not taken effect yet. */
+        [[nodiscard]] bool has_function() const
+        {
+            return static_cast<bool>(this->changed ? this->next : this->function);
+        }
+
+        void set(Function&& replacement)
+        {
+            if (this->calls == 0) {
+                this->function = std::move(replacement);
+                return;
+            }
+            this->next = std::move(replacement);
+            this->changed = true;
+        }
+
+        /** @returns True if function can be called, in which case end_call must be called once it returns. */
+        bool begin_call()
+        {
+            // A function that is being removed or replaced is not called again
+            if (!this->function || this->changed)
+                return false;
+            this->calls++;
+            return true;
+        }
+
+        void end_call()
+        {
+            this->calls--;
+            if (this->calls == 0 && this->changed) {
+                this->function = std::move(this->next);
+                this->changed = false;
+            }
+        }
+    };
+
+    /**
+     * Stores the listener for the packet id, unless there already is one.
+     * @returns True if it was stored.
+     */
+    bool set_listener(uint8_t id, Listener&& listener);
+
+    /** Calls the listener for the frame's packet id, if it still has one. Locks the mutex around the call, not during it. */
+    void call_listener(std::span<const uint8_t> frame);
+
+#if PACKET_SEQUENCE
+    /** Updates the sequence counts for a received packet, and calls the sequence callback if it is out of order. */
+    void track_sequence(std::span<const uint8_t> frame);
+
+    /** What the receiver knows about the sequence of one packet type. Only changed by the receiving thread. */
+    struct SequenceTracker {
+        /** False until the first packet of this type arrives. */
+        bool started = false;
+        /** The sequence of the next packet if none are lost. */
+        uint8_t expected = 0;
+        std::atomic<size_t> received{0};
+        std::atomic<size_t> lost{0};
+        std::atomic<size_t> duplicates{0};
+        std::atomic<size_t> reordered{0};
+    };
+
+    std::array<SequenceTracker, PacketIds::LENGTH> sequence_trackers;
+    /** The sequence of the next packet sent of each type. */
+    std::array<std::atomic<uint8_t>, PacketIds::LENGTH> send_sequences{};
+    GuardedFunction<SequenceCallback> sequence_callback;
+#endif
+
+    /**
+     * @returns If each packet id has a listener, checked under a single lock. Listeners can be removed right after, so
+     * this only says which ids can skip locking. call_listener checks again before calling.
+     */
+    std::array<bool, PacketIds::LENGTH> listener_snapshot();
+
+    /** Sets the send_async priorities that aren't CONTROL. */
+    void set_default_send_priorities();
+
+    /** Allocates the reassembler if it doesn't exist yet. */
+    void create_reassembler();
+
+    /**
+     * Adds a received FragmentPacket to the reassembler. Must be called with reassembly_mutex locked.
+     * @returns The whole message if this was its last missing fragment, or nullopt if there is no reassembler.
+     */
+    std::optional<std::span<const uint8_t>> reassemble(std::span<const uint8_t> frame);
+
+    /** Adds the packet to its buffer, or to its latest slot if its type is conflated. */
+    void store_frame(std::span<const uint8_t> frame);
+
+    /**
+     * Stores a received packet and then runs its listener, without copying it into a Packet first. Compact optical
+     * packets are delivered as the OpticalPacket they decode to.
+     * @param frame The decoded bytes of the packet, including the header. Must be a valid_frame.
+     * @param has_listener If each packet id had a listener, from listener_snapshot. Ids without one are skipped without
+     * locking, and a listener added since then is only called from the next snapshot.
+     */
+    void deliver_frame(std::span<const uint8_t> frame, const std::array<bool, PacketIds::LENGTH>& has_listener);
+
+    /**
+     * Decodes all the given bytes, adding any packets to the buffers and then running their listeners.
+     * @returns The amount of packets that were received.
+     */
+    size_t decode_all(std::span<const uint8_t> bytes);
+
+#if PI
+    /** Called by libusb when one of the transfers queued by start_async_receive completes. */
+    static void async_transfer_callback(libusb_transfer* transfer);
+
+    /** The transfers allocated by start_async_receive. */
+    std::vector<libusb_transfer*> async_transfers;
+    /** The memory each of the async transfers reads into, one after the other. */
+    std::vector<unsigned char> async_buffer;
+    /** The amount of async transfers that are submitted and have not finished. */
+    size_t async_active_transfers = 0;
+    /** If completed async transfers should be submitted again. */
+    bool async_running = false;
+
+    /** Reads and decodes packets until reader_running is false. Runs on reader_thread. */
+    void reader_loop();
+
+    /** The thread started by start_reader_thread. */
+    std::thread reader_thread;
+    /** If the reader thread should keep running. */
+    std::atomic<bool> reader_running{false};
+    /** Packets decoded by the reader thread, waiting for process_incoming. */
+    SpscQueue<Packet, INCOMING_QUEUE_SIZE> incoming;
+    /** The amount of packets the reader thread could not fit in incoming. */
+    std::atomic<size_t> incoming_dropped{0};
+
+    /** Writes the send queue until writer_running is false. Runs on writer_thread. */
+    void writer_loop();
+
+    /** The thread started by start_writer_thread. */
+    std::thread writer_thread;
+    /** If the writer thread should keep running. */
+    std::atomic<bool> writer_running{false};
+    /**
+     * Wakes the writer thread when bytes are added to the send queue, the send buffer gets its first packet, or it
+     * should stop. Used with send_queue_mutex.
+     */
+    std::condition_variable send_queue_ready;
+    /** Counts each time the send buffer went from empty to holding a packet. Changed under send_queue_mutex. */
+    std::atomic<size_t> send_buffer_starts{0};
+
+    /** @returns How long until the oldest packet in the send buffer is due, or SEND_TIMEOUT if it is empty. */
+    std::chrono::microseconds send_flush_wait();
+#endif
+
+    /** The transport made by the default constructor. Empty when the handler was given one. */
+    std::unique_ptr<Transport> owned_transport;
+    /** What all reads and writes go through. */
+    Transport* transport;
 #if PI
-    /** A libusb device handle. */
-    libusb_device_handle* device_handle;
+    /** The transport as USB, which async receive needs. nullptr when the transport is not USB. */
+    UsbTransport* usb = nullptr;
 #endif
 
 
-    // A mutex used for synchronization of `buffers` and `listeners`. A user should be able to use methods that retrieve packets from the
-    // buffers, or add/remove listeners while also calling receive on another thread.
+    // A mutex used for synchronization of `listeners`. A user should be able to add/remove listeners while also calling
+    // receive on another thread. The buffers are lock-free and don't need it.
 #if PI
     using Mutex = std::mutex;
 #elif BRAIN
@@ -217,26 +896,127 @@ private:
 
     Mutex mutex;
 
+    /**
+     * Held for each whole frame or buffer written, so writes from send, flush and write_queued take turns and never
+     * land in the middle of each other's frames. Always taken after send_mutex, never before.
+     */
+    Mutex write_mutex;
+
+    /** A mutex used for synchronization of the send buffer, so packets can be sent from multiple threads. */
+    Mutex send_mutex;
+    /** Encoded frames waiting to be written by flush. */
+    std::array<uint8_t, SEND_BUFFER_SIZE> send_buffer{};
+    /** The amount of bytes in send_buffer. */
+    size_t send_length = 0;
+    /** When the oldest frame in send_buffer was added, in microseconds. */
+    uint64_t send_oldest_time = 0;
+    size_t send_flush_threshold = DEFAULT_SEND_FLUSH_THRESHOLD;
+    uint32_t send_flush_deadline = DEFAULT_SEND_FLUSH_DEADLINE;
+
+    /** A ring of encoded frames of one priority waiting to be written by write_queued. */
+    struct SendQueue {
+        std::array<uint8_t, SEND_QUEUE_SIZE> bytes{};
+        /** The total amount of bytes ever added. Only changed by send_async, under send_queue_mutex. */
+        std::atomic<size_t> head{0};
+        /** The total amount of bytes ever written. Only changed by write_queued. */
+        std::atomic<size_t> tail{0};
+        /** Bytes written from higher priorities while this one had frames waiting. Only used by write_queued. */
+        size_t skipped = 0;
+    };
 
-    /** An array where the indices of the array correspond to the packet id whose listener is stored there */
-    std::array<std::function<void(SerialHandler& serial_handler, const Packet&)>, PacketIds::LENGTH> listeners;
+    /**
+     * Picks the priority to write from next, and how many bytes to write from it. Only called by write_queued.
+     * @returns False if every queue is empty.
+     */
+    bool schedule_send();
 
-    /** An array of bytes that stores the data from receiving packets. Used temporarily between calls to libusb_block_transfer when receiving
-     * This buffer needs to be large enough to store (MAX_ENCODED_PACKET_SIZE - 1) bytes + the amount of bytes being read in each IO call.
-     * If a full MAX_ENCODED_PACKET_SIZE is read, it will be decoded and removed from the buffer before the next receive call.
-     * In the worst case, there will be 1 fewer bytes sent, meaning we need to store them until we read IO again, and on each IO call there needs to
-     * be room for however many bytes we read.
+    /**
+     * @param queued The amount of bytes in the queue.
+     * @returns The length of the whole frames at the front of the queue that fit in max_length, or of the first frame
+     * if it is longer.
      */
-    unsigned char buffer[MAX_ENCODED_PACKET_SIZE - 1 + MAX_LIBUSB_PACKET_SIZE]{};
-    /** The index in the buffer array where the next read data should be placed. */
-    ssize_t next_write_index = 0;
+    static size_t queued_frames_length(const SendQueue& queue, size_t queued, size_t max_length);
+
+    /**
+     * Throws away the rest of the frames write_queued is part way through, counting them as dropped, and releases the
+     * write lock it holds for them. Must be called from the thread that called write_queued.
+     */
+    void drop_queued_remaining();
+
+    /** A mutex used for synchronization between threads calling send_async. The writer does not need it to write. */
+    Mutex send_queue_mutex;
+    std::array<SendQueue, static_cast<size_t>(SendPriority::LENGTH)> send_queues;
+    /** The priority send_async uses for each packet id. */
+    std::array<std::atomic<SendPriority>, PacketIds::LENGTH> send_priorities;
+    std::atomic<size_t> send_fairness_bytes{DEFAULT_SEND_FAIRNESS_BYTES};
+    /** The queue write_queued is writing from. Only used by write_queued. */
+    size_t send_current = 0;
+    /** The bytes left to write from send_current before picking again. Always ends on a frame delimiter. */
+    size_t send_current_remaining = 0;
+
+    std::atomic<size_t> send_dropped_packets{0};
+    std::atomic<size_t> send_dropped_bytes{0};
+    std::atomic<size_t> send_partial_writes{0};
+
+
+    /** An array where the indices of the array correspond to the packet id whose listener is stored there */
+    std::array<GuardedFunction<Listener>, PacketIds::LENGTH> listeners;
+
+    /** An array of bytes that stores the data from the last read. Bytes are handed to the decoder straight from here, so
+     * a read can contain any amount of frames, or part of one. */
+    unsigned char read_buffer[MAX_LIBUSB_PACKET_SIZE]{};
+    /** The index in read_buffer of the next byte that hasn't been given to the decoder. */
+    size_t read_index = 0;
+    /** The amount of bytes in read_buffer from the last read. */
+    size_t read_length = 0;
+
+    /** Where the decoder writes the packet it is currently receiving. */
+    std::array<uint8_t, MAX_PACKET_SIZE> frame_buffer{};
+    /** Decodes the received bytes into frame_buffer as they arrive. */
+    CobsDecoder decoder{frame_buffer};
 
 #if PI
     static constexpr UsbTransferProd default_wrapper{};
-    const UsbTransferWrapper* usb_wrapper;
+#endif
+
+    /** If each packet id is conflated into latest instead of being added to its buffer. */
+    std::array<std::atomic<bool>, PacketIds::LENGTH> conflating{};
+    /** The newest data of each conflated packet id. */
+    std::array<LatestSlot, PacketIds::LENGTH> latest;
+
+    /** Turns received compact optical packets back into OpticalPackets. Only used by the thread delivering packets. */
+    CompactOpticalDecoder compact_optical;
+
+    /** Notified every time a packet is stored, for wait_for and wait_any. */
+    PacketSignal packet_signal;
+
+    Fragmenter fragmenter;
+    /** Locked while a FragmentPacket is put back together and its message is being handled. */
+    Mutex reassembly_mutex;
+    /**
+     * Puts received FragmentPackets back together. Holds several whole messages, so it is only allocated once a
+     * message listener is added. Only used with reassembly_mutex locked.
+     */
+    std::unique_ptr<Reassembler> reassembler;
+    /** A copy of the reassembler's counts, so reassembly_stats doesn't have to wait on a running message listener. */
+    struct ReassemblyCounts {
+        std::atomic<size_t> completed{0};
+        std::atomic<size_t> timed_out{0};
+        std::atomic<size_t> evicted{0};
+        std::atomic<size_t> invalid{0};
+        std::atomic<size_t> duplicates{0};
+    };
+
+    ReassemblyCounts reassembly_counts;
+
+#if LINK_METRICS
+    LinkMetrics link_metrics;
 #endif
 
 protected:
+    /** @returns A buffer for each packet id, with slots only as large as that id's largest packet. */
+    static std::array<Buffer, PacketIds::LENGTH> make_buffers();
+
     /** An array where the indices of the array correspond to the packet id whose buffer is stored there */
-    std::array<Buffer, PacketIds::LENGTH> buffers;
+    std::array<Buffer, PacketIds::LENGTH> buffers = make_buffers();
 };
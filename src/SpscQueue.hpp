@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <optional>
+#include <utility>
+
+/**
+ * A fixed size, lock-free queue with a single producer thread and a single consumer thread.
+ * Neither side ever blocks or takes a lock, so a slow consumer can't hold up the producer and the other way around.
+ * @tparam T The type of the elements. Does not need to be default constructible.
+ * @tparam Capacity The maximum amount of elements. Must be a power of 2.
+ */
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of 2");
+
+    /** Keeps the producer and consumer indices on separate cache lines so they don't slow each other down. */
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
+    /** Raw storage for an element, so elements only exist while they are in the queue. */
+    struct Slot {
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    /** The index of the next element to write. Only written by the producer. */
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+    /** The index of the next element to read. Only written by the consumer. */
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+
+    alignas(CACHE_LINE_SIZE) Slot slots[Capacity];
+
+    T* slot(const size_t index) {
+        return std::launder(reinterpret_cast<T*>(this->slots[index & (Capacity - 1)].storage));
+    }
+
+public:
+    SpscQueue() = default;
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    ~SpscQueue() {
+        while (this->pop().has_value()) {}
+    }
+
+    /**
+     * Adds an element to the back of the queue. Must only be called from the producer thread.
+     * @returns False if the queue is full, in which case value is not moved from.
+     */
+    bool push(T&& value) {
+        const size_t write = this->head.load(std::memory_order_relaxed);
+        if (write - this->tail.load(std::memory_order_acquire) == Capacity)
+            return false;
+
+        new (this->slots[write & (Capacity - 1)].storage) T(std::move(value));
+        this->head.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Removes and returns the element at the front of the queue. Must only be called from the consumer thread.
+     * @returns The element, or nullopt if the queue is empty.
+     */
+    std::optional<T> pop() {
+        const size_t read = this->tail.load(std::memory_order_relaxed);
+        if (read == this->head.load(std::memory_order_acquire))
+            return std::nullopt;
+
+        T* element = this->slot(read);
+        std::optional<T> value{std::move(*element)};
+        element->~T();
+        this->tail.store(read + 1, std::memory_order_release);
+        return value;
+    }
+
+    /** @returns The amount of elements in the queue. Only an estimate if the other thread is using the queue. */
+    [[nodiscard]] size_t size() const {
+        return this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] bool empty() const {
+        return this->size() == 0;
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+};
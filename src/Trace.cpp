@@ -0,0 +1,168 @@
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "Utils.hpp"
+#if BRAIN
+#include "api.h" // Needed for pros::c::task_get_current
+#endif
+
+std::array<std::atomic<Trace::ThreadRing*>, Trace::MAX_THREADS> Trace::rings{};
+std::atomic<size_t> Trace::ring_count{0};
+std::atomic<size_t> Trace::dropped_events{0};
+
+#if BRAIN
+/** The task each ring belongs to, since PROS tasks don't support thread_local. Indexed the same as rings. */
+static std::array<std::atomic<pros::task_t>, Trace::MAX_THREADS> ring_tasks{};
+#endif
+
+Trace::Scope::Scope(const char* name) : name(name), start(Utils::micros()) {}
+
+Trace::Scope::~Scope() {
+    Trace::record(this->name, this->start, static_cast<uint32_t>(Utils::micros() - this->start));
+}
+
+Trace::ThreadRing* Trace::thread_ring() {
+#if PI
+    thread_local ThreadRing* ring = nullptr;
+    if (ring != nullptr)
+        return ring;
+#elif BRAIN
+    const pros::task_t task = pros::c::task_get_current();
+    const size_t count = std::min(ring_count.load(std::memory_order_acquire), MAX_THREADS);
+    for (size_t i = 0; i < count; i++) {
+        if (ring_tasks[i].load(std::memory_order_relaxed) == task)
+            return rings[i].load(std::memory_order_acquire);
+    }
+    ThreadRing* ring = nullptr;
+#endif
+
+    // The first event from this thread. Claim an index, and publish the ring there once it is made
+    const size_t index = ring_count.fetch_add(1, std::memory_order_relaxed);
+    if (index >= MAX_THREADS)
+        return nullptr;
+    ring = new ThreadRing{};
+#if BRAIN
+    ring_tasks[index].store(task, std::memory_order_relaxed);
+#endif
+    rings[index].store(ring, std::memory_order_release);
+    return ring;
+}
+
+void Trace::record(const char* name, const uint64_t start, const uint32_t duration) {
+    ThreadRing* ring = thread_ring();
+    if (ring == nullptr) {
+        dropped_events.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // Only this thread writes to the ring, so there is no need to claim the slot first
+    const uint64_t written = ring->written.load(std::memory_order_relaxed);
+    Event& event = ring->events[written % EVENTS_PER_THREAD];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.duration.store(duration, std::memory_order_relaxed);
+    ring->written.store(written + 1, std::memory_order_release);
+}
+
+void Trace::set_thread_name(const char* name) {
+    ThreadRing* ring = thread_ring();
+    if (ring != nullptr)
+        ring->thread_name.store(name, std::memory_order_relaxed);
+}
+
+/** Appends the string to the JSON with quotes and escapes. Event names are literals, but thread names could be anything. */
+static void append_json_string(std::string& json, const char* string) {
+    json += '"';
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            json += '\\';
+        if (static_cast<unsigned char>(*c) >= 0x20)
+            json += *c;
+    }
+    json += '"';
+}
+
+std::string Trace::chrome_json() {
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    const auto separate = [&json, &first] {
+        if (!first)
+            json += ',';
+        first = false;
+    };
+
+    struct Copy {
+        const char* name;
+        uint64_t start;
+        uint32_t duration;
+    };
+    std::vector<Copy> copies;
+    const size_t count = std::min(ring_count.load(std::memory_order_acquire), MAX_THREADS);
+    for (size_t thread = 0; thread < count; thread++) {
+        const ThreadRing* ring = rings[thread].load(std::memory_order_acquire);
+        // The index is claimed before the ring is published, so it may not be there yet
+        if (ring == nullptr)
+            continue;
+
+        if (const char* thread_name = ring->thread_name.load(std::memory_order_relaxed)) {
+            separate();
+            json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(thread) + ",\"args\":{\"name\":";
+            append_json_string(json, thread_name);
+            json += "}}";
+        }
+
+        // Copy the newest events, then throw away any the thread overwrote while they were being copied
+        const uint64_t written = ring->written.load(std::memory_order_acquire);
+        const uint64_t oldest = std::max(written > EVENTS_PER_THREAD ? written - EVENTS_PER_THREAD : 0,
+            ring->cleared.load(std::memory_order_relaxed));
+        copies.clear();
+        for (uint64_t i = oldest; i < written; i++) {
+            const Event& event = ring->events[i % EVENTS_PER_THREAD];
+            copies.push_back({
+                event.name.load(std::memory_order_relaxed),
+                event.start.load(std::memory_order_relaxed),
+                event.duration.load(std::memory_order_relaxed),
+            });
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t written_after = ring->written.load(std::memory_order_relaxed);
+        const uint64_t overwritten = written_after > EVENTS_PER_THREAD ? written_after - EVENTS_PER_THREAD : 0;
+
+        for (uint64_t i = std::max(oldest, overwritten); i < written; i++) {
+            const Copy& event = copies[i - oldest];
+            separate();
+            json += "{\"name\":";
+            append_json_string(json, event.name);
+            json += event.duration == 0 ? ",\"ph\":\"i\",\"s\":\"t\"" : ",\"ph\":\"X\",\"dur\":" + std::to_string(event.duration);
+            json += ",\"ts\":" + std::to_string(event.start) + ",\"pid\":1,\"tid\":" + std::to_string(thread) + "}";
+        }
+    }
+    json += "]}";
+    return json;
+}
+
+bool Trace::write_chrome_json(const char* path) {
+    const std::string json = chrome_json();
+    const std::unique_ptr<FILE, int (*)(FILE*)> file{fopen(path, "w"), fclose};
+    if (!file)
+        return false;
+    return fwrite(json.data(), 1, json.size(), file.get()) == json.size();
+}
+
+void Trace::clear() {
+    const size_t count = std::min(ring_count.load(std::memory_order_acquire), MAX_THREADS);
+    for (size_t thread = 0; thread < count; thread++) {
+        ThreadRing* ring = rings[thread].load(std::memory_order_acquire);
+        if (ring != nullptr)
+            ring->cleared.store(ring->written.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+    dropped_events.store(0, std::memory_order_relaxed);
+}
+
+size_t Trace::dropped() {
+    return dropped_events.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Utils.hpp"
+
+/**
+ * Records how long the hot paths in SerialHandler take, to find out where the time went when a tick runs late.
+ * Each thread writes fixed size events into its own ring, so recording never takes a lock or allocates after the
+ * thread's first event. chrome_json turns every ring into a trace that chrome://tracing and ui.perfetto.dev can open.
+ *
+ * Only built with TRACING. Without it the TRACE_ macros expand to nothing, so there is no overhead at all, which
+ * matters on the Brain.
+ */
+class Trace {
+public:
+    /** The amount of events each thread keeps. Older events are overwritten. */
+    static constexpr size_t EVENTS_PER_THREAD = 4096;
+    /** The most threads that can record. Events from threads after this are not recorded. */
+    static constexpr size_t MAX_THREADS = 16;
+
+    /** Records the time from when it is made to when it is destroyed as one event. Used by TRACE_SCOPE. */
+    class Scope {
+        const char* name;
+        uint64_t start;
+
+    public:
+        /** @param name Must be a string literal, since only the pointer is kept. */
+        explicit Scope(const char* name);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    /**
+     * Records an event.
+     * @param name Must be a string literal, since only the pointer is kept.
+     * @param start When it started in Utils::micros time.
+     * @param duration How long it took in microseconds. 0 is shown as an instant.
+     */
+    static void record(const char* name, uint64_t start, uint32_t duration);
+
+    /** Names the calling thread in exported traces. The name must be a string literal. */
+    static void set_thread_name(const char* name);
+
+    /**
+     * @returns Every recorded event as Chrome trace event JSON. Can be called while other threads are recording, and
+     * only includes events that were not being overwritten while copying.
+     */
+    static std::string chrome_json();
+
+    /**
+     * Writes chrome_json to a file.
+     * @returns False if the file could not be written.
+     */
+    static bool write_chrome_json(const char* path);
+
+    /** Throws away every recorded event. Threads keep their rings and names. */
+    static void clear();
+
+    /** @returns The amount of events not recorded because MAX_THREADS threads already had rings. */
+    static size_t dropped();
+
+private:
+    /**
+     * One recorded event. The fields are relaxed atomics so exporting while the owning thread writes is not a data
+     * race. Whether an event was overwritten while it was copied is checked with the ring's count instead.
+     */
+    struct Event {
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> start{0};
+        std::atomic<uint32_t> duration{0};
+    };
+
+    /** The events of one thread. Only that thread writes to it. */
+    struct ThreadRing {
+        /** The amount of events ever written. The newest is at (written - 1) % EVENTS_PER_THREAD. */
+        std::atomic<uint64_t> written{0};
+        /** Events before this count were thrown away by clear. */
+        std::atomic<uint64_t> cleared{0};
+        std::atomic<const char*> thread_name{nullptr};
+        std::array<Event, EVENTS_PER_THREAD> events;
+    };
+
+    /** @returns The calling thread's ring, making one the first time. nullptr if there are already MAX_THREADS. */
+    static ThreadRing* thread_ring();
+
+    /** The ring of every thread that has recorded, in the order they started. Rings are never freed. */
+    static std::array<std::atomic<ThreadRing*>, MAX_THREADS> rings;
+    static std::atomic<size_t> ring_count;
+    static std::atomic<size_t> dropped_events;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#if TRACING
+/** Records the time until the end of the enclosing scope as an event with the name, which must be a string literal. */
+#define TRACE_SCOPE(name) const Trace::Scope TRACE_CONCAT(trace_scope_, __LINE__){name}
+/** Records an instant event with the name, which must be a string literal. */
+#define TRACE_INSTANT(name) Trace::record(name, Utils::micros(), 0)
+#else
+#define TRACE_SCOPE(name) static_cast<void>(0)
+#define TRACE_INSTANT(name) static_cast<void>(0)
+#endif
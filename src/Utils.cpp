@@ -1,12 +1,199 @@
 #include "Utils.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "ZeroScan.hpp"
+#if BRAIN
+#include "api.h" // Needed for pros::micros
+#endif
+
+/** Runs shorter than this are scanned and copied byte by byte. Most of our packets are full of zeros or have short
+ * runs, and for those the call overhead of the vector kernel and memcpy costs more than it saves. */
+static constexpr size_t SHORT_RUN = 16;
+
+/**
+ * Copies the run of non zero bytes at the start of input into output, looking at no more than limit bytes.
+ * @returns The amount of bytes copied, which is the index of the first zero or limit.
+ */
+static size_t copy_run(const uint8_t* input, uint8_t* output, const size_t limit) {
+    const size_t short_limit = std::min(limit, SHORT_RUN);
+    size_t run = 0;
+    while (run < short_limit && input[run] != 0) {
+        output[run] = input[run];
+        run++;
+    }
+    if (run < SHORT_RUN || run == limit)
+        return run;
+
+    const size_t rest = ZeroScan::find_zero(input + run, limit - run);
+    memcpy(output + run, input + run, rest);
+    return run + rest;
+}
+
+/**
+ * Copies length bytes from input to output, which are allowed to overlap as long as output is before input.
+ * @returns False if any of the bytes are zero, which is not allowed in cobs encoded data.
+ */
+static bool copy_nonzero(const uint8_t* input, uint8_t* output, const size_t length) {
+    if (length < SHORT_RUN) {
+        for (size_t i = 0; i < length; i++) {
+            if (input[i] == 0) return false;
+            output[i] = input[i];
+        }
+        return true;
+    }
+
+    if (ZeroScan::find_zero(input, length) != length) return false;
+    memmove(output, input, length);
+    return true;
+}
+
+uint64_t Utils::micros() {
+    #if BRAIN
+    return pros::micros();
+    #elif PI
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    #endif
+}
+
 std::optional<std::vector<uint8_t>> Utils::cobs_encode(const std::vector<uint8_t>& data) {
     if (data.empty()) return std::nullopt;
 
-    std::vector<uint8_t> output;
-    output.resize(data.size() + data.size() / 254 + 2);
-    /* This is the maximum size. Encoded data will be the originals size, include a start and end byte, and have +1
-     * byte each time it goes over 254 without a zero in between */
+    std::vector<uint8_t> output(cobs_max_encoded_size(data.size()));
+
+    const std::optional<size_t> length = cobs_encode(std::span<const uint8_t>{data}, std::span<uint8_t>{output});
+    if (!length.has_value()) return std::nullopt;
+
+    output.resize(*length);
+
+    return output;
+}
+
+std::optional<size_t> Utils::cobs_encode(const std::span<const uint8_t> data, const std::span<uint8_t> output) {
+    if (data.empty()) return std::nullopt;
+    // Make sure the worst case encoding fits, so the loop below never has to check bounds
+    if (output.size() < cobs_max_encoded_size(data.size())) return std::nullopt;
+
+    // Same encoding as cobs_encode_reference, but instead of testing each byte this scans for the next zero and copies
+    // the whole run of non zero bytes before it at once
+    const uint8_t* input = data.data();
+    uint8_t* out = output.data();
+    size_t marker_index = 0;
+    size_t output_index = 1;
+    size_t i = 0;
+    while (i < data.size()) {
+        // Zeros are the most common byte in our packets. A zero right after another zero always gets a marker of 1
+        if (input[i] == 0x00 && output_index - marker_index <= 254) {
+            out[marker_index] = output_index - marker_index;
+            marker_index = output_index++;
+            i++;
+            while (i < data.size() && input[i] == 0x00) {
+                out[marker_index] = 1;
+                marker_index = output_index++;
+                i++;
+            }
+            continue;
+        }
+
+        // A block can only hold 254 bytes after its marker, so there is no reason to look further than that for a zero
+        const size_t limit = std::min(254 - (output_index - marker_index - 1), data.size() - i);
+        const size_t run = copy_run(input + i, out + output_index, limit);
+        output_index += run;
+        i += run;
+
+        if (i == data.size()) break;
+
+        // The run either stopped at a zero, or the block is full. Note a zero right after a full block takes the first
+        // branch and writes a 0xFF marker, which matches what cobs_encode_reference produces
+        if (input[i] == 0x00) {
+            out[marker_index] = output_index - marker_index;
+            marker_index = output_index++;
+            i++;
+        }
+        else {
+            out[marker_index] = 0xFF;
+            marker_index = output_index++;
+        }
+    }
+    out[marker_index] = output_index - marker_index;
+    out[output_index++] = 0x00;
+
+    return output_index;
+}
+
+std::optional<std::vector<uint8_t>> Utils::cobs_decode(const std::vector<uint8_t>& data) {
+    if (data.size() <= 1) return std::nullopt;
+
+    std::vector<uint8_t> output(data.size() - 1);
+
+    const std::optional<size_t> length = cobs_decode(std::span<const uint8_t>{data}, std::span<uint8_t>{output});
+    if (!length.has_value()) return std::nullopt;
+
+    output.resize(*length);
+
+    return output;
+}
+
+std::optional<size_t> Utils::cobs_decode(const std::span<const uint8_t> data, const std::span<uint8_t> output) {
+    // See cobs_decode_reference for why these are invalid
+    if (data.size() <= 1) return std::nullopt;
+    if (data[0] > data.size()) return std::nullopt;
+    if (data[0] == 0) return std::nullopt;
+
+    // Same decoding as cobs_decode_reference, but instead of testing each byte this jumps from marker to marker,
+    // checking each run for zeros and copying it at once
+    const uint8_t* input = data.data();
+    uint8_t* out = output.data();
+    size_t output_index = 0;
+    size_t marker_index = 0;
+    while (true) {
+        const uint8_t marker = input[marker_index];
+        size_t next_marker_index = marker_index + marker;
+        const size_t run = marker - 1;
+
+        if (output_index + run > output.size()) return std::nullopt;
+        // output is allowed to be the same memory as data (see cobs_decode_in_place), but it is always behind it
+        if (!copy_nonzero(input + marker_index + 1, out + output_index, run)) return std::nullopt; // cobs encoded bytes cannot contains zeros
+        output_index += run;
+
+        // The last marker points at the end of the data
+        if (next_marker_index == data.size()) break;
+
+        // Runs of zeros are encoded as markers of 1 that each point at the next byte. Walking those directly avoids
+        // waiting on each marker to be read before knowing where the next one is
+        if (marker == 1) {
+            while (input[next_marker_index] == 1 && next_marker_index + 1 < data.size()) {
+                if (output_index >= output.size()) return std::nullopt;
+                out[output_index++] = 0x00;
+                next_marker_index++;
+            }
+        }
+
+        if (input[next_marker_index] == 0) return std::nullopt;
+        // Block markers are special because they don't have a zero at the position they mark
+        if (marker != 0xFF) {
+            if (output_index >= output.size()) return std::nullopt;
+            out[output_index++] = 0x00;
+        }
+        // Markers cannot point past the end of the data
+        if (next_marker_index + input[next_marker_index] > data.size()) return std::nullopt;
+        marker_index = next_marker_index;
+    }
+
+    return output_index;
+}
+
+std::optional<size_t> Utils::cobs_decode_in_place(const std::span<uint8_t> data) {
+    return cobs_decode(std::span<const uint8_t>{data}, data);
+}
+
+std::optional<size_t> Utils::cobs_encode_reference(const std::span<const uint8_t> data, const std::span<uint8_t> output) {
+    if (data.empty()) return std::nullopt;
+    // Make sure the worst case encoding fits, so the loop below never has to check bounds
+    if (output.size() < cobs_max_encoded_size(data.size())) return std::nullopt;
 
     int marker_index = 0; // Stores the index of where the marker will go
     int output_index = 1;
@@ -32,12 +219,10 @@ std::optional<std::vector<uint8_t>> Utils::cobs_encode(const std::vector<uint8_t
     output[marker_index] = output_index - marker_index;
     output[output_index++] = 0x00;
 
-    output.resize(output_index);
-
-    return output;
+    return output_index;
 }
 
-std::optional<std::vector<uint8_t>> Utils::cobs_decode(const std::vector<uint8_t>& data) {
+std::optional<size_t> Utils::cobs_decode_reference(const std::span<const uint8_t> data, const std::span<uint8_t> output) {
     // Encoded data must have at east 2 elements.
     // If it has only 1, that elements says where the next zero is, but that marker is not supported to be 0,
     // so it must be 1 but there are no other elements in the array
@@ -49,21 +234,17 @@ std::optional<std::vector<uint8_t>> Utils::cobs_decode(const std::vector<uint8_t
     // Encoded cobs bytes cannot contain zeros
     if (data[0] == 0) return std::nullopt;
 
-    std::vector<uint8_t> output(data.size() - 1);
-
-    int output_index = 0;
-    int next_marker_index = data[0]; // get the next marker, which is always the first element
+    size_t output_index = 0;
+    size_t next_marker_index = data[0]; // get the next marker, which is always the first element
     bool was_block_marker = (data[0] == 0xFF);
     // Block markers are special because they don't have a zero at the position they mark
 
-    // Note: Jumping directly to marker indexes and memcpying the data ranges into output would be
-    // more efficient, but this does not matter for our usage for now, especially since most
-    // of our packets are very small and full of zeros
-
-    for (int i = 1; i < data.size(); i++) {
+    // Note: output_index is always less than i, so output is allowed to be the same memory as data (see cobs_decode_in_place)
+    for (size_t i = 1; i < data.size(); i++) {
         if (data[i] == 0) return std::nullopt; // cobs encoded bytes cannot contains zeros
         if (i == next_marker_index) {
             if (!was_block_marker) {
+                if (output_index >= output.size()) return std::nullopt;
                 output[output_index++] = 0x00;
             }
 
@@ -73,10 +254,10 @@ std::optional<std::vector<uint8_t>> Utils::cobs_decode(const std::vector<uint8_t
             was_block_marker = (data[i] == 0xFF);
         }
         else {
+            if (output_index >= output.size()) return std::nullopt;
             output[output_index++] = data[i];
         }
     }
-    output.resize(output_index);
 
-    return output;
+    return output_index;
 }
@@ -1,17 +1,72 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <vector>
 #include <optional>
+#include <span>
+#include <vector>
 
 namespace Utils {
+    /** @returns A monotonic time in microseconds, for measuring how long things take. */
+    uint64_t micros();
+
+    /**
+     * @returns The maximum amount of bytes that cobs encoding `length` bytes can produce, including the null delimiter.
+     * Encoded data will be the originals size, include a start and end byte, and have +1 byte each time it goes over 254
+     * without a zero in between.
+     */
+    constexpr size_t cobs_max_encoded_size(const size_t length) {
+        return length + length / 254 + 2;
+    }
+
     /** Encodes an array of bytes and returns the cobs encoding of it, or nullopt if it fails for any reason. */
     std::optional<std::vector<uint8_t>> cobs_encode(const std::vector<uint8_t>& data);
 
+    /**
+     * Encodes an array of bytes into a caller provided buffer, without allocating. The null delimiter is written at the end.
+     * @param data The bytes to encode.
+     * @param output Where the encoded bytes are written. Must be at least cobs_max_encoded_size(data.size()) bytes.
+     * @returns The amount of bytes written to output, including the null delimiter, or nullopt if it fails for any reason.
+     */
+    std::optional<size_t> cobs_encode(std::span<const uint8_t> data, std::span<uint8_t> output);
+
     /**
      * Decodes a vector of bytes encoded with cobs into a vector, or nullopt if it fails for any reason.
      *
      * NOTE: The data passed here should not contain the null delimiter at the end.
      */
     std::optional<std::vector<uint8_t>> cobs_decode(const std::vector<uint8_t>& data);
+
+    /**
+     * Decodes bytes encoded with cobs into a caller provided buffer, without allocating.
+     *
+     * NOTE: The data passed here should not contain the null delimiter at the end.
+     * @param data The encoded bytes.
+     * @param output Where the decoded bytes are written. data.size() - 1 bytes is always enough.
+     * @returns The amount of bytes written to output, or nullopt if it fails for any reason, including output being
+     * too small for the decoded bytes.
+     */
+    std::optional<size_t> cobs_decode(std::span<const uint8_t> data, std::span<uint8_t> output);
+
+    /**
+     * Decodes bytes encoded with cobs, overwriting them with the decoded bytes. Decoding never makes data larger, and
+     * each decoded byte is written at or before the position it is read from, so this is safe to do in place.
+     * If decoding fails the contents of data are unspecified.
+     *
+     * NOTE: The data passed here should not contain the null delimiter at the end.
+     * @returns The amount of decoded bytes at the start of data, or nullopt if it fails for any reason.
+     */
+    std::optional<size_t> cobs_decode_in_place(std::span<uint8_t> data);
+
+    /**
+     * Byte by byte version of the span based cobs_encode. cobs_encode uses vectorized zero scanning (see ZeroScan) and
+     * must always produce exactly the same bytes as this. Kept as a reference for tests and benchmarks.
+     */
+    std::optional<size_t> cobs_encode_reference(std::span<const uint8_t> data, std::span<uint8_t> output);
+
+    /**
+     * Byte by byte version of the span based cobs_decode. cobs_decode uses vectorized zero scanning (see ZeroScan) and
+     * must always produce exactly the same result as this. Kept as a reference for tests and benchmarks.
+     */
+    std::optional<size_t> cobs_decode_reference(std::span<const uint8_t> data, std::span<uint8_t> output);
 }
@@ -0,0 +1,85 @@
+#include "ZeroScan.hpp"
+
+#include <bit>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ZERO_SCAN_NEON 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define ZERO_SCAN_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ZERO_SCAN_SSE2 1
+#endif
+
+size_t ZeroScan::find_zero_scalar(const uint8_t* data, const size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == 0) return i;
+    }
+    return length;
+}
+
+#if ZERO_SCAN_NEON
+
+size_t ZeroScan::find_zero(const uint8_t* data, const size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        // Each byte of the comparison is 0xFF where data is zero
+        const uint8x16_t zeros = vceqq_u8(vld1q_u8(data + i), vdupq_n_u8(0));
+        // NEON has no movemask, so shift each 16 bit lane right by 4 and narrow it. This leaves 4 bits per input byte
+        // in a 64 bit value, which works on both 32 and 64 bit ARM.
+        const uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(zeros), 4);
+        const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask != 0) return i + (std::countr_zero(mask) >> 2);
+    }
+    return i + find_zero_scalar(data + i, length - i);
+}
+
+const char* ZeroScan::kernel_name() {
+    return "neon";
+}
+
+#elif ZERO_SCAN_AVX2
+
+size_t ZeroScan::find_zero(const uint8_t* data, const size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_setzero_si256())));
+        if (mask != 0) return i + std::countr_zero(mask);
+    }
+    return i + find_zero_scalar(data + i, length - i);
+}
+
+const char* ZeroScan::kernel_name() {
+    return "avx2";
+}
+
+#elif ZERO_SCAN_SSE2
+
+size_t ZeroScan::find_zero(const uint8_t* data, const size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128())));
+        if (mask != 0) return i + std::countr_zero(mask);
+    }
+    return i + find_zero_scalar(data + i, length - i);
+}
+
+const char* ZeroScan::kernel_name() {
+    return "sse2";
+}
+
+#else
+
+size_t ZeroScan::find_zero(const uint8_t* data, const size_t length) {
+    return find_zero_scalar(data, length);
+}
+
+const char* ZeroScan::kernel_name() {
+    return "scalar";
+}
+
+#endif
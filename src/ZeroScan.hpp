@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Vectorized kernels for finding zero bytes, used by the COBS codec to find runs of non zero bytes.
+ * The kernel is picked at compile time from the instruction sets the compiler is allowed to use:
+ * NEON on ARM (the Brain is built with -mfpu=neon-fp16), AVX2 or SSE2 on x86, and a plain loop otherwise.
+ */
+namespace ZeroScan {
+    /** @returns The index of the first zero byte in data, or length if there is none. */
+    size_t find_zero(const uint8_t* data, size_t length);
+
+    /** Byte by byte version of find_zero. Used for the tails the vector kernels can't handle, and as a reference in tests. */
+    size_t find_zero_scalar(const uint8_t* data, size_t length);
+
+    /** @returns The name of the kernel find_zero uses, such as "neon" or "sse2". */
+    const char* kernel_name();
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+
+#include "Packet.hpp"
+
+/**
+ * A smaller form of OpticalPacket, with each value stored as a whole number of steps of a configurable resolution
+ * instead of as a double. Sent every so often by CompactOpticalEncoder, with CompactOpticalDeltaPackets in between.
+ * SerialHandler turns these back into OpticalPackets when they are received.
+ */
+class CompactOpticalKeyframePacket : public Packet {
+public:
+    static constexpr uint8_t id = PacketIds::COMPACT_OPTICAL_KEYFRAME;
+
+    struct Data
+    {
+        /** Each value is its real value divided by 10^exponent, rounded. */
+        int32_t x;
+        int32_t y;
+        int32_t heading;
+        /** The resolution of x and y is 10^position_exponent, so -3 is steps of 0.001. */
+        int8_t position_exponent;
+        /** The resolution of heading is 10^heading_exponent. */
+        int8_t heading_exponent;
+        /** Counts up by one for each keyframe sent, so deltas can tell which keyframe they are from. */
+        uint16_t keyframe;
+    };
+
+    explicit CompactOpticalKeyframePacket(const Data& data) : Packet(Header{id}, data) {};
+};
+
+/**
+ * The difference between a sample and the keyframe before it, in steps of the keyframe's resolution. Deltas are always
+ * from the keyframe and never from each other, so a lost delta doesn't affect the ones after it.
+ */
+class CompactOpticalDeltaPacket : public Packet {
+public:
+    static constexpr uint8_t id = PacketIds::COMPACT_OPTICAL_DELTA;
+
+    struct Data
+    {
+        int16_t x;
+        int16_t y;
+        int16_t heading;
+        /** The keyframe this is a difference from. */
+        uint16_t keyframe;
+    };
+
+    explicit CompactOpticalDeltaPacket(const Data& data) : Packet(Header{id}, data) {};
+};
@@ -0,0 +1,32 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "Packet.hpp"
+
+/**
+ * One piece of a message too large for a single packet, made by Fragmenter and put back together by Reassembler.
+ * Every fragment is the same size, so the last one of a message is padded.
+ */
+class FragmentPacket : public Packet {
+public:
+    static constexpr uint8_t id = PacketIds::FRAGMENT;
+
+    /** The most message bytes in one fragment, chosen so an encoded fragment fits in one 512 byte USB packet. */
+    static constexpr size_t MAX_FRAGMENT_BYTES = 480;
+
+    struct Data
+    {
+        /** Counts up by one for each message sent, so fragments of different messages aren't mixed together. */
+        uint16_t message_id;
+        /** Where this fragment is in the message, from 0 to count - 1. */
+        uint16_t index;
+        /** The amount of fragments in the message. */
+        uint16_t count;
+        /** The amount of bytes used. Always MAX_FRAGMENT_BYTES except in the last fragment. */
+        uint16_t length;
+        std::array<uint8_t, MAX_FRAGMENT_BYTES> bytes;
+    };
+
+    explicit FragmentPacket(const Data& data) : Packet(Header{id}, data) {};
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <type_traits>
+
+#include "CompactOpticalPackets.hpp"
+#include "FragmentPacket.hpp"
+#include "InitializeAuxPacket.hpp"
+#include "InitializeOpticalCompletePacket.hpp"
+#include "InitializeOpticalPacket.hpp"
+#include "OpticalPacket.hpp"
+#include "PacketIds.hpp"
+#include "TextPacket.hpp"
+
+/** True for packet types that carry data. Packets such as InitializeAuxPacket are only a header. */
+template <typename T>
+concept HasPacketData = requires { typename T::Data; };
+
+/** @returns The size in bytes of the packet type's data, or 0 if it has none. */
+template <typename T>
+constexpr size_t packet_data_size() {
+    if constexpr (HasPacketData<T>)
+        return sizeof(typename T::Data);
+    else
+        return 0;
+}
+
+/** @returns True if the packet type's data can be sent as raw bytes. Packets without data always can. */
+template <typename T>
+constexpr bool packet_data_trivially_copyable() {
+    if constexpr (HasPacketData<T>)
+        return std::is_trivially_copyable_v<typename T::Data>;
+    else
+        return true;
+}
+
+/** @returns True if the packet type's data can be shorter than its Data struct. See VariableSizePacket. */
+template <typename T>
+constexpr bool packet_variable_size() {
+    return VariableSizePacket<T>;
+}
+
+/**
+ * A list of every packet type, used to check them and build lookup tables by id at compile time instead of by hand.
+ * @tparam Packets Every packet class. Each must have a unique static id.
+ */
+template <typename... Packets>
+class PacketRegistry {
+    /** @returns True if no two of the packets share an id. */
+    static constexpr bool ids_unique() {
+        constexpr std::array<uint8_t, sizeof...(Packets)> ids{Packets::id...};
+        for (size_t i = 0; i < ids.size(); i++) {
+            for (size_t j = i + 1; j < ids.size(); j++) {
+                if (ids[i] == ids[j]) return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(ids_unique(), "Two packet types have the same id");
+    static_assert(((Packets::id < PacketIds::LENGTH) && ...), "A packet id is not in PacketIds");
+    static_assert((std::is_base_of_v<Packet, Packets> && ...), "Every registered type must be a Packet");
+    static_assert((packet_data_trivially_copyable<Packets>() && ...),
+        "Packet data is sent as raw bytes, so it must be trivially copyable");
+
+public:
+    /** The amount of registered packet types. */
+    static constexpr size_t count = sizeof...(Packets);
+
+    /** The size of the data of each packet type, indexed by id. For variable size packets, this is the most it can be. */
+    static constexpr std::array<size_t, PacketIds::LENGTH> data_sizes = [] {
+        std::array<size_t, PacketIds::LENGTH> sizes{};
+        ((sizes[Packets::id] = packet_data_size<Packets>()), ...);
+        return sizes;
+    }();
+
+    /** If each packet type's data can be shorter than data_sizes, indexed by id. */
+    static constexpr std::array<bool, PacketIds::LENGTH> variable_sizes = [] {
+        std::array<bool, PacketIds::LENGTH> variable{};
+        ((variable[Packets::id] = packet_variable_size<Packets>()), ...);
+        return variable;
+    }();
+
+    /** If each id has a registered packet type, indexed by id. */
+    static constexpr std::array<bool, PacketIds::LENGTH> registered = [] {
+        std::array<bool, PacketIds::LENGTH> ids{};
+        ((ids[Packets::id] = true), ...);
+        return ids;
+    }();
+
+    /** @returns True if a packet type is registered with the id. */
+    static constexpr bool contains(const uint8_t id) {
+        return id < PacketIds::LENGTH && registered[id];
+    }
+};
+
+/** Every packet type. New packets must be added here. */
+using Packets = PacketRegistry<
+    InitializeAuxPacket,
+    OpticalPacket,
+    InitializeOpticalPacket,
+    InitializeOpticalCompletePacket,
+    TextPacket,
+    CompactOpticalKeyframePacket,
+    CompactOpticalDeltaPacket,
+    FragmentPacket
+>;
+
+static_assert(Packets::count == PacketIds::LENGTH, "Every id in PacketIds needs a packet type in Packets");
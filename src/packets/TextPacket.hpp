@@ -1,17 +1,32 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <string_view>
 
 #include "Packet.hpp"
 #include "SerialHandler.hpp"
 
+/**
+ * A packet of text, such as a log line. Only the characters used are sent, so short text makes a short packet. Read it
+ * with get_text on the packet, or data_text on a PacketView.
+ */
 class TextPacket : public Packet {
 public:
     static constexpr uint8_t id = PacketIds::TEXT;
+    static constexpr bool variable_size = true;
 
+    /** The most characters a packet can hold. get_data<TextPacket> fills the rest of text with zeros. */
     struct Data {
         std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE> text;
     };
 
-    TextPacket(const std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE>& arr) : Packet(Header{id}, Data{arr}) {};
-};
\ No newline at end of file
+    /** @param text The text to send. Anything past MAX_PACKET_DATA_SIZE characters is cut off. */
+    explicit TextPacket(const std::string_view text)
+        : Packet(Header{id}, text.substr(0, SerialHandler::MAX_PACKET_DATA_SIZE)) {};
+
+    /** Sends the array up to its last non zero character, since the receiver reads the rest as zeros anyway. */
+    TextPacket(const std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE>& arr)
+        : TextPacket(std::string_view{arr.data(), static_cast<size_t>(
+            std::find_if(arr.rbegin(), arr.rend(), [](const char c) { return c != 0; }).base() - arr.begin())}) {};
+};
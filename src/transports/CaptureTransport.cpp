@@ -0,0 +1,68 @@
+#include "CaptureTransport.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "Utils.hpp"
+
+CaptureTransport::CaptureTransport(Transport& inner, const char* path, const bool record_writes)
+    : inner(inner), record_writes(record_writes), file(fopen(path, "wb"), fclose), last_time(Utils::micros())
+{
+    if (!this->file)
+        return;
+
+    fwrite(MAGIC.data(), 1, MAGIC.size(), this->file.get());
+    fwrite(&VERSION, 1, sizeof(VERSION), this->file.get());
+}
+
+bool CaptureTransport::capturing() const {
+    return static_cast<bool>(this->file);
+}
+
+void CaptureTransport::flush() {
+    if (!this->file)
+        return;
+
+    mutex.lock();
+    fflush(this->file.get());
+    mutex.unlock();
+}
+
+size_t CaptureTransport::read(const std::span<uint8_t> output, const unsigned int timeout) {
+    const size_t num_read = this->inner.read(output, timeout);
+    // Reads that time out are left out, replaying them would only add time the recorded delays already account for
+    if (num_read > 0)
+        this->record(READ, output.first(num_read));
+    return num_read;
+}
+
+size_t CaptureTransport::write(const std::span<const uint8_t> bytes, const unsigned int timeout) {
+    const size_t written = this->inner.write(bytes, timeout);
+    if (this->record_writes && written > 0)
+        this->record(WRITE, bytes.first(written));
+    return written;
+}
+
+void CaptureTransport::record(const Kind kind, std::span<const uint8_t> bytes) {
+    if (!this->file)
+        return;
+
+    mutex.lock();
+    // Chunks longer than a record can hold are split, with no time between the parts
+    while (!bytes.empty()) {
+        const uint64_t now = Utils::micros();
+        const auto delay = static_cast<uint32_t>(std::min<uint64_t>(now - this->last_time, std::numeric_limits<uint32_t>::max()));
+        const auto length = static_cast<uint16_t>(std::min<size_t>(bytes.size(), std::numeric_limits<uint16_t>::max()));
+        this->last_time = now;
+
+        std::array<uint8_t, RECORD_HEADER_SIZE> header;
+        header[0] = kind;
+        memcpy(header.data() + 1, &delay, sizeof(delay));
+        memcpy(header.data() + 1 + sizeof(delay), &length, sizeof(length));
+        fwrite(header.data(), 1, header.size(), this->file.get());
+        fwrite(bytes.data(), 1, length, this->file.get());
+        bytes = bytes.subspan(length);
+    }
+    mutex.unlock();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#if PI
+#include <mutex>
+#endif
+
+#include "Transport.hpp"
+#if BRAIN
+#include "api.h" // Needed to be able to use pros::Mutex
+#endif
+
+/**
+ * Wraps another transport and records every chunk read from it, and optionally written to it, into a capture file
+ * that ReplayTransport can play back. Reads are recorded exactly as they were returned, so replaying one gives the
+ * decoder the same chunk boundaries the live connection did.
+ *
+ * The file starts with MAGIC and VERSION, followed by one record per chunk: a Kind byte, the microseconds since the
+ * previous record as a uint32, the length as a uint16, and then the bytes. Numbers are little endian.
+ *
+ * To capture a live connection, make its transport and give the handler a CaptureTransport around it:
+ * UsbTransport usb{&wrapper}; CaptureTransport capture{usb, "match.cap"}; SerialHandler handler{capture};
+ * Asynchronous receiving reads from USB directly, so it is not captured.
+ */
+class CaptureTransport : public Transport {
+public:
+    static constexpr std::array<uint8_t, 4> MAGIC{'P', 'B', 'C', 'P'};
+    static constexpr uint8_t VERSION = 1;
+    /** The size of a record before its bytes. */
+    static constexpr size_t RECORD_HEADER_SIZE = 1 + sizeof(uint32_t) + sizeof(uint16_t);
+
+    /** What a record holds. */
+    enum Kind : uint8_t {
+        READ,
+        WRITE,
+    };
+
+    /**
+     * @param inner The transport to read from and write to. Must outlive this.
+     * @param path Where to write the capture. Replaced if it already exists.
+     * @param record_writes Whether to record what is written as well as what is read.
+     */
+    CaptureTransport(Transport& inner, const char* path, bool record_writes = false);
+
+    /** @returns False if the capture file could not be opened, in which case bytes still pass through. */
+    [[nodiscard]] bool capturing() const;
+
+    /** Writes everything recorded so far to the file. It is also flushed when the transport is destroyed. */
+    void flush();
+
+    size_t read(std::span<uint8_t> output, unsigned int timeout) override;
+
+    size_t write(std::span<const uint8_t> bytes, unsigned int timeout) override;
+
+private:
+    /** Appends a record for the bytes to the file. */
+    void record(Kind kind, std::span<const uint8_t> bytes);
+
+#if PI
+    using Mutex = std::mutex;
+#elif BRAIN
+    using Mutex = pros::Mutex;
+#endif
+
+    Transport& inner;
+    bool record_writes;
+    std::unique_ptr<FILE, int (*)(FILE*)> file;
+    /** The reading and writing threads both record, so the file and time are only used under this. */
+    Mutex mutex;
+    /** When the previous record was made, in Utils::micros time. */
+    uint64_t last_time;
+};
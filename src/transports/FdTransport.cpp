@@ -0,0 +1,115 @@
+#include "FdTransport.hpp"
+
+#include <cerrno>
+#include <unistd.h>
+#if PI
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#endif
+
+FdTransport::FdTransport(const int read_fd, const int write_fd, const bool owned)
+    : read_fd(read_fd), write_fd(write_fd), owned(owned) {}
+
+FdTransport::~FdTransport() {
+    this->close_owned();
+}
+
+FdTransport::FdTransport(FdTransport&& other) noexcept
+    : read_fd(other.read_fd), write_fd(other.write_fd), owned(other.owned) {
+    other.owned = false;
+}
+
+FdTransport& FdTransport::operator=(FdTransport&& other) noexcept {
+    if (this != &other) {
+        this->close_owned();
+        this->read_fd = other.read_fd;
+        this->write_fd = other.write_fd;
+        this->owned = other.owned;
+        other.owned = false;
+    }
+    return *this;
+}
+
+void FdTransport::close_owned() {
+    if (!this->owned)
+        return;
+    close(this->read_fd);
+    if (this->write_fd != this->read_fd)
+        close(this->write_fd);
+    this->owned = false;
+}
+
+#if PI
+/** @returns True once the file descriptor is ready for the events, or false if the timeout passed first. */
+static bool wait_for(const int fd, const short events, const unsigned int timeout) {
+    pollfd poll_fd{fd, events, 0};
+    while (true) {
+        const int ready = poll(&poll_fd, 1, timeout == 0 ? -1 : static_cast<int>(timeout));
+        if (ready >= 0 || errno != EINTR)
+            return ready > 0;
+    }
+}
+#endif
+
+size_t FdTransport::read(const std::span<uint8_t> output, const unsigned int timeout) {
+    #if PI
+    if (!wait_for(this->read_fd, POLLIN, timeout))
+        return 0;
+    #endif
+
+    ssize_t num_read;
+    do {
+        num_read = ::read(this->read_fd, output.data(), output.size());
+    } while (num_read < 0 && errno == EINTR);
+    return num_read < 0 ? 0 : static_cast<size_t>(num_read);
+}
+
+size_t FdTransport::write(const std::span<const uint8_t> bytes, const unsigned int timeout) {
+    #if PI
+    if (!wait_for(this->write_fd, POLLOUT, timeout))
+        return 0;
+    #endif
+
+    ssize_t written;
+    do {
+        written = ::write(this->write_fd, bytes.data(), bytes.size());
+    } while (written < 0 && errno == EINTR);
+    return written < 0 ? 0 : static_cast<size_t>(written);
+}
+
+#if PI
+std::optional<std::pair<FdTransport, FdTransport>> FdTransport::socket_pair() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return std::nullopt;
+    return std::pair{FdTransport{fds[0], fds[0], true}, FdTransport{fds[1], fds[1], true}};
+}
+
+std::optional<std::pair<FdTransport, FdTransport>> FdTransport::pty() {
+    const int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0)
+        return std::nullopt;
+    FdTransport master_transport{master, master, true};
+    if (grantpt(master) != 0 || unlockpt(master) != 0)
+        return std::nullopt;
+
+    const char* name = ptsname(master);
+    const int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+    if (slave < 0)
+        return std::nullopt;
+    FdTransport slave_transport{slave, slave, true};
+
+    // Raw mode, so the tty layer passes every byte through as is instead of treating some as line editing or signals
+    termios settings{};
+    if (tcgetattr(slave, &settings) != 0)
+        return std::nullopt;
+    cfmakeraw(&settings);
+    if (tcsetattr(slave, TCSANOW, &settings) != 0)
+        return std::nullopt;
+
+    return std::pair{std::move(master_transport), std::move(slave_transport)};
+}
+#endif
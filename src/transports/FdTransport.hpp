@@ -0,0 +1,51 @@
+#pragma once
+
+#include <optional>
+#include <utility>
+
+#include "Transport.hpp"
+
+/**
+ * Reads and writes POSIX file descriptors. On the Brain this is stdin and stdout, which PROS connects to the USB serial
+ * port. On the PI it can be any stream, and socket_pair and pty make connected pairs so a Brain handler and a PI handler
+ * can talk to each other in one process, without hardware.
+ */
+class FdTransport : public Transport {
+public:
+    /**
+     * @param read_fd The file descriptor to read from.
+     * @param write_fd The file descriptor to write to. Can be the same as read_fd.
+     * @param owned If the file descriptors are closed when the transport is destroyed.
+     */
+    FdTransport(int read_fd, int write_fd, bool owned = false);
+
+    ~FdTransport() override;
+
+    FdTransport(const FdTransport&) = delete;
+    FdTransport& operator=(const FdTransport&) = delete;
+    FdTransport(FdTransport&& other) noexcept;
+    FdTransport& operator=(FdTransport&& other) noexcept;
+
+    size_t read(std::span<uint8_t> output, unsigned int timeout) override;
+
+    size_t write(std::span<const uint8_t> bytes, unsigned int timeout) override;
+
+#if PI
+    /** @returns Two transports connected to each other by a unix stream socket pair, or nullopt if it can't be made. */
+    static std::optional<std::pair<FdTransport, FdTransport>> socket_pair();
+
+    /**
+     * Makes a pseudo terminal in raw mode, which goes through the kernel's tty layer like a real serial port does.
+     * @returns The master side first and the slave side second, or nullopt if it can't be made.
+     */
+    static std::optional<std::pair<FdTransport, FdTransport>> pty();
+#endif
+
+private:
+    /** Closes the file descriptors if they are owned. */
+    void close_owned();
+
+    int read_fd;
+    int write_fd;
+    bool owned;
+};
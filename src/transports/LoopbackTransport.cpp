@@ -0,0 +1,59 @@
+#include "LoopbackTransport.hpp"
+
+#if PI
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+std::pair<LoopbackTransport, LoopbackTransport> LoopbackTransport::pair() {
+    auto first_to_second = std::make_shared<Pipe>();
+    auto second_to_first = std::make_shared<Pipe>();
+    return std::pair{LoopbackTransport{second_to_first, first_to_second}, LoopbackTransport{first_to_second, second_to_first}};
+}
+
+template <typename F>
+bool LoopbackTransport::wait(Pipe& pipe, std::unique_lock<std::mutex>& lock, const unsigned int timeout, F condition) {
+    if (timeout == 0) {
+        pipe.changed.wait(lock, condition);
+        return true;
+    }
+    return pipe.changed.wait_for(lock, std::chrono::milliseconds(timeout), condition);
+}
+
+size_t LoopbackTransport::read(const std::span<uint8_t> output, const unsigned int timeout) {
+    Pipe& pipe = *this->incoming;
+    std::unique_lock lock{pipe.mutex};
+    if (!wait(pipe, lock, timeout, [&pipe] { return pipe.head != pipe.tail; }))
+        return 0;
+
+    // Copy out in at most two pieces, for when the bytes wrap around the end of the ring
+    const size_t length = std::min(output.size(), pipe.head - pipe.tail);
+    const size_t start = pipe.tail % CAPACITY;
+    const size_t first = std::min(length, CAPACITY - start);
+    memcpy(output.data(), pipe.bytes.data() + start, first);
+    memcpy(output.data() + first, pipe.bytes.data(), length - first);
+    pipe.tail += length;
+
+    lock.unlock();
+    pipe.changed.notify_all();
+    return length;
+}
+
+size_t LoopbackTransport::write(const std::span<const uint8_t> bytes, const unsigned int timeout) {
+    Pipe& pipe = *this->outgoing;
+    std::unique_lock lock{pipe.mutex};
+    if (!wait(pipe, lock, timeout, [&pipe] { return pipe.head - pipe.tail < CAPACITY; }))
+        return 0;
+
+    const size_t length = std::min(bytes.size(), CAPACITY - (pipe.head - pipe.tail));
+    const size_t start = pipe.head % CAPACITY;
+    const size_t first = std::min(length, CAPACITY - start);
+    memcpy(pipe.bytes.data() + start, bytes.data(), first);
+    memcpy(pipe.bytes.data(), bytes.data() + first, length - first);
+    pipe.head += length;
+
+    lock.unlock();
+    pipe.changed.notify_all();
+    return length;
+}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#if PI
+#include <array>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "Transport.hpp"
+
+/**
+ * An in-memory connection between two transports in the same process. Each direction is a fixed size ring of bytes:
+ * a write copies the bytes into the ring and a read copies them back out, so each byte is copied once per side and
+ * nothing is allocated after construction. Used to run a Brain handler and a PI handler against each other without a
+ * kernel or hardware in the way.
+ */
+class LoopbackTransport : public Transport {
+public:
+    /** The most bytes that can be written in one direction before they have to be read. */
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    /** @returns Two transports where bytes written to one are read from the other. */
+    static std::pair<LoopbackTransport, LoopbackTransport> pair();
+
+    size_t read(std::span<uint8_t> output, unsigned int timeout) override;
+
+    /** Writes as many of the bytes as fit, waiting for room if none do. */
+    size_t write(std::span<const uint8_t> bytes, unsigned int timeout) override;
+
+private:
+    /** One direction of the connection. */
+    struct Pipe {
+        std::mutex mutex;
+        /** Notified when bytes are written or read, so a waiting reader or writer can check again. */
+        std::condition_variable changed;
+        std::array<uint8_t, CAPACITY> bytes{};
+        /** The total amount of bytes ever written. */
+        size_t head = 0;
+        /** The total amount of bytes ever read. */
+        size_t tail = 0;
+    };
+
+    LoopbackTransport(std::shared_ptr<Pipe> incoming, std::shared_ptr<Pipe> outgoing)
+        : incoming(std::move(incoming)), outgoing(std::move(outgoing)) {}
+
+    /**
+     * Waits until the condition is true or the timeout passes. The pipe's mutex must be locked.
+     * @returns The value of the condition.
+     */
+    template <typename F>
+    static bool wait(Pipe& pipe, std::unique_lock<std::mutex>& lock, unsigned int timeout, F condition);
+
+    std::shared_ptr<Pipe> incoming;
+    std::shared_ptr<Pipe> outgoing;
+};
+#endif
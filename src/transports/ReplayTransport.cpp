@@ -0,0 +1,105 @@
+#include "ReplayTransport.hpp"
+
+#if PI
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include "CaptureTransport.hpp"
+#include "Utils.hpp"
+
+ReplayTransport::ReplayTransport(std::vector<uint8_t> capture, const Timing timing)
+    : capture(std::move(capture)), timing(timing)
+{
+    // Find every chunk up front, so reads only copy. A record cut off at the end of the file ends the capture
+    size_t offset = CaptureTransport::MAGIC.size() + sizeof(CaptureTransport::VERSION);
+    uint64_t time = 0;
+    while (offset + CaptureTransport::RECORD_HEADER_SIZE <= this->capture.size()) {
+        const uint8_t kind = this->capture[offset];
+        uint32_t delay;
+        uint16_t length;
+        memcpy(&delay, this->capture.data() + offset + 1, sizeof(delay));
+        memcpy(&length, this->capture.data() + offset + 1 + sizeof(delay), sizeof(length));
+        offset += CaptureTransport::RECORD_HEADER_SIZE;
+        if (offset + length > this->capture.size())
+            break;
+
+        time += delay;
+        if (kind == CaptureTransport::READ)
+            this->chunks.push_back({offset, length, time});
+        offset += length;
+    }
+}
+
+std::optional<ReplayTransport> ReplayTransport::open(const char* path, const Timing timing) {
+    const std::unique_ptr<FILE, int (*)(FILE*)> file{fopen(path, "rb"), fclose};
+    if (!file)
+        return std::nullopt;
+
+    std::vector<uint8_t> capture;
+    std::array<uint8_t, 4096> block;
+    size_t num_read;
+    while ((num_read = fread(block.data(), 1, block.size(), file.get())) > 0) {
+        capture.insert(capture.end(), block.begin(), block.begin() + num_read);
+    }
+    return from_bytes(std::move(capture), timing);
+}
+
+std::optional<ReplayTransport> ReplayTransport::from_bytes(std::vector<uint8_t> capture, const Timing timing) {
+    const size_t header_size = CaptureTransport::MAGIC.size() + sizeof(CaptureTransport::VERSION);
+    if (capture.size() < header_size
+        || !std::equal(CaptureTransport::MAGIC.begin(), CaptureTransport::MAGIC.end(), capture.begin())
+        || capture[CaptureTransport::MAGIC.size()] != CaptureTransport::VERSION)
+        return std::nullopt;
+    return ReplayTransport{std::move(capture), timing};
+}
+
+bool ReplayTransport::finished() const {
+    return this->next_chunk >= this->chunks.size();
+}
+
+void ReplayTransport::rewind() {
+    this->next_chunk = 0;
+    this->chunk_offset = 0;
+    this->start.reset();
+}
+
+size_t ReplayTransport::read(const std::span<uint8_t> output, const unsigned int timeout) {
+    if (this->finished() || output.empty())
+        return 0;
+
+    const Chunk& chunk = this->chunks[this->next_chunk];
+    if (this->timing == Timing::ORIGINAL) {
+        const uint64_t now = Utils::micros();
+        if (!this->start.has_value())
+            this->start = now - chunk.time;
+
+        // Wait for when the chunk arrived, or give up like a live read would if the timeout is sooner
+        const uint64_t due = *this->start + chunk.time;
+        if (due > now) {
+            const uint64_t wait = due - now;
+            if (timeout != 0 && wait > timeout * uint64_t{1000}) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+                return 0;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(wait));
+        }
+    }
+
+    const size_t length = std::min(output.size(), chunk.length - this->chunk_offset);
+    memcpy(output.data(), this->capture.data() + chunk.offset + this->chunk_offset, length);
+    this->chunk_offset += length;
+    if (this->chunk_offset == chunk.length) {
+        this->next_chunk++;
+        this->chunk_offset = 0;
+    }
+    return length;
+}
+
+size_t ReplayTransport::write(const std::span<const uint8_t> bytes, unsigned int) {
+    return bytes.size();
+}
+#endif
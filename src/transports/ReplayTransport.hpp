@@ -0,0 +1,67 @@
+#pragma once
+
+#if PI
+#include <optional>
+#include <vector>
+
+#include "Transport.hpp"
+
+/**
+ * Plays back a capture made by CaptureTransport. Each read returns the next recorded read chunk, with the same bytes
+ * and boundaries as when it was captured, and writes are thrown away. Used to run real match traffic through a
+ * handler on a desk, to reproduce bugs or benchmark the decoder.
+ *
+ * Once every chunk has been read, reads return 0 like a timeout. On the PI receive and receive_all keep reading until
+ * they get bytes, so check finished before each call: while (!replay.finished()) handler.receive_all();
+ */
+class ReplayTransport : public Transport {
+public:
+    enum class Timing {
+        /** Wait between chunks for as long as they were apart when captured. */
+        ORIGINAL,
+        /** Return every chunk right away. */
+        FAST,
+    };
+
+    /** @returns A transport playing the capture file, or nullopt if it can't be read or is not a capture. */
+    static std::optional<ReplayTransport> open(const char* path, Timing timing);
+
+    /** @returns A transport playing the bytes of a capture file, or nullopt if they are not a capture. */
+    static std::optional<ReplayTransport> from_bytes(std::vector<uint8_t> capture, Timing timing);
+
+    /** @returns True once every recorded read chunk has been read. */
+    [[nodiscard]] bool finished() const;
+
+    /** Starts playing from the first chunk again. */
+    void rewind();
+
+    /** Reads the next chunk. If output is smaller than the chunk, the rest is returned by the next read. */
+    size_t read(std::span<uint8_t> output, unsigned int timeout) override;
+
+    /** @returns The size of the bytes, which are thrown away. */
+    size_t write(std::span<const uint8_t> bytes, unsigned int timeout) override;
+
+private:
+    ReplayTransport(std::vector<uint8_t> capture, Timing timing);
+
+    /** A recorded chunk, found when the capture is loaded. */
+    struct Chunk {
+        /** Where its bytes start in capture. */
+        size_t offset;
+        size_t length;
+        /** The microseconds from the start of the capture. */
+        uint64_t time;
+    };
+
+    std::vector<uint8_t> capture;
+    /** Only the read chunks, since writes are not played back. */
+    std::vector<Chunk> chunks;
+    Timing timing;
+    /** The chunk the next read returns. */
+    size_t next_chunk = 0;
+    /** How much of next_chunk was already returned by a read into a smaller output. */
+    size_t chunk_offset = 0;
+    /** When the first read happened in Utils::micros time, which chunk times are from in ORIGINAL timing. */
+    std::optional<uint64_t> start;
+};
+#endif
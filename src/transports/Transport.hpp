@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/**
+ * A byte stream that SerialHandler sends and receives its frames over. The handler only ever reads and writes raw
+ * bytes, so the same handler code runs over the Brain's USB connection, a file descriptor, or an in-memory pipe.
+ *
+ * Reads and writes may be called at the same time from different threads, but only one thread may read and only one
+ * may write at a time.
+ */
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    /**
+     * Reads whatever bytes are available, waiting for some to arrive if there are none yet.
+     * @param output Where to write the bytes. USB reads should be at least SerialHandler::MAX_LIBUSB_PACKET_SIZE bytes.
+     * @param timeout How long to wait for bytes in milliseconds, or 0 to wait forever. Ignored on the Brain, where reads
+     * never wait.
+     * @returns The amount of bytes read. 0 if the timeout passed, or the read failed.
+     */
+    virtual size_t read(std::span<uint8_t> output, unsigned int timeout) = 0;
+
+    /**
+     * Writes the bytes once.
+     * @param timeout How long to wait for room to write in milliseconds, or 0 to wait forever. Ignored on the Brain.
+     * @returns The amount of bytes written, which can be less than asked for. 0 if the write failed or timed out.
+     */
+    virtual size_t write(std::span<const uint8_t> bytes, unsigned int timeout) = 0;
+};
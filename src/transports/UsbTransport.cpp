@@ -0,0 +1,95 @@
+#include "UsbTransport.hpp"
+
+#if PI
+#include <cstdio>
+
+#include "SerialHandler.hpp"
+
+UsbTransport::UsbTransport(const UsbTransferWrapper* usb_wrapper) : usb_wrapper(usb_wrapper) {
+    // Initialize a libusb context of our own, so async transfers can be handled in it without touching anyone else's
+    if (const int error = libusb_init_context(&this->usb_context, nullptr, 0); error != LIBUSB_SUCCESS) {
+        printf("Failed to initialize libusb context: %s\n", libusb_error_name(error));
+        this->usb_context = nullptr;
+        return;
+    }
+
+    // Get the list of devices on the system
+    libusb_device** devices = nullptr;
+    const ssize_t device_count = libusb_get_device_list(this->usb_context, &devices);
+    if (device_count < 0) {
+        printf("Failed to get device list: %s\n", libusb_error_name(static_cast<int>(device_count)));
+        return;
+    }
+
+    // TODO: We should probably retry initializing the context and getting the device list if they ever fail.
+
+    // Loop the connected devices to find the VEX V5 Brain
+    for (int i = 0; i < device_count; i++) {
+        libusb_device_descriptor device_descriptor{};
+        // Get the device descriptor. If LIBUSBX_API_VERSION >= 0x01000102 then this function will never fail.
+        if (libusb_get_device_descriptor(devices[i], &device_descriptor) != LIBUSB_SUCCESS)
+            continue;
+
+        if (device_descriptor.idVendor == SerialHandler::VEX_USB_VENDOR_ID) {
+            libusb_device_handle* handle = nullptr;
+            if (const int error = libusb_open(devices[i], &handle) != LIBUSB_SUCCESS) {
+                printf("Failed to open VEX Brain: %s\n", libusb_error_name(error));
+                // TODO: If we find it can error, we should make a loop to try to open multiple times
+                return;
+            }
+            this->device_handle = handle;
+
+            libusb_detach_kernel_driver(handle, SerialHandler::VEX_USB_USER_INTERFACE_NUMBER);
+            libusb_detach_kernel_driver(handle, SerialHandler::VEX_USB_USER_DATA_INTERFACE_NUMBER);
+
+            // Since this is output, line_coding_bytes will not be modified by libusb_control_transfer
+            libusb_control_transfer(
+                handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
+                SerialHandler::SET_LINE_CODING, 0, SerialHandler::VEX_USB_COMMUNICATIONS_INTERFACE_NUMBER,
+                const_cast<unsigned char*>(SerialHandler::line_coding_bytes), sizeof(SerialHandler::line_coding_bytes), 0);
+
+            libusb_control_transfer(
+                handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_ENDPOINT_OUT,
+                SerialHandler::SET_LINE_CODING, 0, SerialHandler::VEX_USB_USER_INTERFACE_NUMBER,
+                const_cast<unsigned char*>(SerialHandler::line_coding_bytes), sizeof(SerialHandler::line_coding_bytes), 0);
+            break;
+
+        }
+    }
+
+    // All devices start with ref count of 1, this subtracts 1 so it dereferences them all
+    libusb_free_device_list(devices, 1);
+
+    if (!this->device_handle) printf("Failed to find vex brain!\n");
+}
+
+UsbTransport::~UsbTransport() {
+    if (this->device_handle)
+        libusb_close(this->device_handle);
+    if (this->usb_context)
+        libusb_exit(this->usb_context);
+}
+
+size_t UsbTransport::read(const std::span<uint8_t> output, const unsigned int timeout) {
+    int num_read = 0;
+    // Reading the MAX_PACKET_SIZE is important so that libusb does not throw an error for not having enough room for the data (and cause undefined behavior)
+    // https://libusb.sourceforge.io/api-1.0/libusb_packetoverflow.html
+    const int res = usb_wrapper->libusb_bulk_transfer(this->device_handle, SerialHandler::VEX_USB_USER_DATA_ENDPOINT_IN,
+                                                      output.data(), static_cast<int>(output.size()), &num_read, timeout);
+    // Timing out is expected when a timeout is given, and some data may still have been read
+    if (res && res != LIBUSB_ERROR_TIMEOUT)
+        printf("Error: %s\n", libusb_error_name(res));
+    return num_read < 0 ? 0 : static_cast<size_t>(num_read);
+}
+
+size_t UsbTransport::write(const std::span<const uint8_t> bytes, const unsigned int timeout) {
+    int transferred = 0;
+    const int res = usb_wrapper->libusb_bulk_transfer(this->device_handle, SerialHandler::VEX_USB_USER_DATA_ENDPOINT_OUT,
+                                                      const_cast<unsigned char*>(bytes.data()),
+                                                      static_cast<int>(bytes.size()), &transferred, timeout);
+    // Timing out is not an error here, the bytes that were transferred before it still count
+    if (res && res != LIBUSB_ERROR_TIMEOUT)
+        printf("Error: %s\n", libusb_error_name(res));
+    return transferred < 0 ? 0 : static_cast<size_t>(transferred);
+}
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+#if PI
+#include <libusb.h>
+
+#include "Transport.hpp"
+
+// helper methods used for mocking usb methods in gtest
+class UsbTransferWrapper {
+public:
+    virtual ~UsbTransferWrapper() = default;
+    virtual int libusb_bulk_transfer(libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) const = 0;
+
+    virtual int libusb_submit_transfer(libusb_transfer *transfer) const = 0;
+
+    virtual int libusb_cancel_transfer(libusb_transfer *transfer) const = 0;
+
+    virtual int libusb_handle_events(libusb_context *ctx) const = 0;
+
+    virtual int libusb_handle_events_timeout(libusb_context *ctx, timeval *tv) const = 0;
+};
+
+class UsbTransferProd : public UsbTransferWrapper {
+public:
+    int libusb_bulk_transfer(libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) const override {
+        return ::libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+    }
+
+    int libusb_submit_transfer(libusb_transfer *transfer) const override {
+        return ::libusb_submit_transfer(transfer);
+    }
+
+    int libusb_cancel_transfer(libusb_transfer *transfer) const override {
+        return ::libusb_cancel_transfer(transfer);
+    }
+
+    int libusb_handle_events(libusb_context *ctx) const override {
+        return ::libusb_handle_events(ctx);
+    }
+
+    int libusb_handle_events_timeout(libusb_context *ctx, timeval *tv) const override {
+        return ::libusb_handle_events_timeout(ctx, tv);
+    }
+};
+
+/**
+ * The USB connection to the Brain's user data interface, found and opened with libusb. This is what SerialHandler uses
+ * on the PI unless it is given another transport. See SerialHandler for how the Brain's USB device is laid out.
+ */
+class UsbTransport : public Transport {
+public:
+    /**
+     * Finds the Brain, opens it, and sets up its serial line. If it can't be found, reads and writes fail.
+     * Leave the default argument unless you want to use the gtest usb wrappers.
+     */
+    explicit UsbTransport(const UsbTransferWrapper* usb_wrapper = &default_wrapper);
+
+    /** Closes the device handle if the Brain was opened. */
+    ~UsbTransport() override;
+
+    UsbTransport(const UsbTransport&) = delete;
+    UsbTransport& operator=(const UsbTransport&) = delete;
+
+    size_t read(std::span<uint8_t> output, unsigned int timeout) override;
+
+    size_t write(std::span<const uint8_t> bytes, unsigned int timeout) override;
+
+    /** @returns The handle of the opened Brain, or nullptr if it was not found. Used to queue async transfers. */
+    [[nodiscard]] libusb_device_handle* handle() const {
+        return this->device_handle;
+    }
+
+    [[nodiscard]] const UsbTransferWrapper* wrapper() const {
+        return this->usb_wrapper;
+    }
+
+    /** @returns The libusb context the Brain was opened with, which async transfers are handled in. */
+    [[nodiscard]] libusb_context* context() const {
+        return this->usb_context;
+    }
+
+private:
+    static constexpr UsbTransferProd default_wrapper{};
+
+    /** The libusb context owned by this transport, or nullptr if it could not be made. */
+    libusb_context* usb_context = nullptr;
+    /** A libusb device handle. */
+    libusb_device_handle* device_handle = nullptr;
+    const UsbTransferWrapper* usb_wrapper;
+};
+#endif
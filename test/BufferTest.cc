@@ -0,0 +1,254 @@
+#include "Buffer.hpp"
+#include "OpticalPacket.hpp"
+#include "TextPacket.hpp"
+#include "gtest/gtest.h"
+
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+// using this fixture gives the tests access to the private add method, which is normally only used by SerialHandler
+class BufferTest : public testing::Test {
+protected:
+    Buffer buffer;
+
+    bool add(const Packet& packet) {
+        return add(this->buffer, packet);
+    }
+
+    static bool add(Buffer& to, const Packet& packet) {
+        return to.add(packet);
+    }
+
+    /** @returns The x of the packet, which the tests use to tell packets apart. */
+    static double x_of(const std::optional<Packet>& packet) {
+        return packet->get_data<OpticalPacket>().x;
+    }
+};
+
+// test that pop_latest returns the newest packet first, and packets of any size survive the ring
+TEST_F(BufferTest, PopLatestOrder) {
+    EXPECT_EQ(buffer.pop_latest(), std::nullopt);
+
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(add(OpticalPacket{static_cast<double>(i), 0, 0}));
+    }
+    EXPECT_EQ(buffer.size(), 5);
+    for (int i = 4; i >= 0; i--) {
+        EXPECT_EQ(x_of(buffer.pop_latest()), i);
+    }
+    EXPECT_EQ(buffer.pop_latest(), std::nullopt);
+
+    std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE> text{};
+    text[text.size() - 1] = 'z';
+    EXPECT_TRUE(add(TextPacket{text}));
+    auto popped = buffer.pop_latest();
+    ASSERT_NE(popped, std::nullopt);
+    EXPECT_EQ(popped->get_id(), PacketIds::TEXT);
+    EXPECT_EQ(popped->get_data<TextPacket>().text, text);
+}
+
+// test popping from the oldest end, and peeking at both ends without removing anything
+TEST_F(BufferTest, PopOldestAndPeek) {
+    EXPECT_EQ(buffer.pop_oldest(), std::nullopt);
+    EXPECT_EQ(buffer.peek_latest(), std::nullopt);
+    EXPECT_EQ(buffer.peek_oldest(), std::nullopt);
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(add(OpticalPacket{static_cast<double>(i), 0, 0}));
+    }
+    EXPECT_EQ(x_of(buffer.peek_latest()), 3);
+    EXPECT_EQ(x_of(buffer.peek_oldest()), 0);
+    EXPECT_EQ(buffer.size(), 4) << "peeking should not remove anything";
+
+    EXPECT_EQ(x_of(buffer.pop_oldest()), 0);
+    EXPECT_EQ(x_of(buffer.pop_latest()), 3);
+    EXPECT_EQ(x_of(buffer.pop_oldest()), 1);
+    EXPECT_EQ(x_of(buffer.peek_latest()), 2);
+    EXPECT_EQ(x_of(buffer.pop_oldest()), 2);
+    EXPECT_EQ(buffer.pop_oldest(), std::nullopt);
+}
+
+// test taking several packets at once in the order they were added, across the end of the ring
+TEST_F(BufferTest, PopNAndDrain) {
+    std::vector<Packet> packets;
+    EXPECT_EQ(buffer.drain(std::back_inserter(packets)), 0);
+
+    // move the ring part of the way around first, so the packets wrap
+    for (size_t i = 0; i < Buffer::CAPACITY - 3; i++) {
+        add(OpticalPacket{0, 0, 0});
+        buffer.pop_latest();
+    }
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(add(OpticalPacket{static_cast<double>(i), 0, 0}));
+    }
+
+    EXPECT_EQ(buffer.pop_n(4, std::back_inserter(packets)), 4);
+    EXPECT_EQ(buffer.size(), 6);
+    EXPECT_EQ(buffer.drain(std::back_inserter(packets)), 6);
+    EXPECT_EQ(buffer.size(), 0);
+    ASSERT_EQ(packets.size(), 10);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(packets[i].get_data<OpticalPacket>().x, i);
+    }
+
+    std::array<std::optional<Packet>, 2> few;
+    EXPECT_TRUE(add(OpticalPacket{10, 0, 0}));
+    EXPECT_EQ(buffer.pop_n(few.size(), few.begin()), 1) << "there is only one packet to take";
+    EXPECT_EQ(x_of(few[0]), 10);
+}
+
+// test both policies for when the buffer is full
+TEST_F(BufferTest, FullPolicies) {
+    buffer.set_max_size(3);
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(add(OpticalPacket{static_cast<double>(i), 0, 0}));
+    }
+    EXPECT_EQ(buffer.size(), 3);
+    EXPECT_EQ(buffer.dropped(), 2) << "the 2 oldest packets should have been overwritten";
+    EXPECT_EQ(x_of(buffer.pop_latest()), 4);
+
+    buffer.set_full_policy(Buffer::FullPolicy::DROP_NEWEST);
+    EXPECT_TRUE(add(OpticalPacket{5, 0, 0}));
+    EXPECT_FALSE(add(OpticalPacket{6, 0, 0})) << "a full buffer should refuse new packets";
+    EXPECT_EQ(buffer.dropped(), 3);
+    EXPECT_EQ(x_of(buffer.pop_latest()), 5);
+    EXPECT_EQ(x_of(buffer.pop_latest()), 3);
+    EXPECT_EQ(x_of(buffer.pop_latest()), 2);
+    EXPECT_EQ(buffer.pop_latest(), std::nullopt);
+
+    // the max size can't go over the capacity
+    buffer.set_max_size(std::numeric_limits<size_t>::max());
+    for (size_t i = 0; i < Buffer::CAPACITY + 1; i++) {
+        add(OpticalPacket{0, 0, 0});
+    }
+    EXPECT_EQ(buffer.size(), Buffer::CAPACITY);
+}
+
+// test that a buffer sized for one packet type holds it through the whole ring, and counts larger packets as dropped
+TEST_F(BufferTest, SizedSlots) {
+    Buffer optical{sizeof(Header) + sizeof(OpticalPacket::Data)};
+    for (size_t i = 0; i < Buffer::CAPACITY * 2; i++) {
+        EXPECT_TRUE(add(optical, OpticalPacket{static_cast<double>(i), 1, 2}));
+    }
+    EXPECT_EQ(optical.dropped(), Buffer::CAPACITY) << "the oldest packets should have been overwritten";
+    for (size_t i = Buffer::CAPACITY; i < Buffer::CAPACITY * 2; i++) {
+        const auto packet = optical.pop_oldest();
+        ASSERT_NE(packet, std::nullopt);
+        EXPECT_EQ(packet->get_data<OpticalPacket>().x, i);
+        EXPECT_EQ(packet->get_data<OpticalPacket>().heading, 2);
+    }
+
+    EXPECT_FALSE(add(optical, TextPacket{std::string(100, 'x')})) << "the packet is larger than a slot";
+    EXPECT_EQ(optical.dropped(), Buffer::CAPACITY + 1);
+    EXPECT_EQ(optical.size(), 0);
+}
+
+// test one thread adding while others pop, making sure every packet comes out exactly once and is never torn
+TEST_F(BufferTest, ConcurrentPop) {
+    constexpr int count = 20000;
+    constexpr int consumers = 3;
+    buffer.set_full_policy(Buffer::FullPolicy::DROP_NEWEST);
+
+    std::atomic<bool> done = false;
+    std::vector<std::vector<int>> popped(consumers);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([this, &done, &popped, c] {
+            while (true) {
+                const bool finished = done.load();
+                if (std::optional<Packet> packet = buffer.pop_latest()) {
+                    const auto data = packet->get_data<OpticalPacket>();
+                    // every field is written with the same value, so a torn copy would show up here
+                    ASSERT_EQ(data.x, data.y);
+                    ASSERT_EQ(data.x, data.heading);
+                    popped[c].push_back(static_cast<int>(data.x));
+                }
+                else if (finished) {
+                    return;
+                }
+                else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for (int i = 0; i < count; i++) {
+        const auto value = static_cast<double>(i);
+        while (!add(OpticalPacket{value, value, value})) {
+            std::this_thread::yield();
+        }
+    }
+    done = true;
+    for (std::thread& thread : threads) thread.join();
+
+    std::vector<bool> seen(count);
+    size_t total = 0;
+    for (const auto& values : popped) {
+        for (const int value : values) {
+            EXPECT_FALSE(seen[value]) << value << " was popped twice";
+            seen[value] = true;
+            total++;
+        }
+    }
+    EXPECT_EQ(total, count);
+}
+
+// test one thread adding while others take batches and peek, making sure every packet comes out exactly once and in order
+TEST_F(BufferTest, ConcurrentDrain) {
+    constexpr int count = 20000;
+    constexpr int consumers = 3;
+    buffer.set_full_policy(Buffer::FullPolicy::DROP_NEWEST);
+
+    std::atomic<bool> done = false;
+    std::vector<std::vector<int>> popped(consumers);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([this, &done, &popped, c] {
+            std::vector<Packet> packets;
+            while (true) {
+                const bool finished = done.load();
+                if (const std::optional<Packet> peeked = buffer.peek_oldest()) {
+                    const auto data = peeked->get_data<OpticalPacket>();
+                    ASSERT_EQ(data.x, data.y) << "a peek should never be torn";
+                }
+
+                packets.clear();
+                const size_t taken = c == 0 ? buffer.drain(std::back_inserter(packets)) : buffer.pop_n(3, std::back_inserter(packets));
+                for (const Packet& packet : packets) {
+                    const auto data = packet.get_data<OpticalPacket>();
+                    ASSERT_EQ(data.x, data.y);
+                    ASSERT_EQ(data.x, data.heading);
+                    if (!popped[c].empty() && &packet != &packets.front()) {
+                        ASSERT_EQ(static_cast<int>(data.x), popped[c].back() + 1) << "a batch should be in order";
+                    }
+                    popped[c].push_back(static_cast<int>(data.x));
+                }
+                if (taken == 0 && finished) return;
+                if (taken == 0) std::this_thread::yield();
+            }
+        });
+    }
+
+    for (int i = 0; i < count; i++) {
+        const auto value = static_cast<double>(i);
+        while (!add(OpticalPacket{value, value, value})) {
+            std::this_thread::yield();
+        }
+    }
+    done = true;
+    for (std::thread& thread : threads) thread.join();
+
+    std::vector<bool> seen(count);
+    size_t total = 0;
+    for (const auto& values : popped) {
+        for (const int value : values) {
+            EXPECT_FALSE(seen[value]) << value << " was popped twice";
+            seen[value] = true;
+            total++;
+        }
+    }
+    EXPECT_EQ(total, count);
+}
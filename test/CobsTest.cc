@@ -1,7 +1,10 @@
 #include <cstring>
 #include <gtest/gtest.h>
+#include <random>
 
+#include "CobsDecoder.hpp"
 #include "Utils.hpp"
+#include "ZeroScan.hpp"
 
 // long string used to test encoding
 static constexpr char lorem[] = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Cras nulla dui, convallis quis quam nec, bibendum auctor lectus. Nam porta justo libero, in efficitur neque fringilla et. Praesent malesuada dui id justo varius, semper imperdiet nulla ultricies. Aliquam erat volutpat. Aenean sagittis dui sit amet velit lacinia volutpat. Sed sem lectus, ultricies ac neque eu, lobortis tempor dui. Nunc faucibus venenatis lectus vel fermentum. Duis a imperdiet neque. Sed et efficitur tellus. Donec id fermentum felis, et pretium arcu. Integer eleifend eros ut enim pulvinar, ut sagittis purus egestas. Interdum et malesuada fames ac ante ipsum primis in faucibus. Integer ultrices diam est, id tincidunt nisi tincidunt et. Nunc ex risus, ornare vitae tellus non, porta luctus urna. Mauris massa mauris, iaculis ac interdum eget, pellentesque eu augue.Mauris sed odio gravida, ultricies elit eget, bibendum tellus. Integer tincidunt vitae dolor at interdum. Aliquam a ex vel sem tempus pretium id at tortor. Sed non dui eget nisl gravida laoreet eget eget dui. Pellentesque et quam mollis lectus ultricies pulvinar. Vestibulum accumsan dolor elit, a egestas odio pellentesque sed. Nunc congue ornare leo, vel euismod nulla elementum auctor. Praesent eget mauris posuere dui sodales consequat nec at arcu. In nisi orci, ullamcorper eget dui non, condimentum porttitor nunc. Suspendisse elementum venenatis lacus, non elementum nisi iaculis non. Nullam et sodales sapien. Praesent tempor ligula eu dignissim lacinia. Cras pharetra tincidunt iaculis. Interdum et malesuada fames ac ante ipsum primis in faucibus.";
@@ -119,3 +122,228 @@ TEST(CobsTest, DecodingZeros) {
 
     EXPECT_EQ(Utils::cobs_decode(encoded2), std::nullopt);
 }
+
+// test that the span based encode and decode match the vector based versions
+TEST(CobsTest, EncodingDecodingSpan) {
+    std::vector<uint8_t> bytes(sizeof(lorem));
+    std::memcpy(bytes.data(), lorem, bytes.size());
+    bytes[10] = '\0';
+    bytes[600] = '\0';
+
+    std::array<uint8_t, Utils::cobs_max_encoded_size(sizeof(lorem))> encoded{};
+    const auto encoded_length = Utils::cobs_encode(std::span<const uint8_t>{bytes}, encoded);
+    ASSERT_NE(encoded_length, std::nullopt);
+
+    // should produce the exact same bytes as the allocating version
+    const auto expected = Utils::cobs_encode(bytes);
+    ASSERT_NE(expected, std::nullopt);
+    ASSERT_EQ(*encoded_length, expected->size());
+    EXPECT_TRUE(std::equal(expected->begin(), expected->end(), encoded.begin()));
+
+    std::array<uint8_t, sizeof(lorem)> decoded{};
+    // decode without the null delimiter
+    const auto decoded_length = Utils::cobs_decode(std::span<const uint8_t>{encoded.data(), *encoded_length - 1}, decoded);
+    ASSERT_NE(decoded_length, std::nullopt);
+    ASSERT_EQ(*decoded_length, bytes.size());
+    EXPECT_TRUE(std::equal(bytes.begin(), bytes.end(), decoded.begin()));
+}
+
+// test decoding over the top of the encoded bytes
+TEST(CobsTest, DecodingInPlace) {
+    const std::vector<uint8_t> bytes{'h', 'i', '\0', 'b', '\0', '\0', 'y', 'e'};
+
+    auto encoded = Utils::cobs_encode(bytes);
+    ASSERT_NE(encoded, std::nullopt);
+    encoded->pop_back(); // remove null delimiter
+
+    const auto decoded_length = Utils::cobs_decode_in_place(*encoded);
+    ASSERT_NE(decoded_length, std::nullopt);
+    encoded->resize(*decoded_length);
+    EXPECT_EQ(*encoded, bytes);
+}
+
+// test that the span versions fail instead of writing past the end of a buffer that is too small
+TEST(CobsTest, SpanOutputTooSmall) {
+    const std::vector<uint8_t> bytes{1, 2, 3, 4};
+    std::array<uint8_t, 4> small{};
+
+    EXPECT_EQ(Utils::cobs_encode(std::span<const uint8_t>{bytes}, small), std::nullopt);
+
+    const std::vector<uint8_t> encoded{5, 1, 2, 3, 4};
+    std::array<uint8_t, 3> smaller{};
+    EXPECT_EQ(Utils::cobs_decode(std::span<const uint8_t>{encoded}, smaller), std::nullopt);
+}
+
+/**
+ * Helper that checks the vectorized codec against the byte by byte reference for the given bytes. Both the encoded bytes
+ * and the decoded bytes must be identical.
+ */
+static void expect_matches_reference(const std::vector<uint8_t>& bytes) {
+    std::vector<uint8_t> encoded(Utils::cobs_max_encoded_size(bytes.size()));
+    std::vector<uint8_t> reference_encoded(encoded.size());
+    const auto length = Utils::cobs_encode(std::span<const uint8_t>{bytes}, encoded);
+    const auto reference_length = Utils::cobs_encode_reference(std::span<const uint8_t>{bytes}, reference_encoded);
+    ASSERT_EQ(length, reference_length) << "encoded length mismatch for " << bytes.size() << " bytes";
+    if (!length.has_value()) return;
+    encoded.resize(*length);
+    reference_encoded.resize(*reference_length);
+    ASSERT_EQ(encoded, reference_encoded) << "encoded bytes mismatch for " << bytes.size() << " bytes";
+
+    // decode without the null delimiter
+    const std::span<const uint8_t> frame{encoded.data(), encoded.size() - 1};
+    std::vector<uint8_t> decoded(frame.size());
+    std::vector<uint8_t> reference_decoded(frame.size());
+    const auto decoded_length = Utils::cobs_decode(frame, decoded);
+    const auto reference_decoded_length = Utils::cobs_decode_reference(frame, reference_decoded);
+    ASSERT_EQ(decoded_length, reference_decoded_length) << "decoded length mismatch for " << bytes.size() << " bytes";
+    if (!decoded_length.has_value()) return;
+    decoded.resize(*decoded_length);
+    reference_decoded.resize(*reference_decoded_length);
+    EXPECT_EQ(decoded, reference_decoded) << "decoded bytes mismatch for " << bytes.size() << " bytes";
+}
+
+// test that the vectorized codec produces exactly the same output as the reference on the inputs from the tests above
+TEST(CobsTest, MatchesReferenceOnKnownInputs) {
+    expect_matches_reference({'h', 'i', '\0', 'b', '\0', 'y', 'e'});
+
+    std::vector<uint8_t> long_bytes(sizeof(lorem));
+    std::memcpy(long_bytes.data(), lorem, long_bytes.size());
+    expect_matches_reference(long_bytes);
+    long_bytes[257] = '\0';
+    expect_matches_reference(long_bytes);
+
+    // mostly zeros, like a TextPacket with a short message
+    std::vector<uint8_t> sparse(1023);
+    sparse[100] = 'w';
+    sparse[250] = 't';
+    sparse[499] = 'a';
+    expect_matches_reference(sparse);
+}
+
+// test that runs of non zero bytes around the 254 byte block limit match the reference, followed by a zero or not
+TEST(CobsTest, MatchesReferenceAroundBlockLimit) {
+    for (size_t run = 250; run <= 260; run++) {
+        std::vector<uint8_t> bytes(run, 'x');
+        expect_matches_reference(bytes);
+        bytes.push_back(0);
+        expect_matches_reference(bytes);
+        bytes.push_back('y');
+        expect_matches_reference(bytes);
+    }
+}
+
+// test random data of every size up to a full packet with different amounts of zeros
+TEST(CobsTest, MatchesReferenceRandom) {
+    std::mt19937 rng{1234};
+    for (const double zero_chance : {0.0, 0.01, 0.1, 0.5, 1.0}) {
+        std::bernoulli_distribution is_zero{zero_chance};
+        std::uniform_int_distribution<int> byte{1, 255};
+        for (size_t size = 1; size <= 1024; size += 7) {
+            std::vector<uint8_t> bytes(size);
+            for (auto& b : bytes) b = is_zero(rng) ? 0 : byte(rng);
+            expect_matches_reference(bytes);
+        }
+    }
+}
+
+// test that decoding garbage fails or succeeds the same way as the reference
+TEST(CobsTest, DecodeGarbageMatchesReference) {
+    std::mt19937 rng{5678};
+    std::uniform_int_distribution<int> byte{0, 255};
+    for (int i = 0; i < 2000; i++) {
+        std::vector<uint8_t> garbage(1 + i % 300);
+        for (auto& b : garbage) b = byte(rng) | (i % 2); // half of them have no zeros, so they get further into decoding
+        std::vector<uint8_t> decoded(garbage.size());
+        std::vector<uint8_t> reference_decoded(garbage.size());
+        const auto length = Utils::cobs_decode(std::span<const uint8_t>{garbage}, decoded);
+        ASSERT_EQ(length, Utils::cobs_decode_reference(std::span<const uint8_t>{garbage}, reference_decoded));
+        if (length.has_value()) {
+            EXPECT_TRUE(std::equal(decoded.begin(), decoded.begin() + *length, reference_decoded.begin()));
+        }
+    }
+}
+
+// test that the selected zero scanning kernel finds the same zero as the scalar loop at every alignment
+TEST(CobsTest, ZeroScanMatchesScalar) {
+    std::vector<uint8_t> bytes(200, 0xAB);
+    for (size_t offset = 0; offset < 32; offset++) {
+        for (size_t length = 0; length + offset <= 100; length++) {
+            for (size_t zero = 0; zero <= length; zero++) {
+                if (zero < length) bytes[offset + zero] = 0;
+                EXPECT_EQ(ZeroScan::find_zero(bytes.data() + offset, length),
+                          ZeroScan::find_zero_scalar(bytes.data() + offset, length))
+                    << ZeroScan::kernel_name() << " kernel, offset " << offset << " length " << length;
+                if (zero < length) bytes[offset + zero] = 0xAB;
+            }
+        }
+    }
+}
+
+// test that the streaming decoder produces the same frames as cobs_decode, no matter how the stream is split up
+TEST(CobsTest, StreamingDecoderMatchesDecode) {
+    std::mt19937 rng{91011};
+    std::uniform_int_distribution<int> byte{0, 255};
+    std::uniform_int_distribution<size_t> frame_size{1, 1024};
+
+    // build a stream of many frames back to back
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 50; i++) {
+        std::vector<uint8_t> frame(frame_size(rng));
+        for (auto& b : frame) b = byte(rng) % 3 == 0 ? 0 : byte(rng);
+        auto encoded = Utils::cobs_encode(frame);
+        ASSERT_NE(encoded, std::nullopt);
+        stream.insert(stream.end(), encoded->begin(), encoded->end());
+        frames.push_back(std::move(frame));
+    }
+
+    for (const size_t chunk_size : {1, 10, 512, 100000}) {
+        std::array<uint8_t, 1024> output{};
+        CobsDecoder decoder{output};
+        size_t frame_index = 0;
+        for (size_t offset = 0; offset < stream.size(); offset += chunk_size) {
+            std::span<const uint8_t> chunk{stream.data() + offset, std::min(chunk_size, stream.size() - offset)};
+            // keep feeding the same chunk until the decoder has used all of it
+            while (!chunk.empty()) {
+                const auto [consumed, result] = decoder.feed(chunk);
+                chunk = chunk.subspan(consumed);
+                if (result == CobsDecoder::Result::INCOMPLETE) continue;
+                ASSERT_EQ(result, CobsDecoder::Result::FRAME) << "chunk size " << chunk_size << " frame " << frame_index;
+                ASSERT_LT(frame_index, frames.size());
+                const auto frame = decoder.frame();
+                EXPECT_TRUE(std::ranges::equal(frame, frames[frame_index])) << "chunk size " << chunk_size << " frame " << frame_index;
+                frame_index++;
+            }
+        }
+        EXPECT_EQ(frame_index, frames.size()) << "chunk size " << chunk_size;
+    }
+}
+
+// test that the streaming decoder rejects the same invalid frames as cobs_decode, and recovers for the next frame
+TEST(CobsTest, StreamingDecoderInvalidFrames) {
+    std::array<uint8_t, 16> output{};
+    CobsDecoder decoder{output};
+
+    const auto feed_all = [&decoder](const std::vector<uint8_t>& bytes) {
+        const auto [consumed, result] = decoder.feed(bytes);
+        EXPECT_EQ(consumed, bytes.size());
+        return result;
+    };
+
+    // same as DecodingStartIndexTooBig and DecodingMiddleIndexTooBig, with the delimiter added
+    EXPECT_EQ(feed_all({50, 1, 2, 3, 0}), CobsDecoder::Result::INVALID);
+    EXPECT_EQ(feed_all({3, 1, 2, 3, 2, 0}), CobsDecoder::Result::INVALID);
+    // a frame with only a marker is too short
+    EXPECT_EQ(feed_all({1, 0}), CobsDecoder::Result::INVALID);
+    // a frame that decodes to more than the output can hold is skipped
+    std::vector<uint8_t> large(40, 'x');
+    auto encoded_large = Utils::cobs_encode(large);
+    EXPECT_EQ(feed_all(*encoded_large), CobsDecoder::Result::INVALID);
+
+    // empty frames are skipped, and a valid frame still decodes afterward
+    const std::vector<uint8_t> bytes{'o', 'k', 0, '!'};
+    auto encoded = Utils::cobs_encode(bytes);
+    encoded->insert(encoded->begin(), {0, 0});
+    EXPECT_EQ(feed_all(*encoded), CobsDecoder::Result::FRAME);
+    EXPECT_TRUE(std::ranges::equal(decoder.frame(), bytes));
+}
@@ -0,0 +1,58 @@
+#include "CompactOptical.hpp"
+#include "gtest/gtest.h"
+
+#include <vector>
+
+/** @returns The serialized packet, which is what the decoder is given after it is received. */
+static std::vector<uint8_t> frame(const Packet& packet) {
+    return packet.serialize();
+}
+
+// test that samples come back within half a step of the configured resolution, with keyframes and deltas
+TEST(CompactOpticalTest, RoundTripResolution) {
+    CompactOpticalEncoder encoder{{.position_exponent = -2, .heading_exponent = -3, .keyframe_interval = 4}};
+    CompactOpticalDecoder decoder;
+
+    for (int i = 0; i < 20; i++) {
+        const OpticalPacket::Data sample{12.3456 + i * 0.37, -7.891 - i * 0.11, 1.23456 + i * 0.01};
+        const auto decoded = decoder.decode(frame(encoder.encode(sample)));
+        ASSERT_NE(decoded, std::nullopt);
+        EXPECT_NEAR(decoded->x, sample.x, 0.005);
+        EXPECT_NEAR(decoded->y, sample.y, 0.005);
+        EXPECT_NEAR(decoded->heading, sample.heading, 0.0005);
+    }
+}
+
+// test that keyframes are sent every interval and whenever a delta can't hold the change, and that they are smaller
+TEST(CompactOpticalTest, KeyframeInterval) {
+    CompactOpticalEncoder encoder{{.keyframe_interval = 3}};
+    std::vector<uint8_t> ids;
+    for (int i = 0; i < 6; i++) {
+        ids.push_back(encoder.encode({i * 0.1, 0, 0}).get_id());
+    }
+    // moving 100 units is 100000 steps of 0.001, too many for a delta
+    ids.push_back(encoder.encode({100, 0, 0}).get_id());
+    ids.push_back(encoder.encode({100.1, 0, 0}).get_id());
+
+    constexpr uint8_t KEY = CompactOpticalKeyframePacket::id;
+    constexpr uint8_t DELTA = CompactOpticalDeltaPacket::id;
+    EXPECT_EQ(ids, (std::vector<uint8_t>{KEY, DELTA, DELTA, KEY, DELTA, DELTA, KEY, DELTA}));
+
+    EXPECT_EQ(sizeof(CompactOpticalKeyframePacket::Data), 16);
+    EXPECT_EQ(sizeof(CompactOpticalDeltaPacket::Data), 8);
+}
+
+// test that deltas from a lost keyframe are thrown away until the next keyframe arrives
+TEST(CompactOpticalTest, LostKeyframe) {
+    CompactOpticalEncoder encoder{{.keyframe_interval = 2}};
+    CompactOpticalDecoder decoder;
+
+    EXPECT_NE(decoder.decode(frame(encoder.encode({1, 1, 1}))), std::nullopt);
+    EXPECT_NE(decoder.decode(frame(encoder.encode({2, 2, 2}))), std::nullopt);
+    encoder.encode({3, 3, 3}); // the second keyframe is lost
+    EXPECT_EQ(decoder.decode(frame(encoder.encode({4, 4, 4}))), std::nullopt) << "the delta is from the lost keyframe";
+
+    const auto decoded = decoder.decode(frame(encoder.encode({5, 5, 5})));
+    ASSERT_NE(decoded, std::nullopt);
+    EXPECT_DOUBLE_EQ(decoded->x, 5);
+}
@@ -0,0 +1,154 @@
+#include "Fragmentation.hpp"
+#include "LoopbackTransport.hpp"
+#include "SerialHandler.hpp"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/** @returns A message with a different byte at each position, so misplaced fragments are noticed. */
+static std::vector<uint8_t> make_message(const size_t size) {
+    std::vector<uint8_t> message(size);
+    for (size_t i = 0; i < size; i++) {
+        message[i] = static_cast<uint8_t>(i * 7 + i / 256);
+    }
+    return message;
+}
+
+/** @returns The serialized fragments of the message, which is what the reassembler is given after they are received. */
+static std::vector<std::vector<uint8_t>> split(Fragmenter& fragmenter, const std::vector<uint8_t>& message) {
+    std::vector<std::vector<uint8_t>> frames;
+    EXPECT_TRUE(fragmenter.split(message, [&frames](const FragmentPacket& fragment) {
+        frames.push_back(fragment.serialize());
+    }));
+    return frames;
+}
+
+// test that messages of every size come back the same, with fragments arriving in any order and twice
+TEST(FragmentationTest, RoundTrip) {
+    Fragmenter fragmenter;
+    Reassembler reassembler;
+    for (const size_t size : {size_t{0}, size_t{1}, FragmentPacket::MAX_FRAGMENT_BYTES, FragmentPacket::MAX_FRAGMENT_BYTES + 1,
+                              size_t{5000}, Reassembler::MAX_MESSAGE_SIZE}) {
+        const auto message = make_message(size);
+        auto frames = split(fragmenter, message);
+        EXPECT_EQ(frames.size(), Fragmenter::fragment_count(size));
+        std::reverse(frames.begin(), frames.end());
+
+        for (size_t i = 0; i + 1 < frames.size(); i++) {
+            EXPECT_EQ(reassembler.add(frames[i], 0), std::nullopt);
+            EXPECT_EQ(reassembler.add(frames[i], 0), std::nullopt) << "a duplicate should not finish the message";
+        }
+        const auto reassembled = reassembler.add(frames.back(), 0);
+        ASSERT_NE(reassembled, std::nullopt) << size;
+        EXPECT_TRUE(std::ranges::equal(*reassembled, message)) << size;
+    }
+    EXPECT_EQ(reassembler.stats().completed, 6);
+    EXPECT_EQ(reassembler.incomplete(), 0);
+
+    std::vector<uint8_t> too_large(Reassembler::MAX_MESSAGE_SIZE + 1);
+    EXPECT_FALSE(fragmenter.split(too_large, [](const FragmentPacket&) { FAIL() << "nothing should be sent"; }));
+}
+
+// test that incomplete messages are thrown away after the timeout, and the oldest when there are too many
+TEST(FragmentationTest, TimeoutAndEviction) {
+    Fragmenter fragmenter;
+    Reassembler reassembler{1000};
+    const auto message = make_message(2000);
+
+    // only the first fragment of each arrives
+    for (size_t i = 0; i < Reassembler::MAX_REASSEMBLIES + 1; i++) {
+        EXPECT_EQ(reassembler.add(split(fragmenter, message).front(), i), std::nullopt);
+    }
+    EXPECT_EQ(reassembler.incomplete(), Reassembler::MAX_REASSEMBLIES);
+    EXPECT_EQ(reassembler.stats().evicted, 1);
+
+    const auto late = split(fragmenter, message);
+    EXPECT_EQ(reassembler.add(late[0], 5000), std::nullopt);
+    EXPECT_EQ(reassembler.stats().timed_out, Reassembler::MAX_REASSEMBLIES);
+    EXPECT_EQ(reassembler.incomplete(), 1);
+    for (size_t i = 1; i + 1 < late.size(); i++) {
+        EXPECT_EQ(reassembler.add(late[i], 5500), std::nullopt);
+    }
+    EXPECT_NE(reassembler.add(late.back(), 5900), std::nullopt) << "the timeout is from the first fragment";
+
+    // a fragment that isn't full but isn't the last doesn't make sense
+    auto invalid = late[0];
+    invalid[sizeof(Header) + offsetof(FragmentPacket::Data, length)] = 1;
+    EXPECT_EQ(reassembler.add(invalid, 6000), std::nullopt);
+    EXPECT_EQ(reassembler.stats().invalid, 1);
+}
+
+// test sending a message larger than a packet between two handlers
+TEST(FragmentationTest, HandlerMessages) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+
+    std::vector<std::vector<uint8_t>> received;
+    ASSERT_TRUE(pi.add_message_listener([&received](SerialHandler&, const std::span<const uint8_t> message) {
+        received.emplace_back(message.begin(), message.end());
+    }));
+    EXPECT_FALSE(pi.add_message_listener([](SerialHandler&, std::span<const uint8_t>) {}));
+
+    const auto first = make_message(3000);
+    const auto second = make_message(10);
+    ASSERT_TRUE(brain.send_message(first));
+    ASSERT_TRUE(brain.send_message(second));
+
+    const size_t fragments = Fragmenter::fragment_count(first.size()) + Fragmenter::fragment_count(second.size());
+    size_t packets = 0;
+    while (packets < fragments) {
+        packets += pi.receive_all();
+    }
+    ASSERT_EQ(received.size(), 2);
+    EXPECT_EQ(received[0], first);
+    EXPECT_EQ(received[1], second);
+    EXPECT_EQ(pi.reassembly_stats().completed, 2);
+}
+
+// test that fragments are ignored until a message listener is added, and that the counts can be read while receiving
+TEST(FragmentationTest, HandlerMessageListenerAddedLate) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+
+    // with no message listener there is nothing to put the fragments back together
+    const auto early = make_message(1000);
+    ASSERT_TRUE(brain.send_message(early));
+    size_t packets = 0;
+    while (packets < Fragmenter::fragment_count(early.size())) {
+        packets += pi.receive_all();
+    }
+    EXPECT_EQ(pi.reassembly_stats().completed, 0);
+    EXPECT_EQ(pi.reassembly_stats().invalid, 0);
+
+    // the listener can read the counts itself, while another thread reads them too
+    std::vector<size_t> completed;
+    ASSERT_TRUE(pi.add_message_listener([&completed](SerialHandler& handler, std::span<const uint8_t>) {
+        completed.push_back(handler.reassembly_stats().completed);
+    }));
+    std::atomic<bool> done{false};
+    std::thread reader{[&pi, &done] {
+        size_t last = 0;
+        while (!done.load()) {
+            const size_t now = pi.reassembly_stats().completed;
+            EXPECT_GE(now, last) << "the counts should only go up";
+            last = now;
+        }
+    }};
+
+    const auto message = make_message(3000);
+    for (int i = 0; i < 3; i++) ASSERT_TRUE(brain.send_message(message));
+    packets = 0;
+    while (packets < Fragmenter::fragment_count(message.size()) * 3) {
+        packets += pi.receive_all();
+    }
+    done.store(true);
+    reader.join();
+
+    EXPECT_EQ(completed, (std::vector<size_t>{1, 2, 3}));
+    EXPECT_EQ(pi.reassembly_stats().completed, 3);
+}
@@ -0,0 +1,37 @@
+#include "LatestSlot.hpp"
+#include "gtest/gtest.h"
+
+#include <array>
+#include <span>
+#include <thread>
+
+// test that a reader never sees a half written value while the writer keeps replacing it
+TEST(LatestSlotTest, NoTornReads) {
+    constexpr uint64_t writes = 20000;
+    using Value = std::array<uint64_t, LatestSlot::MAX_SIZE / sizeof(uint64_t)>;
+    LatestSlot slot;
+
+    Value value{};
+    const auto value_bytes = std::span{reinterpret_cast<uint8_t*>(value.data()), sizeof(Value)};
+    EXPECT_EQ(slot.read(value_bytes), 0) << "nothing has been written yet";
+
+    std::thread writer{[&slot] {
+        for (uint64_t i = 1; i <= writes; i++) {
+            Value written;
+            written.fill(i); // every word is the same, so a torn read would show up as different words
+            slot.write(std::span{reinterpret_cast<const uint8_t*>(written.data()), sizeof(Value)});
+        }
+    }};
+
+    uint32_t last_sequence = 0;
+    while (last_sequence < writes) {
+        const uint32_t sequence = slot.read(value_bytes);
+        ASSERT_GE(sequence, last_sequence) << "the sequence should never go backwards";
+        if (sequence != 0) {
+            ASSERT_EQ(value[0], sequence) << "the data should be from the write the sequence says it is";
+            for (const uint64_t word : value) ASSERT_EQ(word, value[0]);
+        }
+        last_sequence = sequence;
+    }
+    writer.join();
+}
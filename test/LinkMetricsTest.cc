@@ -0,0 +1,40 @@
+#include "LinkMetrics.hpp"
+#include "gtest/gtest.h"
+
+// test that durations land in power of 2 buckets, and percentiles come from them
+TEST(LinkMetricsTest, HistogramPercentiles) {
+    EXPECT_EQ(LinkMetrics::Histogram::bucket(0), 0);
+    EXPECT_EQ(LinkMetrics::Histogram::bucket(1), 1);
+    EXPECT_EQ(LinkMetrics::Histogram::bucket(3), 2);
+    EXPECT_EQ(LinkMetrics::Histogram::bucket(4), 3);
+    EXPECT_EQ(LinkMetrics::Histogram::bucket(UINT64_MAX), LinkMetrics::HISTOGRAM_BUCKETS - 1);
+
+    LinkMetrics::Histogram histogram;
+    EXPECT_EQ(histogram.snapshot().percentile(0.5), 0) << "an empty histogram has no percentiles";
+
+    // 90 fast durations and 10 slow ones
+    for (int i = 0; i < 90; i++) histogram.record(10);
+    for (int i = 0; i < 10; i++) histogram.record(1000);
+
+    const LinkMetrics::HistogramSnapshot snapshot = histogram.snapshot();
+    EXPECT_EQ(snapshot.count, 100);
+    EXPECT_EQ(snapshot.max, 1000);
+    EXPECT_DOUBLE_EQ(snapshot.mean(), 109);
+    EXPECT_EQ(snapshot.percentile(0.5), 15) << "the upper bound of the bucket holding 10";
+    EXPECT_EQ(snapshot.percentile(0.9), 15);
+    EXPECT_EQ(snapshot.percentile(0.99), 1000) << "capped at the max instead of 1023";
+}
+
+// test that rates are packets per second between two snapshots
+TEST(LinkMetricsTest, PacketRate) {
+    LinkMetrics::Snapshot earlier;
+    LinkMetrics::Snapshot later;
+    earlier.time = 1'000'000;
+    later.time = 1'500'000;
+    earlier.packets[PacketIds::OPTICAL] = 10;
+    later.packets[PacketIds::OPTICAL] = 60;
+
+    EXPECT_DOUBLE_EQ(LinkMetrics::packet_rate(earlier, later, PacketIds::OPTICAL), 100);
+    EXPECT_DOUBLE_EQ(LinkMetrics::packet_rate(earlier, later, PacketIds::TEXT), 0);
+    EXPECT_DOUBLE_EQ(LinkMetrics::packet_rate(later, earlier, PacketIds::OPTICAL), 0) << "snapshots out of order";
+}
@@ -2,7 +2,9 @@
 
 #include "Packet.hpp"
 #include "PacketIds.hpp"
+#include "PacketView.hpp"
 #include "packets/OpticalPacket.hpp"
+#include "packets/TextPacket.hpp"
 
 
 /** Data used in all the optical tests as the data to compare against */
@@ -36,6 +38,16 @@ protected:
         EXPECT_EQ(x, OPTICAL_TEST_DATA.x) << "decoded x incorrectly";
         EXPECT_EQ(y, OPTICAL_TEST_DATA.y) << "decoded y incorrectly";
     }
+
+    /** @returns True if the packet's data is stored without allocating. */
+    static bool is_inline(const Packet& packet) {
+        return packet.data.is_inline();
+    }
+
+    /** @returns Where the packet's data is stored. */
+    static const uint8_t* data_address(const Packet& packet) {
+        return packet.data.data();
+    }
 };
 
 
@@ -67,3 +79,79 @@ TEST_F(PacketTest, ConstructingFromDataStruct) {
     const Packet packet{Header{PacketIds::OPTICAL}, data};
     test_optical_packet(packet);
 }
+
+// test that small packets are stored inline, and large ones still work after being copied and moved
+TEST_F(PacketTest, InlineAndHeapData) {
+    const OpticalPacket optical{OPTICAL_TEST_DATA.x, OPTICAL_TEST_DATA.y, OPTICAL_TEST_DATA.heading};
+    EXPECT_TRUE(is_inline(optical)) << "an optical packet should not allocate";
+    const Packet copied{optical};
+    test_optical_packet(copied);
+
+    std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE> text{};
+    text[0] = 'a';
+    text[text.size() - 1] = 'z';
+    TextPacket large{text};
+    EXPECT_FALSE(is_inline(large));
+
+    Packet copy{large};
+    EXPECT_NE(data_address(copy), data_address(large)) << "copying should not share the heap memory";
+    EXPECT_EQ(copy.get_data<TextPacket>().text, text);
+
+    // moving a large packet should take its memory instead of copying it
+    const uint8_t* address = data_address(copy);
+    Packet moved{std::move(copy)};
+    EXPECT_EQ(data_address(moved), address);
+    EXPECT_EQ(moved.get_data<TextPacket>().text, text);
+
+    // assigning over a large packet should free its memory and take the small one
+    moved = optical;
+    test_optical_packet(moved);
+    moved = std::move(large);
+    EXPECT_EQ(moved.get_data<TextPacket>().text, text);
+}
+
+// test reading fields through a view over bytes that are not aligned for the data
+TEST_F(PacketTest, ViewUnaligned) {
+    const OpticalPacket packet{OPTICAL_TEST_DATA.x, OPTICAL_TEST_DATA.y, OPTICAL_TEST_DATA.heading};
+    const auto bytes = packet.serialize();
+    // put the packet one byte into the storage, so the doubles are never aligned
+    std::vector<uint8_t> storage(bytes.size() + 1);
+    std::memcpy(storage.data() + 1, bytes.data(), bytes.size());
+
+    const PacketView<OpticalPacket> view{std::span{storage}.subspan(1)};
+    EXPECT_EQ(view.get_id(), PacketIds::OPTICAL);
+    EXPECT_EQ(view.get<&OpticalPacket::Data::x>(), OPTICAL_TEST_DATA.x);
+    EXPECT_EQ(view.get<&OpticalPacket::Data::y>(), OPTICAL_TEST_DATA.y);
+    EXPECT_EQ(view.get<&OpticalPacket::Data::heading>(), OPTICAL_TEST_DATA.heading);
+    EXPECT_EQ(view.data().heading, OPTICAL_TEST_DATA.heading);
+    test_optical_packet(view.to_packet());
+}
+
+// test that a text packet only holds the characters it uses, and reads the rest as zeros
+TEST_F(PacketTest, VariableSizeText) {
+    const TextPacket text{std::string_view{"hello"}};
+    EXPECT_EQ(text.serialized_size(), sizeof(Header) + 5);
+    EXPECT_EQ(text.get_text(), "hello");
+    EXPECT_TRUE(is_inline(text)) << "short text should not allocate";
+
+    const auto data = text.get_data<TextPacket>();
+    EXPECT_EQ(std::string_view(data.text.data()), "hello");
+    EXPECT_TRUE(std::all_of(data.text.begin() + 5, data.text.end(), [](const char c) { return c == 0; }));
+
+    // arrays are only sent up to their last character
+    std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE> array{};
+    array[0] = 'a';
+    array[2] = 'c';
+    EXPECT_EQ(TextPacket{array}.get_text(), std::string_view("a\0c", 3));
+    EXPECT_EQ(TextPacket{array}.get_data<TextPacket>().text, array);
+
+    // text that doesn't fit is cut off
+    const std::string long_text(SerialHandler::MAX_PACKET_DATA_SIZE + 10, 'x');
+    EXPECT_EQ(TextPacket{long_text}.get_text().size(), SerialHandler::MAX_PACKET_DATA_SIZE);
+
+    const auto bytes = text.serialize();
+    const PacketView<TextPacket> view{bytes};
+    EXPECT_EQ(view.data_text(), "hello");
+    EXPECT_EQ(view.get<&TextPacket::Data::text>(), data.text);
+    EXPECT_EQ(view.data().text, data.text);
+}
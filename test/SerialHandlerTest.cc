@@ -3,14 +3,30 @@
 #include "TextPacket.hpp"
 #include "gtest/gtest.h"
 
+#include <chrono>
 #include <gmock/gmock.h>
+#include <memory>
+#include <string>
 
 
 class UsbTransferMock : public UsbTransferWrapper {
 public:
     MOCK_METHOD(int, libusb_bulk_transfer, (libusb_device_handle*, unsigned char, unsigned char*, int, int*, unsigned int), (const, override));
+    MOCK_METHOD(int, libusb_submit_transfer, (libusb_transfer*), (const, override));
+    MOCK_METHOD(int, libusb_cancel_transfer, (libusb_transfer*), (const, override));
+    MOCK_METHOD(int, libusb_handle_events, (libusb_context*), (const, override));
+    MOCK_METHOD(int, libusb_handle_events_timeout, (libusb_context*, timeval*), (const, override));
 };
 
+/** @returns The frame send writes for the packet, which includes its sequence number when those are enabled. */
+static std::vector<uint8_t> encode_sent(const Packet& packet, const uint8_t sequence) {
+    auto bytes = packet.serialize();
+#if PACKET_SEQUENCE
+    bytes[offsetof(Header, sequence)] = sequence;
+#endif
+    return *Utils::cobs_encode(bytes);
+}
+
 // Note: Some of these tests do not properly mock the libusb length field, and will send the entire result even if the
 // length is less than the packet size. For packets that are over any reasonable minimum of the internal buffer length, the
 // length field is used as it should be.
@@ -57,6 +73,7 @@ TEST(SerialHandlerTest, ReceiveLargeSplit) {
     large_data[187] = 'a';
     large_data[200] = 'b';
     large_data[511] = 'c';
+    large_data[large_data.size() - 1] = 'd'; // so none of it is left off as padding
     TextPacket test_packet{large_data};
     auto encoded = Utils::cobs_encode(test_packet.serialize());
     ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
@@ -85,6 +102,7 @@ TEST(SerialHandlerTest, ReceiveLargeSplit) {
     EXPECT_EQ(received_data.text[187], 'a');
     EXPECT_EQ(received_data.text[200], 'b');
     EXPECT_EQ(received_data.text[511], 'c');
+    EXPECT_EQ(received_data.text[large_data.size() - 1], 'd');
 }
 
 // test that receiving data that is not a valid packet does not crash the program
@@ -189,8 +207,824 @@ TEST(SerialHandlerTest, OverflowBuffer) {
     delete[] large_data;
 }
 
+// test that packets overwritten because nobody popped them in time are counted
+TEST(SerialHandlerTest, DroppedPackets) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    constexpr size_t COUNT = Buffer::CAPACITY + 3;
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < COUNT; i++) {
+        const auto encoded = Utils::cobs_encode(OpticalPacket{static_cast<double>(i), 2, 3}.serialize());
+        stream.insert(stream.end(), encoded->begin(), encoded->end());
+    }
+    size_t offset = 0;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&stream, &offset](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            const size_t count = std::min<size_t>(length, stream.size() - offset);
+            std::memcpy(data, stream.data() + offset, count);
+            offset += count;
+            if (transferred) *transferred = count;
+            return 0;
+        });
+
+    size_t received = 0;
+    while (received < COUNT) {
+        received += handler.receive_all();
+    }
+    EXPECT_EQ(handler.dropped_packets<OpticalPacket>(), 3) << "the 3 oldest packets should have been overwritten";
+    EXPECT_EQ(handler.dropped_packets<TextPacket>(), 0);
+    const auto oldest = handler.pop_oldest<OpticalPacket>();
+    ASSERT_NE(oldest, std::nullopt);
+    EXPECT_EQ(oldest->get_data<OpticalPacket>().x, 3);
+}
+
+// test that receive_all decodes every packet in a single read, and runs the listener for each of them
+TEST(SerialHandlerTest, ReceiveAllFromOneRead) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    // put 5 optical packets with different data into one read
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 5; i++) {
+        auto encoded = Utils::cobs_encode(OpticalPacket{static_cast<double>(i), 2, 3}.serialize());
+        ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+        stream.insert(stream.end(), encoded->begin(), encoded->end());
+    }
+    // and the first half of another one, which should be finished by the next read
+    auto last = Utils::cobs_encode(OpticalPacket{5, 2, 3}.serialize());
+    const size_t half = last->size() / 2;
+    stream.insert(stream.end(), last->begin(), last->begin() + half);
+    ASSERT_LE(stream.size(), SerialHandler::MAX_LIBUSB_PACKET_SIZE);
+
+    int reads = 0;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(2)
+        .WillRepeatedly([&](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            if (reads++ == 0) {
+                std::memcpy(data, stream.data(), stream.size());
+                if (transferred) *transferred = stream.size();
+            }
+            else {
+                std::memcpy(data, last->data() + half, last->size() - half);
+                if (transferred) *transferred = last->size() - half;
+            }
+            return 0;
+        });
+
+    std::vector<double> listener_x;
+    handler.add_listener<OpticalPacket>([&listener_x](SerialHandler&, const Packet& packet) {
+        listener_x.push_back(packet.get_data<OpticalPacket>().x);
+    });
+
+    EXPECT_EQ(handler.receive_all(), 5);
+    EXPECT_EQ(listener_x, (std::vector<double>{0, 1, 2, 3, 4})) << "listeners should run once per packet, in order";
+    EXPECT_EQ(handler.receive_all(), 1) << "the packet split between reads should be received by the second read";
+    EXPECT_EQ(listener_x.size(), 6);
+
+    // all 6 should be in the buffer, newest first
+    for (int i = 5; i >= 0; i--) {
+        auto packet = handler.pop_latest<OpticalPacket>();
+        ASSERT_NE(packet, std::nullopt);
+        EXPECT_EQ(packet->get_data<OpticalPacket>().x, i);
+    }
+    EXPECT_EQ(handler.pop_latest<OpticalPacket>(), std::nullopt);
+}
+
+// test that a listener removed partway through a receive_all batch is not called for the rest of the batch
+TEST(SerialHandlerTest, ReceiveAllListenerRemovedMidBatch) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    // text, optical, text in one read
+    std::vector<uint8_t> stream;
+    for (const Packet& packet : {Packet{TextPacket{"a"}}, Packet{OpticalPacket{1, 2, 3}}, Packet{TextPacket{"b"}}}) {
+        auto encoded = Utils::cobs_encode(packet.serialize());
+        ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+        stream.insert(stream.end(), encoded->begin(), encoded->end());
+    }
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    std::string text;
+    handler.add_listener<TextPacket>([&text](SerialHandler&, const Packet& packet) {
+        text += packet.get_text();
+    });
+    handler.add_listener<OpticalPacket>([](SerialHandler& serial_handler, const OpticalPacket::Data&) {
+        serial_handler.remove_listener<TextPacket>();
+    });
+
+    EXPECT_EQ(handler.receive_all(), 3);
+    EXPECT_EQ(text, "a") << "the text listener was removed before the second text packet";
+    EXPECT_NE(handler.pop_latest<TextPacket>(), std::nullopt) << "the packet should still be buffered";
+}
+
+// test that async receiving keeps the transfers queued, and decodes the packets from completed transfers
+TEST(SerialHandlerTest, AsyncReceive) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    std::vector<libusb_transfer*> submitted;
+    std::vector<libusb_transfer*> cancelled;
+    EXPECT_CALL(usb_mock, libusb_submit_transfer)
+        .Times(4) // 3 from starting, and 1 from resubmitting the completed transfer
+        .WillRepeatedly([&submitted](libusb_transfer* transfer) -> int {
+            submitted.push_back(transfer);
+            return 0;
+        });
+    EXPECT_CALL(usb_mock, libusb_cancel_transfer)
+        .Times(3)
+        .WillRepeatedly([&cancelled](libusb_transfer* transfer) -> int {
+            cancelled.push_back(transfer);
+            return 0;
+        });
+    // libusb calls the callbacks of cancelled transfers while handling events
+    EXPECT_CALL(usb_mock, libusb_handle_events_timeout)
+        .WillRepeatedly([&cancelled](libusb_context*, timeval*) -> int {
+            for (libusb_transfer* transfer : cancelled) {
+                transfer->status = LIBUSB_TRANSFER_CANCELLED;
+                transfer->callback(transfer);
+            }
+            cancelled.clear();
+            return 0;
+        });
+
+    ASSERT_TRUE(handler.start_async_receive(3, SerialHandler::MAX_LIBUSB_PACKET_SIZE));
+    ASSERT_EQ(submitted.size(), 3);
+    EXPECT_EQ(submitted[0]->endpoint, SerialHandler::VEX_USB_USER_DATA_ENDPOINT_IN);
+    EXPECT_EQ(submitted[0]->length, SerialHandler::MAX_LIBUSB_PACKET_SIZE);
+
+    // complete the first transfer with two packets in it
+    auto encoded = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+    libusb_transfer* transfer = submitted[0];
+    std::memcpy(transfer->buffer, encoded->data(), encoded->size());
+    std::memcpy(transfer->buffer + encoded->size(), encoded->data(), encoded->size());
+    transfer->actual_length = static_cast<int>(encoded->size() * 2);
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    transfer->callback(transfer);
+
+    ASSERT_EQ(submitted.size(), 4) << "the completed transfer should be submitted again";
+    EXPECT_EQ(submitted[3], transfer);
+
+    EXPECT_NE(handler.pop_latest<OpticalPacket>(), std::nullopt);
+    EXPECT_NE(handler.pop_latest<OpticalPacket>(), std::nullopt);
+    EXPECT_EQ(handler.pop_latest<OpticalPacket>(), std::nullopt);
+
+    handler.stop_async_receive();
+}
+
+// test that transfers libusb never gives back are not freed, and that their late callbacks do nothing
+TEST(SerialHandlerTest, AsyncStopAbandonsUnfinished) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    std::vector<libusb_transfer*> submitted;
+    EXPECT_CALL(usb_mock, libusb_submit_transfer)
+        .Times(2)
+        .WillRepeatedly([&submitted](libusb_transfer* transfer) -> int {
+            submitted.push_back(transfer);
+            return 0;
+        });
+    EXPECT_CALL(usb_mock, libusb_cancel_transfer).Times(2).WillRepeatedly(testing::Return(0));
+    // handling events keeps failing, so the cancelled callbacks are never called
+    EXPECT_CALL(usb_mock, libusb_handle_events_timeout)
+        .Times(testing::AtLeast(1))
+        .WillRepeatedly(testing::Return(LIBUSB_ERROR_IO));
+
+    ASSERT_TRUE(handler.start_async_receive(2, SerialHandler::MAX_LIBUSB_PACKET_SIZE));
+    const auto start = std::chrono::steady_clock::now();
+    handler.stop_async_receive(20);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+
+    // libusb finally reports the cancellation after the handler gave up on it
+    for (libusb_transfer* transfer : submitted) {
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        transfer->callback(transfer);
+    }
+    EXPECT_FALSE(handler.start_async_receive(0)) << "the handler should still be usable after stopping";
+}
+
+// test that the reader thread decodes packets in the background, and that their listeners run on the thread that
+// calls process_incoming
+TEST(SerialHandlerTest, ReaderThread) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    auto encoded = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+
+    std::atomic<int> reads = 0;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            EXPECT_NE(timeout, 0) << "the reader thread must not block forever, or it can't be stopped";
+            // send 3 packets, and then act like the brain stopped sending
+            if (reads++ < 3) {
+                std::memcpy(data, encoded->data(), encoded->size());
+                if (transferred) *transferred = encoded->size();
+                return 0;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (transferred) *transferred = 0;
+            return LIBUSB_ERROR_TIMEOUT;
+        });
+
+    std::vector<std::thread::id> listener_threads;
+    handler.add_listener<OpticalPacket>([&listener_threads](SerialHandler&, const Packet&) {
+        listener_threads.push_back(std::this_thread::get_id());
+    });
+
+    ASSERT_TRUE(handler.start_reader_thread());
+    EXPECT_FALSE(handler.start_reader_thread()) << "only one reader thread should be able to run";
+
+    size_t processed = 0;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (processed < 3 && std::chrono::steady_clock::now() < deadline) {
+        processed += handler.process_incoming();
+    }
+    handler.stop_reader_thread();
+
+    EXPECT_EQ(processed, 3);
+    EXPECT_EQ(handler.dropped_incoming(), 0);
+    EXPECT_EQ(listener_threads, std::vector<std::thread::id>(3, std::this_thread::get_id()));
+    EXPECT_NE(handler.pop_latest<OpticalPacket>(), std::nullopt);
+}
+
+// test that a conflated packet type only keeps its newest data, and skips its buffer
+TEST(SerialHandlerTest, ConflatedReadLatest) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+    handler.set_conflating<OpticalPacket>(true);
+    EXPECT_EQ(handler.read_latest<OpticalPacket>(), std::nullopt) << "nothing has been received yet";
+
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 3; i++) {
+        auto encoded = Utils::cobs_encode(OpticalPacket{static_cast<double>(i), 2, 3}.serialize());
+        ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+        stream.insert(stream.end(), encoded->begin(), encoded->end());
+    }
+
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    int listener_calls = 0;
+    handler.add_listener<OpticalPacket>([&listener_calls](SerialHandler&, const Packet&) { listener_calls++; });
+
+    EXPECT_EQ(handler.receive_all(), 3);
+    EXPECT_EQ(listener_calls, 3) << "listeners should still run for every packet";
+
+    const auto latest = handler.read_latest<OpticalPacket>();
+    ASSERT_NE(latest, std::nullopt);
+    EXPECT_EQ(latest->data.x, 2);
+    EXPECT_EQ(latest->data.y, 2);
+    EXPECT_EQ(latest->data.heading, 3);
+    EXPECT_EQ(latest->sequence, 3);
+    EXPECT_EQ(handler.read_latest<OpticalPacket>()->sequence, 3) << "reading should not remove the data";
+    EXPECT_EQ(handler.pop_latest<OpticalPacket>(), std::nullopt) << "conflated packets should not be buffered";
+}
+
+// test that send waits on every write like it always has, and resumes after partial writes
+TEST(SerialHandlerTest, SendPartialWrites) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    // the mock only accepts 10 bytes at a time, like a slow connection would
+    std::vector<uint8_t> written;
+    int writes = 0;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&written, &writes](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            EXPECT_EQ(timeout, 0) << "send should wait for the write to finish";
+            writes++;
+            const int accepted = std::min(length, 10);
+            written.insert(written.end(), data, data + accepted);
+            if (transferred) *transferred = accepted;
+            return accepted < length ? LIBUSB_ERROR_TIMEOUT : 0;
+        });
+
+    handler.send(OpticalPacket{1, 2, 3});
+    handler.send(OpticalPacket{4, 5, 6});
+
+    const auto first = encode_sent(OpticalPacket{1, 2, 3}, 0);
+    const auto second = encode_sent(OpticalPacket{4, 5, 6}, 1);
+    ASSERT_EQ(written.size(), first.size() + second.size());
+    EXPECT_TRUE(std::equal(first.begin(), first.end(), written.begin()));
+    EXPECT_TRUE(std::equal(second.begin(), second.end(), written.begin() + first.size()));
+    EXPECT_GT(writes, 2);
+    EXPECT_GT(handler.send_stats().partial_writes, 0);
+    EXPECT_EQ(handler.send_stats().dropped_bytes, 0);
+}
+
+// test that send_buffered packs frames into one transfer, written by flush or when the threshold is reached
+TEST(SerialHandlerTest, SendBuffered) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    auto encoded = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+
+    std::vector<std::vector<uint8_t>> transfers;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&transfers](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            EXPECT_EQ(endpoint, SerialHandler::VEX_USB_USER_DATA_ENDPOINT_OUT);
+            transfers.emplace_back(data, data + length);
+            if (transferred) *transferred = length;
+            return 0;
+        });
+
+    handler.set_send_flush_deadline(std::numeric_limits<uint32_t>::max());
+    handler.set_send_flush_threshold(encoded->size() * 4);
+
+    // nothing should be written until flush
+    for (int i = 0; i < 3; i++) handler.send_buffered(OpticalPacket{1, 2, 3});
+    handler.flush_if_due();
+    EXPECT_TRUE(transfers.empty());
+    handler.flush();
+    ASSERT_EQ(transfers.size(), 1);
+    EXPECT_EQ(transfers[0].size(), encoded->size() * 3);
+    const auto third = encode_sent(OpticalPacket{1, 2, 3}, 2);
+    EXPECT_TRUE(std::equal(third.begin(), third.end(), transfers[0].begin() + encoded->size() * 2));
+
+    handler.flush();
+    EXPECT_EQ(transfers.size(), 1) << "flushing an empty buffer should not write anything";
+
+    // the 4th packet reaches the threshold
+    for (int i = 0; i < 4; i++) handler.send_buffered(OpticalPacket{1, 2, 3});
+    ASSERT_EQ(transfers.size(), 2);
+    EXPECT_EQ(transfers[1].size(), encoded->size() * 4);
+
+    // with no deadline every packet is written right away
+    handler.set_send_flush_deadline(0);
+    handler.send_buffered(OpticalPacket{1, 2, 3});
+    ASSERT_EQ(transfers.size(), 3);
+    EXPECT_EQ(transfers[2], encode_sent(OpticalPacket{1, 2, 3}, 7));
+}
+
+// test that the send queue resumes after partial writes, and refuses packets once it is full
+TEST(SerialHandlerTest, SendAsyncPartialWrites) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    auto encoded = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+
+    // the mock only accepts 10 bytes at a time, like a slow connection would
+    std::vector<uint8_t> written;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&written](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            EXPECT_NE(timeout, 0) << "writes should not be able to block forever";
+            const int accepted = std::min(length, 10);
+            written.insert(written.end(), data, data + accepted);
+            if (transferred) *transferred = accepted;
+            return accepted < length ? LIBUSB_ERROR_TIMEOUT : 0;
+        });
+
+    // fill the queue until it refuses a packet
+    // refused packets still use up a sequence number, so keep track of which ones were queued
+    std::vector<uint8_t> sequences;
+    uint8_t sequence = 0;
+    while (handler.send_async(OpticalPacket{1, 2, 3})) sequences.push_back(sequence++);
+    sequence++;
+    size_t queued = sequences.size();
+    EXPECT_EQ(queued, SerialHandler::SEND_QUEUE_SIZE / encoded->size());
+    EXPECT_EQ(handler.send_stats().dropped_packets, 1);
+    EXPECT_EQ(handler.send_stats().dropped_bytes, encoded->size());
+    EXPECT_TRUE(written.empty()) << "send_async should not write anything itself";
+
+    // write half of it, and then queue more so the frames wrap around the end of the queue
+    while (written.size() < queued * encoded->size() / 2) handler.write_queued();
+    while (handler.send_async(OpticalPacket{1, 2, 3})) sequences.push_back(sequence++);
+    queued = sequences.size();
+    while (handler.queued_send_bytes() > 0) ASSERT_GT(handler.write_queued(), 0);
+
+    // every frame should arrive whole and in order
+    ASSERT_EQ(written.size(), queued * encoded->size());
+    for (size_t i = 0; i < queued; i++) {
+        const auto frame = encode_sent(OpticalPacket{1, 2, 3}, sequences[i]);
+        ASSERT_TRUE(std::equal(frame.begin(), frame.end(), written.begin() + i * encoded->size())) << "frame " << i;
+    }
+    EXPECT_GT(handler.send_stats().partial_writes, 0);
+}
+
+// test that the writer thread writes packets put on the send queue
+TEST(SerialHandlerTest, WriterThread) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    std::atomic<size_t> written = 0;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&written](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            written += length;
+            if (transferred) *transferred = length;
+            return 0;
+        });
+
+    ASSERT_TRUE(handler.start_writer_thread());
+    EXPECT_FALSE(handler.start_writer_thread()) << "only one writer thread should be able to run";
+    for (int i = 0; i < 5; i++) EXPECT_TRUE(handler.send_async(OpticalPacket{1, 2, 3}));
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (handler.queued_send_bytes() > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+    handler.stop_writer_thread();
+
+    EXPECT_EQ(handler.queued_send_bytes(), 0);
+    EXPECT_EQ(written, 5 * Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize())->size());
+}
+
+/** @returns The kind of each whole frame in the bytes, 'T' for a full TextPacket and 'O' for anything smaller. */
+static std::string frame_kinds(const std::vector<uint8_t>& written) {
+    std::string kinds;
+    size_t start = 0;
+    for (size_t i = 0; i < written.size(); i++) {
+        if (written[i] != 0) continue;
+        kinds += i - start > SerialHandler::MAX_PACKET_DATA_SIZE ? 'T' : 'O';
+        start = i + 1;
+    }
+    return kinds;
+}
+
+// test that control packets are written ahead of queued text, and that the priority can be set per type and per call
+TEST(SerialHandlerTest, SendPriority) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    std::vector<uint8_t> written;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&written](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            written.insert(written.end(), data, data + length);
+            if (transferred) *transferred = length;
+            return 0;
+        });
+
+    const TextPacket text{std::string(SerialHandler::MAX_PACKET_DATA_SIZE, 'x')};
+    for (int i = 0; i < 3; i++) ASSERT_TRUE(handler.send_async(text));
+    ASSERT_GT(handler.write_queued(), 0);
+    EXPECT_TRUE(handler.send_async(OpticalPacket{1, 2, 3}));
+    EXPECT_TRUE(handler.send_async(OpticalPacket{1, 2, 3}, SerialHandler::SendPriority::BULK));
+    EXPECT_GT(handler.queued_send_bytes(SerialHandler::SendPriority::CONTROL), 0);
+    EXPECT_EQ(handler.queued_send_bytes(SerialHandler::SendPriority::NORMAL), 0);
+    while (handler.queued_send_bytes() > 0) ASSERT_GT(handler.write_queued(), 0);
+    EXPECT_EQ(frame_kinds(written), "TOTTO") << "the optical packet should only wait for the text being written";
+
+    written.clear();
+    handler.set_send_priority<OpticalPacket>(SerialHandler::SendPriority::BULK);
+    ASSERT_TRUE(handler.send_async(text));
+    ASSERT_TRUE(handler.send_async(OpticalPacket{1, 2, 3}));
+    while (handler.queued_send_bytes() > 0) ASSERT_GT(handler.write_queued(), 0);
+    EXPECT_EQ(frame_kinds(written), "TO");
+}
+
+// test that lower priorities still get to send a frame after the fairness limit of higher priority bytes
+TEST(SerialHandlerTest, SendFairness) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    std::vector<uint8_t> written;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&written](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            written.insert(written.end(), data, data + length);
+            if (transferred) *transferred = length;
+            return 0;
+        });
+
+    const auto write_all = [&handler, &written](const size_t optical) {
+        written.clear();
+        for (int i = 0; i < 2; i++) EXPECT_TRUE(handler.send_async(TextPacket{std::string(SerialHandler::MAX_PACKET_DATA_SIZE, 'x')}));
+        for (size_t i = 0; i < optical; i++) EXPECT_TRUE(handler.send_async(OpticalPacket{1, 2, 3}));
+        while (handler.queued_send_bytes() > 0) EXPECT_GT(handler.write_queued(), 0);
+        return frame_kinds(written);
+    };
+
+    // less than the default fairness, so the text waits for all of it
+    EXPECT_EQ(write_all(40), std::string(40, 'O') + "TT");
+
+    // each write takes as many optical frames as fit in the quantum, and then the text is owed a frame
+    handler.set_send_fairness(1);
+    const size_t per_write = SerialHandler::SEND_WRITE_QUANTUM / Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize())->size();
+    const std::string kinds = write_all(3 * per_write);
+    EXPECT_EQ(kinds, std::string(per_write, 'O') + "T" + std::string(per_write, 'O') + "T" + std::string(per_write, 'O'));
+}
+
+// test listeners that take the packet's data, and that packets with the wrong data size for their id are thrown away
+TEST(SerialHandlerTest, TypedListener) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    auto valid = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    // an optical packet missing its heading
+    auto bytes = OpticalPacket{4, 5, 6}.serialize();
+    bytes.resize(bytes.size() - sizeof(std::float64_t));
+    auto truncated = Utils::cobs_encode(bytes);
+    ASSERT_NE(valid, std::nullopt) << "cobs encoding failed";
+    ASSERT_NE(truncated, std::nullopt) << "cobs encoding failed";
+
+    std::vector<uint8_t> stream{truncated->begin(), truncated->end()};
+    stream.insert(stream.end(), valid->begin(), valid->end());
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    std::vector<OpticalPacket::Data> received;
+    EXPECT_TRUE(handler.add_listener<OpticalPacket>([&received](SerialHandler&, const OpticalPacket::Data& data) {
+        received.push_back(data);
+    }));
+    EXPECT_FALSE(handler.add_listener<OpticalPacket>([](SerialHandler&, const Packet&) {}))
+        << "there can only be one listener for each id";
+
+    EXPECT_EQ(handler.receive_all(), 1) << "the truncated packet should be thrown away";
+    ASSERT_EQ(received.size(), 1);
+    EXPECT_EQ(received[0].x, 1);
+    EXPECT_EQ(received[0].y, 2);
+    EXPECT_EQ(received[0].heading, 3);
+    EXPECT_TRUE(handler.remove_listener<OpticalPacket>());
+}
+
+// test that a view listener reads straight from the handler's receive storage
+TEST(SerialHandlerTest, ViewListener) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    auto encoded = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&encoded](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, encoded->data(), encoded->size());
+            if (transferred) *transferred = encoded->size();
+            return 0;
+        });
+
+    const uint8_t* viewed = nullptr;
+    double heading = 0;
+    handler.add_listener<OpticalPacket>([&](SerialHandler&, const PacketView<OpticalPacket> view) {
+        viewed = view.data_bytes().data();
+        heading = view.get<&OpticalPacket::Data::heading>();
+    });
+
+    handler.receive();
+    EXPECT_EQ(heading, 3);
+    // the view should point into the handler, not at a copy made for the listener
+    ASSERT_NE(viewed, nullptr);
+    EXPECT_TRUE(viewed > reinterpret_cast<const uint8_t*>(&handler) && viewed < reinterpret_cast<const uint8_t*>(&handler + 1));
+    EXPECT_NE(handler.pop_latest<OpticalPacket>(), std::nullopt) << "the packet should still be buffered";
+}
+
+// test that text is received with only the characters sent, and that text longer than a packet is thrown away
+TEST(SerialHandlerTest, ReceiveVariableText) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    auto too_long = TextPacket{std::string_view{"x"}}.serialize();
+    too_long.resize(sizeof(Header) + SerialHandler::MAX_PACKET_DATA_SIZE + 1, 'x');
+    std::vector<uint8_t> stream;
+    for (const auto& bytes : {TextPacket{std::string_view{"hi"}}.serialize(), too_long, TextPacket{std::string_view{""}}.serialize()}) {
+        const auto encoded = Utils::cobs_encode(bytes);
+        ASSERT_NE(encoded, std::nullopt) << "cobs encoding failed";
+        stream.insert(stream.end(), encoded->begin(), encoded->end());
+    }
+    // the stream is longer than one read, so it is handed out length bytes at a time
+    size_t offset = 0;
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .WillRepeatedly([&stream, &offset](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            const size_t count = std::min<size_t>(length, stream.size() - offset);
+            std::memcpy(data, stream.data() + offset, count);
+            offset += count;
+            if (transferred) *transferred = count;
+            return 0;
+        });
+
+    std::vector<std::string> received;
+    handler.add_listener<TextPacket>([&received](SerialHandler&, const PacketView<TextPacket> view) {
+        received.emplace_back(view.data_text());
+    });
+    size_t count = 0;
+    while (offset < stream.size()) {
+        count += handler.receive_all();
+    }
+    EXPECT_EQ(count, 2) << "the text longer than a packet should be thrown away";
+    EXPECT_EQ(received, (std::vector<std::string>{"hi", ""}));
+    const auto latest = handler.pop_latest<TextPacket>();
+    ASSERT_NE(latest, std::nullopt);
+    EXPECT_EQ(latest->serialized_size(), sizeof(Header));
+}
+
+// test that compact optical packets are received as ordinary optical packets
+TEST(SerialHandlerTest, CompactOpticalTransparent) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    CompactOpticalEncoder encoder;
+    std::vector<uint8_t> stream;
+    for (const double x : {1.0, 1.5, 2.0}) {
+        const auto frame = Utils::cobs_encode(encoder.encode({x, -x, 0.25}).serialize());
+        ASSERT_NE(frame, std::nullopt) << "cobs encoding failed";
+        stream.insert(stream.end(), frame->begin(), frame->end());
+    }
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    std::vector<double> xs;
+    EXPECT_TRUE(handler.add_listener<OpticalPacket>([&xs](SerialHandler&, const OpticalPacket::Data& data) {
+        xs.push_back(data.x);
+    }));
+
+    EXPECT_EQ(handler.receive_all(), 3);
+    EXPECT_EQ(xs, (std::vector{1.0, 1.5, 2.0}));
+    const auto latest = handler.pop_latest<OpticalPacket>();
+    ASSERT_NE(latest, std::nullopt);
+    EXPECT_DOUBLE_EQ(latest->get_data<OpticalPacket>().y, -2);
+    EXPECT_EQ(handler.pop_latest<CompactOpticalDeltaPacket>(), std::nullopt) << "compact packets are only stored as optical packets";
+}
+
+#if LINK_METRICS
+// test that bytes, frames, drops and timings are all counted
+TEST(SerialHandlerTest, LinkMetrics) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    // a block that says it is longer than the frame, a packet id that does not exist, and an optical packet missing its heading
+    std::vector<uint8_t> stream{0x05, 0x01, 0x00};
+    const auto unknown = Utils::cobs_encode(std::vector<uint8_t>{200, 1, 2, 3});
+    auto truncated = OpticalPacket{4, 5, 6}.serialize();
+    truncated.resize(truncated.size() - sizeof(std::float64_t));
+    const auto truncated_frame = Utils::cobs_encode(truncated);
+    const auto valid = Utils::cobs_encode(OpticalPacket{1, 2, 3}.serialize());
+    ASSERT_NE(unknown, std::nullopt) << "cobs encoding failed";
+    ASSERT_NE(truncated_frame, std::nullopt) << "cobs encoding failed";
+    ASSERT_NE(valid, std::nullopt) << "cobs encoding failed";
+    stream.insert(stream.end(), unknown->begin(), unknown->end());
+    stream.insert(stream.end(), truncated_frame->begin(), truncated_frame->end());
+    stream.insert(stream.end(), valid->begin(), valid->end());
+    stream.insert(stream.end(), valid->begin(), valid->end());
+
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(2)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            if (endpoint == SerialHandler::VEX_USB_USER_DATA_ENDPOINT_OUT) {
+                *transferred = length;
+                return 0;
+            }
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    size_t calls = 0;
+    EXPECT_TRUE(handler.add_listener<OpticalPacket>([&calls](SerialHandler&, const OpticalPacket::Data&) { calls++; }));
+
+    const LinkMetrics::Snapshot before = handler.metrics();
+    EXPECT_EQ(handler.receive_all(), 2);
+    handler.send(OpticalPacket{7, 8, 9});
+    const LinkMetrics::Snapshot after = handler.metrics();
+
+    EXPECT_EQ(after.bytes_read, stream.size());
+    EXPECT_EQ(after.bytes_written, encode_sent(OpticalPacket{7, 8, 9}, 0).size());
+    EXPECT_EQ(after.frames_decoded, 2);
+    EXPECT_EQ(after.dropped(LinkMetrics::Drop::COBS), 1);
+    EXPECT_EQ(after.dropped(LinkMetrics::Drop::UNKNOWN_ID), 1);
+    EXPECT_EQ(after.dropped(LinkMetrics::Drop::WRONG_SIZE), 1);
+    EXPECT_EQ(after.packets[PacketIds::OPTICAL], 2) << "sent packets are not counted as received";
+    EXPECT_EQ(after.listener_calls, calls);
+    EXPECT_EQ(after.listener_time.count, 2);
+    EXPECT_EQ(after.read_latency.count, 1);
+    EXPECT_GE(after.decode_time.count, 5) << "every frame ends a feed";
+    EXPECT_EQ(after.buffer_overflows, 0);
+    EXPECT_GE(LinkMetrics::packet_rate(before, after, PacketIds::OPTICAL), 0.0);
+}
+#endif
+
+#if PACKET_SEQUENCE
+// test that gaps, duplicates and reordering in the sequence numbers are counted and reported
+TEST(SerialHandlerTest, SequenceTracking) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    // starts at 250 to also cover wrapping around. 253 and 254 are lost, 253 shows up late, and 0 arrives twice
+    const std::vector<uint8_t> sequences{250, 251, 252, 255, 0, 0, 253, 1};
+    std::vector<uint8_t> stream;
+    for (const uint8_t sequence : sequences) {
+        const auto frame = encode_sent(OpticalPacket{1, 2, 3}, sequence);
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    ASSERT_LE(stream.size(), SerialHandler::MAX_LIBUSB_PACKET_SIZE);
+
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    std::vector<SerialHandler::SequenceEvent::Kind> events;
+    handler.set_sequence_callback([&events](SerialHandler&, const SerialHandler::SequenceEvent& event) {
+        EXPECT_EQ(event.packet_id, PacketIds::OPTICAL);
+        events.push_back(event.kind);
+    });
+
+    EXPECT_EQ(handler.receive_all(), sequences.size());
+    const SerialHandler::SequenceStats stats = handler.sequence_stats<OpticalPacket>();
+    EXPECT_EQ(stats.received, sequences.size());
+    EXPECT_EQ(stats.lost, 1) << "253 was lost, but arrived late";
+    EXPECT_EQ(stats.duplicates, 1);
+    EXPECT_EQ(stats.reordered, 1);
+    using Kind = SerialHandler::SequenceEvent::Kind;
+    EXPECT_EQ(events, (std::vector{Kind::GAP, Kind::DUPLICATE, Kind::REORDERED}));
+}
+
+// test that the sequence callback can replace itself, and is kept alive until it returns
+TEST(SerialHandlerTest, SequenceCallbackReplacesItself) {
+    UsbTransferMock usb_mock;
+    SerialHandler handler{&usb_mock}; // create a serial handler using the mock usb class
+
+    std::vector<uint8_t> stream;
+    for (const uint8_t sequence : {0, 2, 2, 1}) {
+        const auto frame = encode_sent(OpticalPacket{1, 2, 3}, sequence);
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    EXPECT_CALL(usb_mock, libusb_bulk_transfer)
+        .Times(1)
+        .WillRepeatedly([&stream](libusb_device_handle *dev_handle,
+        unsigned char endpoint, unsigned char *data, int length,
+        int *transferred, unsigned int timeout) -> int {
+            std::memcpy(data, stream.data(), stream.size());
+            if (transferred) *transferred = stream.size();
+            return 0;
+        });
+
+    using Kind = SerialHandler::SequenceEvent::Kind;
+    auto first = std::make_shared<std::vector<Kind>>();
+    auto second = std::make_shared<std::vector<Kind>>();
+    handler.set_sequence_callback([first, second](SerialHandler& serial_handler, const SerialHandler::SequenceEvent& event) {
+        serial_handler.set_sequence_callback([second](SerialHandler&, const SerialHandler::SequenceEvent& event) {
+            second->push_back(event.kind);
+        });
+        // this callback was replaced, but its captures must still be alive until it returns
+        first->push_back(event.kind);
+    });
+
+    EXPECT_EQ(handler.receive_all(), 4);
+    EXPECT_EQ(*first, (std::vector{Kind::GAP}));
+    EXPECT_EQ(*second, (std::vector{Kind::DUPLICATE, Kind::REORDERED}));
+    EXPECT_EQ(first.use_count(), 1) << "the replaced callback should be destroyed once it returned";
+}
+#endif
+
 // TODO:
-// test that callbacks work
 // test that buffers are populated in correct order
 // test mocking the read method
 // test the SerialHandler constructor when vex brain doesnt exist and other errors
@@ -0,0 +1,66 @@
+#include "SpscQueue.hpp"
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <thread>
+
+// test that elements come out in the order they went in, and that push fails once the queue is full
+TEST(SpscQueueTest, FifoAndFull) {
+    SpscQueue<int, 4> queue;
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(queue.pop(), std::nullopt);
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.push(int{i}));
+    }
+    EXPECT_FALSE(queue.push(4)) << "push should fail once the queue holds capacity elements";
+    EXPECT_EQ(queue.size(), 4);
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(queue.pop(), i);
+    }
+    EXPECT_TRUE(queue.empty());
+}
+
+// test that the queue works with types that can only be moved, and destroys what is left in it
+TEST(SpscQueueTest, MoveOnly) {
+    auto counted = std::make_shared<int>(5);
+    {
+        SpscQueue<std::unique_ptr<std::shared_ptr<int>>, 2> queue;
+        EXPECT_TRUE(queue.push(std::make_unique<std::shared_ptr<int>>(counted)));
+        EXPECT_TRUE(queue.push(std::make_unique<std::shared_ptr<int>>(counted)));
+        EXPECT_EQ(counted.use_count(), 3);
+
+        auto popped = queue.pop();
+        ASSERT_TRUE(popped.has_value());
+        EXPECT_EQ(**popped->get(), 5);
+    }
+    EXPECT_EQ(counted.use_count(), 1) << "elements left in the queue should be destroyed with it";
+}
+
+// test a producer and consumer on different threads, wrapping around the queue many times
+TEST(SpscQueueTest, TwoThreads) {
+    constexpr int count = 10000;
+    SpscQueue<int, 64> queue;
+
+    std::thread producer{[&queue] {
+        for (int i = 0; i < count; i++) {
+            while (!queue.push(int{i})) {
+                std::this_thread::yield();
+            }
+        }
+    }};
+
+    int expected = 0;
+    while (expected < count) {
+        if (std::optional<int> value = queue.pop()) {
+            ASSERT_EQ(*value, expected);
+            expected++;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    EXPECT_TRUE(queue.empty());
+}
@@ -0,0 +1,62 @@
+#include "Trace.hpp"
+#include "gtest/gtest.h"
+
+#if TRACING
+#include "LoopbackTransport.hpp"
+#include "OpticalPacket.hpp"
+#include "SerialHandler.hpp"
+
+#include <string>
+#include <thread>
+
+/** @returns The amount of times the text is in the string. */
+static size_t count_of(const std::string& string, const std::string& text) {
+    size_t count = 0;
+    for (size_t at = string.find(text); at != std::string::npos; at = string.find(text, at + 1)) count++;
+    return count;
+}
+
+// test that events from each thread are exported as chrome trace events, and that each ring keeps only the newest
+TEST(TraceTest, ThreadsAndOverwrite) {
+    Trace::clear();
+    std::thread worker{[] {
+        Trace::set_thread_name("worker \"1\"");
+        for (size_t i = 0; i < Trace::EVENTS_PER_THREAD + 10; i++) {
+            TRACE_SCOPE("worker_event");
+        }
+    }};
+    worker.join();
+    {
+        TRACE_SCOPE("main_event");
+        TRACE_INSTANT("main_instant");
+    }
+
+    const std::string json = Trace::chrome_json();
+    EXPECT_EQ(json.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0), 0);
+    EXPECT_EQ(json.substr(json.size() - 2), "]}");
+    EXPECT_EQ(count_of(json, "\"name\":\"worker_event\""), Trace::EVENTS_PER_THREAD) << "the oldest should be overwritten";
+    EXPECT_EQ(count_of(json, "\"name\":\"main_event\""), 1);
+    EXPECT_EQ(count_of(json, "\"name\":\"main_instant\",\"ph\":\"i\""), 1);
+    EXPECT_EQ(count_of(json, "\"args\":{\"name\":\"worker \\\"1\\\"\"}"), 1) << "the thread name should be escaped";
+
+    Trace::clear();
+    EXPECT_EQ(count_of(Trace::chrome_json(), "_event"), 0);
+}
+
+// test that the trace points in SerialHandler record sends and receives
+TEST(TraceTest, HandlerTracePoints) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+    pi.add_listener<OpticalPacket>([](SerialHandler&, const OpticalPacket::Data&) {});
+
+    Trace::clear();
+    brain.send(OpticalPacket{1, 2, 3});
+    pi.receive();
+
+    const std::string json = Trace::chrome_json();
+    for (const char* name : {"send", "write", "receive", "read", "cobs_decode", "decode_packet", "listener_lock", "listener"}) {
+        EXPECT_EQ(count_of(json, "\"name\":\"" + std::string(name) + "\""), 1) << name;
+    }
+}
+#endif
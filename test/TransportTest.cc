@@ -0,0 +1,369 @@
+#include "CaptureTransport.hpp"
+#include "FdTransport.hpp"
+#include "InitializeOpticalCompletePacket.hpp"
+#include "LoopbackTransport.hpp"
+#include "OpticalPacket.hpp"
+#include "ReplayTransport.hpp"
+#include "SerialHandler.hpp"
+#include "TextPacket.hpp"
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+/** Reads until `length` bytes have arrived or a read times out. */
+static std::vector<uint8_t> read_exactly(Transport& transport, const size_t length) {
+    std::vector<uint8_t> received(length);
+    size_t total = 0;
+    while (total < length) {
+        const size_t num_read = transport.read(std::span{received}.subspan(total), 1000);
+        if (num_read == 0) break;
+        total += num_read;
+    }
+    received.resize(total);
+    return received;
+}
+
+/** Checks that every byte value, including ones a terminal would normally treat specially, goes both ways unchanged. */
+static void expect_bytes_pass_through(Transport& first, Transport& second) {
+    std::vector<uint8_t> bytes(256);
+    std::iota(bytes.begin(), bytes.end(), 0);
+
+    EXPECT_EQ(first.write(bytes, 1000), bytes.size());
+    EXPECT_EQ(read_exactly(second, bytes.size()), bytes);
+    EXPECT_EQ(second.write(bytes, 1000), bytes.size());
+    EXPECT_EQ(read_exactly(first, bytes.size()), bytes);
+}
+
+/** Checks that a handler on each end can send packets to the other. */
+static void expect_handlers_talk(Transport& brain_side, Transport& pi_side) {
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+
+    std::array<char, SerialHandler::MAX_PACKET_DATA_SIZE> text{};
+    text[0] = 'h';
+    text[1] = 'i';
+    brain.send(OpticalPacket{1, 2, 3});
+    brain.send(TextPacket{text});
+
+    size_t received = 0;
+    while (received < 2) {
+        received += pi.receive_all();
+    }
+    const auto optical = pi.pop_latest<OpticalPacket>();
+    ASSERT_NE(optical, std::nullopt);
+    EXPECT_EQ(optical->get_data<OpticalPacket>().heading, 3);
+    const auto text_packet = pi.pop_latest<TextPacket>();
+    ASSERT_NE(text_packet, std::nullopt);
+    EXPECT_EQ(text_packet->get_data<TextPacket>().text, text);
+
+    // and back the other way
+    pi.send(OpticalPacket{4, 5, 6});
+    while (brain.receive_all() == 0) {}
+    const auto reply = brain.pop_latest<OpticalPacket>();
+    ASSERT_NE(reply, std::nullopt);
+    EXPECT_EQ(reply->get_data<OpticalPacket>().x, 4);
+}
+
+// test that bytes go through the loopback in order, including when they wrap around the end of the ring
+TEST(TransportTest, LoopbackWrapsAround) {
+    auto [first, second] = LoopbackTransport::pair();
+
+    std::vector<uint8_t> filler(LoopbackTransport::CAPACITY - 10, 7);
+    EXPECT_EQ(first.write(filler, 0), filler.size());
+    EXPECT_EQ(read_exactly(second, filler.size()), filler);
+
+    std::vector<uint8_t> bytes(100);
+    std::iota(bytes.begin(), bytes.end(), 0);
+    EXPECT_EQ(first.write(bytes, 0), bytes.size());
+    EXPECT_EQ(read_exactly(second, bytes.size()), bytes);
+
+    expect_bytes_pass_through(first, second);
+}
+
+// test that a full loopback only takes what fits, and that reads and writes give up after their timeout
+TEST(TransportTest, LoopbackFullAndTimeouts) {
+    auto [first, second] = LoopbackTransport::pair();
+
+    std::array<uint8_t, 16> output{};
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(second.read(output, 20), 0) << "nothing was written";
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+
+    std::vector<uint8_t> bytes(LoopbackTransport::CAPACITY + 10, 1);
+    EXPECT_EQ(first.write(bytes, 0), LoopbackTransport::CAPACITY);
+    EXPECT_EQ(first.write(bytes, 20), 0) << "there is no room left";
+    EXPECT_EQ(second.read(output, 0), output.size());
+    EXPECT_EQ(first.write(bytes, 0), output.size()) << "only the room that was read can be written";
+}
+
+// test that the socket pair and pseudo terminal pass every byte value through untouched
+TEST(TransportTest, FdPairsPassBytes) {
+    auto sockets = FdTransport::socket_pair();
+    ASSERT_NE(sockets, std::nullopt);
+    expect_bytes_pass_through(sockets->first, sockets->second);
+
+    auto pty = FdTransport::pty();
+    ASSERT_NE(pty, std::nullopt);
+    expect_bytes_pass_through(pty->first, pty->second);
+}
+
+// test a Brain handler and a PI handler talking to each other in the same process over each transport
+TEST(TransportTest, HandlerPairs) {
+    {
+        auto [brain, pi] = LoopbackTransport::pair();
+        expect_handlers_talk(brain, pi);
+    }
+    {
+        auto sockets = FdTransport::socket_pair();
+        ASSERT_NE(sockets, std::nullopt);
+        expect_handlers_talk(sockets->first, sockets->second);
+    }
+    {
+        auto pty = FdTransport::pty();
+        ASSERT_NE(pty, std::nullopt);
+        expect_handlers_talk(pty->second, pty->first);
+    }
+}
+
+// test that a waiter sleeps until another thread receives the packet, and gives up after its timeout
+TEST(TransportTest, WaitForPackets) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(pi.wait_for<OpticalPacket>(20), std::nullopt);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+    const std::array<uint8_t, 2> ids{PacketIds::OPTICAL, PacketIds::INITIALIZE_OPTICAL_COMPLETE};
+    EXPECT_EQ(pi.wait_any(ids, 1), std::nullopt);
+
+    // the packet is sent and received after the wait has started
+    std::thread receiver{[&brain, &pi] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        brain.send(InitializeOpticalCompletePacket{});
+        pi.receive_all();
+    }};
+    const auto complete = pi.wait_for<InitializeOpticalCompletePacket>(5000);
+    receiver.join();
+    ASSERT_NE(complete, std::nullopt);
+    EXPECT_EQ(complete->get_id(), PacketIds::INITIALIZE_OPTICAL_COMPLETE);
+
+    // packets already in a buffer end the wait right away, and wait_any leaves them there
+    brain.send(OpticalPacket{1, 2, 3});
+    pi.receive_all();
+    EXPECT_EQ(pi.wait_any(ids, 0), PacketIds::OPTICAL);
+    EXPECT_NE(pi.wait_for<OpticalPacket>(0), std::nullopt);
+    EXPECT_EQ(pi.wait_any(ids, 1), std::nullopt);
+}
+
+// test that waiting on a conflated type never blocks on its empty buffer, and wait_any wakes on its latest slot
+TEST(TransportTest, WaitForConflatedPackets) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+    pi.set_conflating<OpticalPacket>(true);
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(pi.wait_for<OpticalPacket>(0), std::nullopt) << "conflated types should not wait forever";
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+
+    // the packet is sent and received after the wait has started
+    const std::array<uint8_t, 1> ids{PacketIds::OPTICAL};
+    std::thread receiver{[&brain, &pi] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        brain.send(OpticalPacket{1, 2, 3});
+        pi.receive_all();
+    }};
+    EXPECT_EQ(pi.wait_any(ids, 5000), PacketIds::OPTICAL);
+    receiver.join();
+    ASSERT_NE(pi.read_latest<OpticalPacket>(), std::nullopt);
+    EXPECT_EQ(pi.read_latest<OpticalPacket>()->data.x, 1);
+
+    // the slot keeps the packet, but it was already there before this wait
+    EXPECT_EQ(pi.wait_any(ids, 1), std::nullopt);
+}
+
+// test that the writer thread writes a buffered packet once its deadline passes, without another send or flush
+TEST(TransportTest, WriterFlushesBufferedAtDeadline) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    brain.set_send_flush_deadline(5000);
+    ASSERT_TRUE(brain.start_writer_thread());
+
+    const auto start = std::chrono::steady_clock::now();
+    brain.send_buffered(OpticalPacket{1, 2, 3});
+    std::array<uint8_t, 64> bytes;
+    EXPECT_GT(pi_side.read(bytes, 1000), 0) << "the packet should be written by the writer thread";
+    const auto waited = std::chrono::steady_clock::now() - start;
+    EXPECT_GE(waited, std::chrono::microseconds(5000)) << "the packet should wait for its deadline";
+    EXPECT_LT(waited, std::chrono::milliseconds(SerialHandler::SEND_TIMEOUT)) << "the writer should wake at the deadline";
+    brain.stop_writer_thread();
+}
+
+/** Writes a few bytes at a time to another transport, like a slow connection, so frames are split across writes. */
+class TrickleTransport : public Transport {
+public:
+    explicit TrickleTransport(Transport& inner) : inner(inner) {}
+
+    size_t read(const std::span<uint8_t> output, const unsigned int timeout) override {
+        return this->inner.read(output, timeout);
+    }
+
+    size_t write(const std::span<const uint8_t> bytes, const unsigned int timeout) override {
+        const size_t written = this->inner.write(bytes.first(std::min<size_t>(bytes.size(), 5)), timeout);
+        // Give other writers a chance to slip in between the pieces of a frame
+        std::this_thread::yield();
+        return written;
+    }
+
+private:
+    Transport& inner;
+};
+
+// test that send, send_buffered and the writer thread take turns writing, so partial writes never mix frames together
+TEST(TransportTest, WritersTakeTurnsOnPartialWrites) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    TrickleTransport trickle{brain_side};
+    SerialHandler brain{trickle};
+    SerialHandler pi{pi_side};
+    brain.set_send_flush_deadline(1000);
+    ASSERT_TRUE(brain.start_writer_thread());
+    constexpr int COUNT = 200;
+
+    // every packet carries the same value in each field, so a frame mixed with another one is noticed
+    std::atomic<int> optical{0};
+    std::atomic<int> text{0};
+    std::atomic<int> corrupt{0};
+    pi.add_listener<OpticalPacket>([&](SerialHandler&, const OpticalPacket::Data& data) {
+        (data.x == data.y && data.y == data.heading ? optical : corrupt)++;
+    });
+    pi.add_listener<TextPacket>([&](SerialHandler&, const TextPacket::Data& data) {
+        (std::string_view{data.text.data()} == "the quick brown fox jumps over the lazy dog" ? text : corrupt)++;
+    });
+
+    // the reader thread keeps draining the connection, so no sender blocks on it even if packets go missing
+    ASSERT_TRUE(pi.start_reader_thread());
+    std::atomic<int> finished{0};
+    std::thread async_sender{[&brain, &finished] {
+        for (int i = 0; i < COUNT; i++) {
+            while (!brain.send_async(OpticalPacket{i * 1.0, i * 1.0, i * 1.0})) std::this_thread::yield();
+        }
+        finished++;
+    }};
+    std::thread buffered_sender{[&brain, &finished] {
+        for (int i = 0; i < COUNT; i++) brain.send_buffered(OpticalPacket{-i * 1.0, -i * 1.0, -i * 1.0});
+        finished++;
+    }};
+    std::thread sender{[&brain, &finished] {
+        for (int i = 0; i < COUNT; i++) brain.send(TextPacket{"the quick brown fox jumps over the lazy dog"});
+        finished++;
+    }};
+
+    // wait for every sender to finish and every packet to arrive, flushing the last buffered packets once they're done
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+    while ((finished < 3 || optical < COUNT * 2 || text < COUNT) && std::chrono::steady_clock::now() < deadline) {
+        pi.process_incoming();
+        if (finished == 3) brain.flush();
+    }
+    async_sender.join();
+    buffered_sender.join();
+    sender.join();
+    pi.stop_reader_thread();
+    brain.stop_writer_thread();
+
+    EXPECT_EQ(optical.load(), COUNT * 2);
+    EXPECT_EQ(text.load(), COUNT);
+    EXPECT_EQ(corrupt.load(), 0);
+    EXPECT_EQ(brain.send_stats().dropped_bytes, 0);
+    EXPECT_GT(brain.send_stats().partial_writes, 0);
+}
+
+// test adding and removing a listener over and over while another thread receives the packet it listens for
+TEST(TransportTest, RemoveListenerWhileReceiving) {
+    auto [brain_side, pi_side] = LoopbackTransport::pair();
+    SerialHandler brain{brain_side};
+    SerialHandler pi{pi_side};
+    constexpr size_t COUNT = 2000;
+
+    std::atomic<bool> done{false};
+    std::thread receiver{[&] {
+        size_t received = 0;
+        while (received < COUNT) {
+            brain.send(OpticalPacket{1, 2, 3});
+            received += pi.receive_all();
+        }
+        done = true;
+    }};
+
+    // each listener owns memory that removing it frees, so calling one that was already destroyed is a use after free
+    std::atomic<size_t> calls{0};
+    while (!done) {
+        pi.add_listener<OpticalPacket>([&calls, owned = std::make_shared<int>(3)](SerialHandler&, const OpticalPacket::Data& data) {
+            if (data.heading == *owned)
+                calls++;
+        });
+        std::this_thread::yield();
+        EXPECT_TRUE(pi.remove_listener<OpticalPacket>());
+    }
+    receiver.join();
+    EXPECT_GT(calls.load(), 0);
+
+    SerialHandler::Listener empty;
+    EXPECT_THROW(empty(pi, {}), std::bad_function_call) << "an empty listener should throw instead of crashing";
+}
+
+// test that a capture replays the same packets in the same read chunks, as fast as possible or with the original timing
+TEST(TransportTest, CaptureReplay) {
+    const std::string path = testing::TempDir() + "capture_replay.cap";
+    std::vector<size_t> chunk_sizes;
+    {
+        auto [brain_side, pi_side] = LoopbackTransport::pair();
+        CaptureTransport capture{pi_side, path.c_str(), true};
+        ASSERT_TRUE(capture.capturing());
+        SerialHandler brain{brain_side};
+        SerialHandler pi{capture};
+
+        // one packet per read, then three in one read, then a gap before the last one
+        brain.send(OpticalPacket{1, 2, 3});
+        pi.receive_all();
+        for (int i = 0; i < 3; i++) {
+            brain.send_buffered(OpticalPacket{i * 1.0, 0, 0});
+        }
+        brain.flush();
+        pi.receive_all();
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        brain.send(TextPacket{"last"});
+        pi.receive_all();
+        pi.send(OpticalPacket{4, 5, 6}); // writes are recorded but not replayed
+    }
+
+    auto replay = ReplayTransport::open(path.c_str(), ReplayTransport::Timing::FAST);
+    ASSERT_NE(replay, std::nullopt);
+    SerialHandler handler{*replay};
+    std::vector<size_t> received;
+    while (!replay->finished()) {
+        received.push_back(handler.receive_all());
+    }
+    EXPECT_EQ(received, (std::vector<size_t>{1, 3, 1}));
+    EXPECT_EQ(handler.pop_latest<OpticalPacket>()->get_data<OpticalPacket>().x, 2);
+    EXPECT_EQ(handler.pop_latest<TextPacket>()->get_text(), "last");
+
+    // the original timing keeps the gap before the last packet, and a shorter timeout gives up like a live read
+    auto timed = ReplayTransport::open(path.c_str(), ReplayTransport::Timing::ORIGINAL);
+    ASSERT_NE(timed, std::nullopt);
+    std::array<uint8_t, 256> bytes;
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_GT(timed->read(bytes, 0), 0);
+    EXPECT_GT(timed->read(bytes, 0), 0);
+    EXPECT_EQ(timed->read(bytes, 1), 0);
+    EXPECT_GT(timed->read(bytes, 0), 0);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(25));
+    EXPECT_TRUE(timed->finished());
+
+    EXPECT_EQ(ReplayTransport::from_bytes({'n', 'o', 'p', 'e', 1}, ReplayTransport::Timing::FAST), std::nullopt);
+}